@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "bufpool.h"
+#include "qdl.h"
+
+/*
+ * The buffer pool holds the payload sized buffers of a session, carved out
+ * of one allocation made when the session starts, backed by 2 MiB huge pages
+ * when the system provides them.
+ *
+ * Buffers are lent out by bufpool_get() with a single reference; each stage
+ * that needs the data beyond the lender's use of it, e.g. a hashing job
+ * running on a worker, takes its own reference with bufpool_ref(). The
+ * buffer returns to the pool when the last reference is dropped.
+ */
+#define BUFPOOL_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+struct bufpool {
+	void *base;
+	size_t map_len;
+	size_t size;
+	size_t stride;
+	unsigned count;
+	bool huge;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	unsigned *refs;
+	unsigned *free;
+	unsigned nfree;
+
+	/* statistics */
+	unsigned long gets;
+	unsigned long waits;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t in_use_sum;
+	unsigned in_use_peak;
+};
+
+static struct bufpool *bufpool;
+
+static uint64_t bufpool_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * bufpool_create() - allocate the session's buffer pool
+ * @size:	size of each buffer
+ * @count:	number of buffers
+ */
+void bufpool_create(size_t size, unsigned count)
+{
+	struct bufpool *pool;
+	unsigned i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		err(1, "failed to allocate buffer pool");
+
+	/* Keep every buffer page aligned, as required by direct I/O */
+	pool->size = size;
+	pool->stride = (size + 4095) & ~(size_t)4095;
+	pool->count = count;
+	pool->map_len = (pool->stride * count + BUFPOOL_HUGE_PAGE_SIZE - 1) &
+			~(size_t)(BUFPOOL_HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+	pool->base = mmap(NULL, pool->map_len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	pool->huge = pool->base != MAP_FAILED;
+#else
+	pool->base = MAP_FAILED;
+#endif
+	if (pool->base == MAP_FAILED) {
+		/* No reserved huge pages, ask for transparent ones instead */
+		pool->base = mmap(NULL, pool->map_len, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pool->base == MAP_FAILED)
+			err(1, "failed to allocate buffer pool");
+#ifdef MADV_HUGEPAGE
+		madvise(pool->base, pool->map_len, MADV_HUGEPAGE);
+#endif
+	}
+
+	pool->refs = calloc(count, sizeof(*pool->refs));
+	pool->free = calloc(count, sizeof(*pool->free));
+	if (!pool->refs || !pool->free)
+		err(1, "failed to allocate buffer pool");
+
+	for (i = 0; i < count; i++)
+		pool->free[i] = count - i - 1;
+	pool->nfree = count;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	bufpool = pool;
+}
+
+/**
+ * bufpool_destroy() - free the session's buffer pool
+ *
+ * All buffers must have been returned to the pool. Statistics of the pool's
+ * use are printed in debug mode.
+ */
+void bufpool_destroy(void)
+{
+	struct bufpool *pool = bufpool;
+
+	if (!pool)
+		return;
+
+	if (qdl_debug && pool->gets) {
+		fprintf(stderr, "[POOL] %u buffers of %zu bytes on %s pages, %u in use at peak, %.1f on average\n",
+			pool->count, pool->size, pool->huge ? "huge" : "regular",
+			pool->in_use_peak, (double)pool->in_use_sum / pool->gets);
+		fprintf(stderr, "[POOL] %lu loans, %lu waited %.3f ms in total, %.3f ms at most\n",
+			pool->gets, pool->waits, pool->wait_ns / 1e6, pool->max_wait_ns / 1e6);
+	}
+
+	munmap(pool->base, pool->map_len);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->refs);
+	free(pool->free);
+	free(pool);
+
+	bufpool = NULL;
+}
+
+/**
+ * bufpool_size() - size of the pool's buffers
+ *
+ * Return: buffer size, or 0 if no pool has been created
+ */
+size_t bufpool_size(void)
+{
+	return bufpool ? bufpool->size : 0;
+}
+
+/**
+ * bufpool_index() - index of a buffer in the pool
+ * @buf:	pointer into a buffer
+ *
+ * Return: index of the buffer, or -1 if @buf doesn't belong to the pool
+ */
+int bufpool_index(const void *buf)
+{
+	struct bufpool *pool = bufpool;
+	uintptr_t offset;
+
+	if (!pool || (uintptr_t)buf < (uintptr_t)pool->base)
+		return -1;
+
+	offset = (uintptr_t)buf - (uintptr_t)pool->base;
+	if (offset >= pool->stride * pool->count)
+		return -1;
+
+	return offset / pool->stride;
+}
+
+/**
+ * bufpool_buf() - buffer at an index of the pool
+ * @index:	index of the buffer
+ *
+ * Return: the buffer
+ */
+void *bufpool_buf(unsigned index)
+{
+	return (char *)bufpool->base + (size_t)index * bufpool->stride;
+}
+
+/**
+ * bufpool_count() - number of buffers in the pool
+ *
+ * Return: number of buffers, or 0 if no pool has been created
+ */
+unsigned bufpool_count(void)
+{
+	return bufpool ? bufpool->count : 0;
+}
+
+/**
+ * bufpool_get() - borrow a buffer from the pool
+ *
+ * Waits for a buffer to be returned if all of them are lent out.
+ *
+ * Return: buffer, holding a single reference
+ */
+void *bufpool_get(void)
+{
+	struct bufpool *pool = bufpool;
+	uint64_t start;
+	uint64_t wait;
+	unsigned in_use;
+	unsigned idx;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->nfree) {
+		start = bufpool_now();
+		while (!pool->nfree)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		wait = bufpool_now() - start;
+
+		pool->waits++;
+		pool->wait_ns += wait;
+		if (wait > pool->max_wait_ns)
+			pool->max_wait_ns = wait;
+	}
+
+	idx = pool->free[--pool->nfree];
+	pool->refs[idx] = 1;
+
+	in_use = pool->count - pool->nfree;
+	pool->gets++;
+	pool->in_use_sum += in_use;
+	if (in_use > pool->in_use_peak)
+		pool->in_use_peak = in_use;
+	pthread_mutex_unlock(&pool->lock);
+
+	return bufpool_buf(idx);
+}
+
+/**
+ * bufpool_ref() - take another reference to a borrowed buffer
+ * @buf:	pointer into the buffer, ignored if not part of the pool
+ */
+void bufpool_ref(const void *buf)
+{
+	int idx = bufpool_index(buf);
+
+	if (idx < 0)
+		return;
+
+	pthread_mutex_lock(&bufpool->lock);
+	bufpool->refs[idx]++;
+	pthread_mutex_unlock(&bufpool->lock);
+}
+
+/**
+ * bufpool_put() - drop a reference to a borrowed buffer
+ * @buf:	pointer into the buffer, ignored if not part of the pool
+ *
+ * The buffer returns to the pool when its last reference is dropped.
+ */
+void bufpool_put(const void *buf)
+{
+	int idx = bufpool_index(buf);
+
+	if (idx < 0)
+		return;
+
+	pthread_mutex_lock(&bufpool->lock);
+	if (!--bufpool->refs[idx]) {
+		bufpool->free[bufpool->nfree++] = idx;
+		pthread_cond_signal(&bufpool->cond);
+	}
+	pthread_mutex_unlock(&bufpool->lock);
+}
@@ -0,0 +1,16 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+void bufpool_create(size_t size, unsigned count);
+void bufpool_destroy(void);
+size_t bufpool_size(void);
+unsigned bufpool_count(void);
+int bufpool_index(const void *buf);
+void *bufpool_buf(unsigned index);
+void *bufpool_get(void);
+void bufpool_ref(const void *buf);
+void bufpool_put(const void *buf);
+
+#endif
@@ -0,0 +1,862 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+#include "worker.h"
+
+/*
+ * Compressed images are expanded in memory while they are read, so that
+ * program entries can refer to .gz, .xz and .zst files directly. The format
+ * is recognized by its magic, regardless of the file name, and each format
+ * is available when qdl is built with the respective library.
+ *
+ * zstd images made of multiple frames of known size, such as those written
+ * in the seekable format, are expanded one frame per job on a pool of
+ * worker threads, a window of frames ahead of the reader. The window is
+ * bounded by the number of CPUs and by DECOMPRESS_SLOTS_BUDGET.
+ */
+#define DECOMPRESS_IN_SIZE	(1024 * 1024)
+
+/* Larger frames are expanded by the reader, as a stream */
+#define DECOMPRESS_FRAME_MAX	(64 * 1024 * 1024)
+
+/* Memory the frames expanded ahead of the reader may take, per image */
+#define DECOMPRESS_SLOTS_BUDGET	(256 * 1024 * 1024)
+
+#ifdef HAVE_ZSTD
+struct decompress_frame {
+	const void *data;
+	size_t data_len;
+	size_t len;
+};
+
+struct decompress_slot {
+	struct decompress *dc;
+	unsigned frame;
+
+	void *buf;
+	size_t size;
+	size_t pos;
+
+	bool done;
+	int error;
+};
+#endif
+
+struct decompress {
+	enum decompress_format format;
+
+	int fd;
+	off_t in_offset;
+	uint8_t *in;
+	size_t in_len;
+	size_t in_pos;
+	bool in_eof;
+
+	/* a gzip member or zstd frame is only partially decoded */
+	bool partial;
+	bool end;
+
+#ifdef HAVE_ZLIB
+	z_stream zlib;
+#endif
+#ifdef HAVE_LZMA
+	lzma_stream lzma;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zstd;
+
+	/* frames expanded by the worker pool */
+	void *map;
+	size_t map_len;
+	struct decompress_frame *frames;
+	unsigned nframes;
+	unsigned next;
+	unsigned cur;
+
+	struct decompress_slot *slots;
+	unsigned nslots;
+	struct worker_pool *pool;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+/*
+ * The expanded sizes of the images of the session, as each is asked for by
+ * every pass over the program entries
+ */
+struct decompress_size {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	uint64_t expanded;
+
+	struct decompress_size *next;
+};
+
+static struct decompress_size *decompress_sizes;
+
+/**
+ * decompress_detect() - detect the compression of a file
+ * @fd:		file descriptor of the file
+ *
+ * Return: the compression format, DECOMPRESS_NONE for uncompressed files
+ */
+enum decompress_format decompress_detect(int fd)
+{
+	static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+	static const uint8_t xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+	static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+	uint8_t magic[6];
+	ssize_t n;
+
+	n = pread(fd, magic, sizeof(magic), 0);
+	if (n < (ssize_t)sizeof(magic))
+		return DECOMPRESS_NONE;
+
+	if (!memcmp(magic, gzip_magic, sizeof(gzip_magic)))
+		return DECOMPRESS_GZIP;
+	if (!memcmp(magic, xz_magic, sizeof(xz_magic)))
+		return DECOMPRESS_XZ;
+	if (!memcmp(magic, zstd_magic, sizeof(zstd_magic)))
+		return DECOMPRESS_ZSTD;
+
+	return DECOMPRESS_NONE;
+}
+
+const char *decompress_name(enum decompress_format format)
+{
+	switch (format) {
+	case DECOMPRESS_GZIP:
+		return "gzip";
+	case DECOMPRESS_XZ:
+		return "xz";
+	case DECOMPRESS_ZSTD:
+		return "zstd";
+	default:
+		return "none";
+	}
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+static int decompress_input(struct decompress *dc)
+{
+	ssize_t n;
+
+	if (dc->in_pos < dc->in_len || dc->in_eof)
+		return 0;
+
+	do {
+		n = pread(dc->fd, dc->in, DECOMPRESS_IN_SIZE, dc->in_offset);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -errno;
+
+	dc->in_eof = !n;
+	dc->in_len = n;
+	dc->in_pos = 0;
+	dc->in_offset += n;
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static int decompress_gzip_open(struct decompress *dc)
+{
+	/* Accept gzip headers only, concatenated members are decoded in turn */
+	if (inflateInit2(&dc->zlib, 16 + MAX_WBITS) != Z_OK)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static ssize_t decompress_gzip_read(struct decompress *dc, void *buf, size_t len)
+{
+	z_stream *zs = &dc->zlib;
+	int ret;
+
+	zs->next_out = buf;
+	zs->avail_out = len;
+
+	while (zs->avail_out) {
+		ret = decompress_input(dc);
+		if (ret < 0)
+			return ret;
+
+		zs->next_in = dc->in + dc->in_pos;
+		zs->avail_in = dc->in_len - dc->in_pos;
+		if (!zs->avail_in && !dc->partial)
+			break;
+
+		ret = inflate(zs, Z_NO_FLUSH);
+		dc->in_pos = dc->in_len - zs->avail_in;
+
+		if (ret == Z_STREAM_END) {
+			inflateReset(zs);
+			dc->partial = false;
+		} else if (ret == Z_OK) {
+			dc->partial = true;
+		} else {
+			/* Corrupt, or truncated when no progress can be made */
+			return -EINVAL;
+		}
+	}
+
+	return len - zs->avail_out;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int decompress_xz_open(struct decompress *dc)
+{
+	lzma_stream init = LZMA_STREAM_INIT;
+
+	dc->lzma = init;
+	if (lzma_stream_decoder(&dc->lzma, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static ssize_t decompress_xz_read(struct decompress *dc, void *buf, size_t len)
+{
+	lzma_stream *ls = &dc->lzma;
+	lzma_ret ret;
+	int error;
+
+	ls->next_out = buf;
+	ls->avail_out = len;
+
+	while (ls->avail_out && !dc->end) {
+		error = decompress_input(dc);
+		if (error < 0)
+			return error;
+
+		ls->next_in = dc->in + dc->in_pos;
+		ls->avail_in = dc->in_len - dc->in_pos;
+
+		ret = lzma_code(ls, ls->avail_in ? LZMA_RUN : LZMA_FINISH);
+		dc->in_pos = dc->in_len - ls->avail_in;
+
+		if (ret == LZMA_STREAM_END)
+			dc->end = true;
+		else if (ret != LZMA_OK)
+			return -EINVAL;
+	}
+
+	return len - ls->avail_out;
+}
+
+/* The expanded size of a single stream file, from the index at its end */
+static int decompress_xz_size(int fd, off_t file_size, uint64_t *size)
+{
+	uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+	uint64_t memlimit = UINT64_MAX;
+	lzma_index *index = NULL;
+	lzma_stream_flags flags;
+	uint8_t *buf;
+	size_t pos = 0;
+	lzma_ret ret;
+
+	if (file_size < 2 * LZMA_STREAM_HEADER_SIZE)
+		return -EINVAL;
+
+	if (pread(fd, footer, sizeof(footer), file_size - sizeof(footer)) != sizeof(footer))
+		return -EINVAL;
+
+	if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK ||
+	    flags.backward_size > (lzma_vli)file_size - 2 * LZMA_STREAM_HEADER_SIZE)
+		return -EINVAL;
+
+	buf = malloc(flags.backward_size);
+	if (!buf)
+		return -ENOMEM;
+
+	if (pread(fd, buf, flags.backward_size,
+		  file_size - sizeof(footer) - flags.backward_size) != (ssize_t)flags.backward_size) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	ret = lzma_index_buffer_decode(&index, &memlimit, NULL, buf, &pos, flags.backward_size);
+	free(buf);
+	if (ret != LZMA_OK)
+		return -EINVAL;
+
+	/* Concatenated streams, or padding, leave the index short of the file */
+	if (lzma_index_file_size(index) != (lzma_vli)file_size) {
+		lzma_index_end(index, NULL);
+		return -EINVAL;
+	}
+
+	*size = lzma_index_uncompressed_size(index);
+	lzma_index_end(index, NULL);
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd_open(struct decompress *dc)
+{
+	dc->zstd = ZSTD_createDStream();
+	if (!dc->zstd)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static ssize_t decompress_zstd_read(struct decompress *dc, void *buf, size_t len)
+{
+	ZSTD_outBuffer out = { buf, len, 0 };
+	ZSTD_inBuffer in;
+	size_t before;
+	size_t ret;
+	int error;
+
+	while (out.pos < out.size) {
+		error = decompress_input(dc);
+		if (error < 0)
+			return error;
+
+		in.src = dc->in;
+		in.size = dc->in_len;
+		in.pos = dc->in_pos;
+		if (in.pos == in.size && !dc->partial)
+			break;
+
+		before = out.pos;
+		ret = ZSTD_decompressStream(dc->zstd, &out, &in);
+		dc->in_pos = in.pos;
+		if (ZSTD_isError(ret))
+			return -EINVAL;
+
+		dc->partial = ret != 0;
+
+		/* Truncated, the frame can't be completed */
+		if (dc->in_eof && in.pos == in.size && out.pos == before && dc->partial)
+			return -EINVAL;
+	}
+
+	return out.pos;
+}
+
+/*
+ * Index the frames of a zstd image, succeeding only if the size of every
+ * frame is known and small enough to be expanded in one go.
+ */
+static int decompress_zstd_index(int fd, off_t file_size, void **map,
+				 struct decompress_frame **frames, unsigned *nframes)
+{
+	struct decompress_frame *list = NULL;
+	struct decompress_frame *frame;
+	unsigned long long len;
+	const uint8_t *data;
+	unsigned size = 0;
+	unsigned n = 0;
+	uint32_t magic;
+	size_t off = 0;
+	size_t count;
+	void *ptr;
+
+	ptr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		return -errno;
+
+	while (off < (size_t)file_size) {
+		data = (const uint8_t *)ptr + off;
+
+		count = ZSTD_findFrameCompressedSize(data, file_size - off);
+		if (ZSTD_isError(count))
+			goto invalid;
+
+		/* Skippable frames, e.g. the seek table, carry no image data */
+		memcpy(&magic, data, sizeof(magic));
+		if ((magic & 0xfffffff0) == ZSTD_MAGIC_SKIPPABLE_START) {
+			off += count;
+			continue;
+		}
+
+		len = ZSTD_getFrameContentSize(data, count);
+		if (len == ZSTD_CONTENTSIZE_UNKNOWN || len == ZSTD_CONTENTSIZE_ERROR ||
+		    len > DECOMPRESS_FRAME_MAX)
+			goto invalid;
+
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			frame = realloc(list, size * sizeof(*list));
+			if (!frame)
+				goto invalid;
+			list = frame;
+		}
+
+		frame = &list[n++];
+		frame->data = data;
+		frame->data_len = count;
+		frame->len = len;
+
+		off += count;
+	}
+
+	*map = ptr;
+	*frames = list;
+	*nframes = n;
+
+	return 0;
+
+invalid:
+	free(list);
+	munmap(ptr, file_size);
+	return -EINVAL;
+}
+
+static void decompress_zstd_frame(void *data)
+{
+	struct decompress_slot *slot = data;
+	struct decompress *dc = slot->dc;
+	const struct decompress_frame *frame = &dc->frames[slot->frame];
+	size_t n;
+
+	n = ZSTD_decompress(slot->buf, frame->len, frame->data, frame->data_len);
+
+	pthread_mutex_lock(&dc->lock);
+	slot->error = ZSTD_isError(n) || n != frame->len ? -EINVAL : 0;
+	slot->done = true;
+	pthread_cond_broadcast(&dc->cond);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+static void decompress_zstd_submit(struct decompress *dc, struct decompress_slot *slot)
+{
+	size_t len = dc->frames[dc->next].len;
+
+	if (slot->size < len) {
+		free(slot->buf);
+		slot->buf = malloc(len);
+		if (!slot->buf)
+			err(1, "failed to allocate decompression buffer");
+		slot->size = len;
+	}
+
+	slot->frame = dc->next++;
+	slot->pos = 0;
+	slot->done = false;
+
+	worker_pool_submit(dc->pool, decompress_zstd_frame, slot);
+}
+
+static int decompress_zstd_parallel_open(struct decompress *dc, off_t file_size)
+{
+	size_t largest = 1;
+	unsigned budget;
+	long ncpus;
+	unsigned i;
+	int ret;
+
+	ret = decompress_zstd_index(dc->fd, file_size, &dc->map, &dc->frames, &dc->nframes);
+	if (ret < 0)
+		return ret;
+
+	if (dc->nframes < 2) {
+		free(dc->frames);
+		dc->frames = NULL;
+		munmap(dc->map, file_size);
+		dc->map = NULL;
+		return -EINVAL;
+	}
+
+	dc->map_len = file_size;
+
+	/* Each slot may end up holding the largest frame */
+	for (i = 0; i < dc->nframes; i++) {
+		if (dc->frames[i].len > largest)
+			largest = dc->frames[i].len;
+	}
+
+	budget = DECOMPRESS_SLOTS_BUDGET / largest;
+	if (!budget)
+		budget = 1;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	dc->nslots = 2 * (ncpus > 0 ? ncpus : 1);
+	if (dc->nslots > budget)
+		dc->nslots = budget;
+	if (dc->nslots > dc->nframes)
+		dc->nslots = dc->nframes;
+
+	dc->slots = calloc(dc->nslots, sizeof(*dc->slots));
+	if (!dc->slots)
+		err(1, "failed to allocate decompression slots");
+
+	pthread_mutex_init(&dc->lock, NULL);
+	pthread_cond_init(&dc->cond, NULL);
+
+	dc->pool = worker_pool_create(0);
+
+	for (i = 0; i < dc->nslots; i++) {
+		dc->slots[i].dc = dc;
+		decompress_zstd_submit(dc, &dc->slots[i]);
+	}
+
+	return 0;
+}
+
+static ssize_t decompress_zstd_parallel_read(struct decompress *dc, void *buf, size_t len)
+{
+	struct decompress_slot *slot;
+	size_t done = 0;
+	size_t frame_len;
+	size_t n;
+
+	while (done < len && dc->cur < dc->nframes) {
+		slot = &dc->slots[dc->cur % dc->nslots];
+
+		pthread_mutex_lock(&dc->lock);
+		while (!slot->done)
+			pthread_cond_wait(&dc->cond, &dc->lock);
+		pthread_mutex_unlock(&dc->lock);
+
+		if (slot->error)
+			return slot->error;
+
+		frame_len = dc->frames[slot->frame].len;
+		n = frame_len - slot->pos < len - done ? frame_len - slot->pos : len - done;
+		memcpy((uint8_t *)buf + done, (uint8_t *)slot->buf + slot->pos, n);
+		slot->pos += n;
+		done += n;
+
+		/* Hand the slot to the next frame, once this one is consumed */
+		if (slot->pos == frame_len) {
+			dc->cur++;
+			if (dc->next < dc->nframes)
+				decompress_zstd_submit(dc, slot);
+		}
+	}
+
+	return done;
+}
+
+static void decompress_zstd_parallel_close(struct decompress *dc)
+{
+	unsigned i;
+
+	worker_pool_wait(dc->pool);
+	worker_pool_destroy(dc->pool);
+
+	for (i = 0; i < dc->nslots; i++)
+		free(dc->slots[i].buf);
+	free(dc->slots);
+	free(dc->frames);
+	munmap(dc->map, dc->map_len);
+
+	pthread_cond_destroy(&dc->cond);
+	pthread_mutex_destroy(&dc->lock);
+}
+#endif
+
+/**
+ * decompress_open() - start expanding a compressed image
+ * @fd:		file descriptor of the compressed file
+ *
+ * Return: decompressor, or NULL with errno set on failure, ENOTSUP if the
+ * format isn't supported by this build
+ */
+struct decompress *decompress_open(int fd)
+{
+	struct decompress *dc;
+	struct stat sb;
+	int ret = -ENOTSUP;
+
+	if (fstat(fd, &sb) < 0)
+		return NULL;
+
+	dc = calloc(1, sizeof(*dc));
+	if (!dc) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	dc->format = decompress_detect(fd);
+	dc->fd = fd;
+
+	switch (dc->format) {
+	case DECOMPRESS_GZIP:
+#ifdef HAVE_ZLIB
+		ret = decompress_gzip_open(dc);
+#endif
+		break;
+	case DECOMPRESS_XZ:
+#ifdef HAVE_LZMA
+		ret = decompress_xz_open(dc);
+#endif
+		break;
+	case DECOMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+		if (!decompress_zstd_parallel_open(dc, sb.st_size))
+			return dc;
+
+		ret = decompress_zstd_open(dc);
+#endif
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (!ret) {
+		dc->in = malloc(DECOMPRESS_IN_SIZE);
+		if (dc->in)
+			return dc;
+
+		ret = -ENOMEM;
+	}
+
+	decompress_close(dc);
+	errno = -ret;
+
+	return NULL;
+}
+
+/**
+ * decompress_read() - read the next part of the expanded image
+ * @dc:		decompressor
+ * @buf:	buffer to read into
+ * @len:	number of bytes to read
+ *
+ * Return: number of bytes read, short only at the end of the image, or
+ * negative errno on failure
+ */
+ssize_t decompress_read(struct decompress *dc, void *buf, size_t len)
+{
+	switch (dc->format) {
+#ifdef HAVE_ZLIB
+	case DECOMPRESS_GZIP:
+		return decompress_gzip_read(dc, buf, len);
+#endif
+#ifdef HAVE_LZMA
+	case DECOMPRESS_XZ:
+		return decompress_xz_read(dc, buf, len);
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		if (dc->pool)
+			return decompress_zstd_parallel_read(dc, buf, len);
+		return decompress_zstd_read(dc, buf, len);
+#endif
+	default:
+		return -ENOTSUP;
+	}
+}
+
+/**
+ * decompress_skip() - discard the next part of the expanded image
+ * @dc:		decompressor
+ * @len:	number of bytes to discard
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int decompress_skip(struct decompress *dc, uint64_t len)
+{
+	ssize_t n;
+	void *buf;
+
+	if (!len)
+		return 0;
+
+	buf = malloc(DECOMPRESS_IN_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	while (len) {
+		n = decompress_read(dc, buf, len < DECOMPRESS_IN_SIZE ? len : DECOMPRESS_IN_SIZE);
+		if (n <= 0)
+			break;
+
+		len -= n;
+	}
+
+	free(buf);
+
+	return n < 0 ? n : 0;
+}
+
+void decompress_close(struct decompress *dc)
+{
+	if (!dc)
+		return;
+
+	switch (dc->format) {
+#ifdef HAVE_ZLIB
+	case DECOMPRESS_GZIP:
+		inflateEnd(&dc->zlib);
+		break;
+#endif
+#ifdef HAVE_LZMA
+	case DECOMPRESS_XZ:
+		lzma_end(&dc->lzma);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		if (dc->pool)
+			decompress_zstd_parallel_close(dc);
+		ZSTD_freeDStream(dc->zstd);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	free(dc->in);
+	free(dc);
+}
+
+/**
+ * decompress_size() - get the expanded size of a compressed image
+ * @fd:		file descriptor of the compressed file
+ * @size:	expanded size of the image
+ *
+ * The size is read from the image's index when the format has one, or
+ * otherwise found by expanding the image. Either way it's kept, keyed by the
+ * identity and modification time of the file, for the rest of the session.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int decompress_size(int fd, uint64_t *size)
+{
+	struct decompress_size *entry;
+	struct decompress *dc;
+	struct stat sb;
+	uint64_t total = 0;
+	bool known = false;
+	ssize_t n;
+	void *buf;
+
+	if (fstat(fd, &sb) < 0)
+		return -errno;
+
+	for (entry = decompress_sizes; entry; entry = entry->next) {
+		if (entry->dev == sb.st_dev && entry->ino == sb.st_ino &&
+		    entry->size == sb.st_size &&
+		    entry->mtime.tv_sec == sb.st_mtim.tv_sec &&
+		    entry->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+			*size = entry->expanded;
+			return 0;
+		}
+	}
+
+	switch (decompress_detect(fd)) {
+#ifdef HAVE_LZMA
+	case DECOMPRESS_XZ:
+		known = !decompress_xz_size(fd, sb.st_size, &total);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD: {
+		struct decompress_frame *frames;
+		unsigned nframes;
+		unsigned i;
+		void *map;
+
+		if (!decompress_zstd_index(fd, sb.st_size, &map, &frames, &nframes)) {
+			for (i = 0; i < nframes; i++)
+				total += frames[i].len;
+			known = true;
+
+			free(frames);
+			munmap(map, sb.st_size);
+		}
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+
+	if (!known) {
+		dc = decompress_open(fd);
+		if (!dc)
+			return -errno;
+
+		buf = malloc(DECOMPRESS_IN_SIZE);
+		if (!buf) {
+			decompress_close(dc);
+			return -ENOMEM;
+		}
+
+		while ((n = decompress_read(dc, buf, DECOMPRESS_IN_SIZE)) > 0)
+			total += n;
+
+		free(buf);
+		decompress_close(dc);
+
+		if (n < 0)
+			return n;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry) {
+		entry->dev = sb.st_dev;
+		entry->ino = sb.st_ino;
+		entry->size = sb.st_size;
+		entry->mtime = sb.st_mtim;
+		entry->expanded = total;
+		entry->next = decompress_sizes;
+		decompress_sizes = entry;
+	}
+
+	*size = total;
+
+	return 0;
+}
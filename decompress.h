@@ -0,0 +1,24 @@
+#ifndef __DECOMPRESS_H__
+#define __DECOMPRESS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+enum decompress_format {
+	DECOMPRESS_NONE,
+	DECOMPRESS_GZIP,
+	DECOMPRESS_XZ,
+	DECOMPRESS_ZSTD,
+};
+
+struct decompress;
+
+enum decompress_format decompress_detect(int fd);
+const char *decompress_name(enum decompress_format format);
+int decompress_size(int fd, uint64_t *size);
+struct decompress *decompress_open(int fd);
+ssize_t decompress_read(struct decompress *dc, void *buf, size_t len);
+int decompress_skip(struct decompress *dc, uint64_t len);
+void decompress_close(struct decompress *dc);
+
+#endif
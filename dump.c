@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dump.h"
+#include "program.h"
+#include "qdl.h"
+#include "sparse.h"
+
+/* Granularity of the zero detection used to punch holes in raw dumps */
+#define DUMP_HOLE_SIZE	4096
+
+struct dump_sink {
+	int fd;
+	bool direct;
+	off_t offset;
+
+	struct sparse_writer *sparse;
+};
+
+static struct dump *dumps;
+static struct dump *dumps_last;
+
+/**
+ * dump_add() - add a region to be dumped
+ * @spec:	"<label>=<file>", "<lun>=<file>" or "<lun>:<start>:<count>=<file>"
+ * @sparse:	write the output as an Android sparse image
+ *
+ * Labels are resolved against the loaded program files when the dump is
+ * executed, a bare LUN dumps the entire physical partition.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int dump_add(const char *spec, bool sparse)
+{
+	struct dump *dump;
+	unsigned long start;
+	unsigned long count;
+	const char *eq;
+	char tmp[32];
+	char *target;
+	char *end;
+
+	eq = strchr(spec, '=');
+	if (!eq || eq == spec || !eq[1]) {
+		fprintf(stderr, "[DUMP] invalid dump \"%s\"\n", spec);
+		return -EINVAL;
+	}
+
+	dump = calloc(1, sizeof(struct dump));
+	target = strndup(spec, eq - spec);
+	dump->filename = strdup(eq + 1);
+	dump->sparse = sparse;
+
+	if (isdigit(target[0])) {
+		dump->partition = strtoul(target, &end, 10);
+		if (*end == ':') {
+			start = strtoul(end + 1, &end, 10);
+			if (*end != ':')
+				goto invalid;
+
+			count = strtoul(end + 1, &end, 10);
+			if (!count)
+				goto invalid;
+
+			snprintf(tmp, sizeof(tmp), "%lu", start);
+			dump->start_sector = strdup(tmp);
+			dump->num_sectors = count;
+		}
+
+		if (*end)
+			goto invalid;
+
+		free(target);
+	} else {
+		dump->label = target;
+	}
+
+	if (dumps) {
+		dumps_last->next = dump;
+		dumps_last = dump;
+	} else {
+		dumps = dump;
+		dumps_last = dump;
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "[DUMP] invalid dump \"%s\"\n", spec);
+	free(target);
+	free(dump);
+	return -EINVAL;
+}
+
+bool dump_need_execute(void)
+{
+	return !!dumps;
+}
+
+int dump_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct dump *dump))
+{
+	struct program *program;
+	struct dump *dump;
+	int ret;
+
+	for (dump = dumps; dump; dump = dump->next) {
+		if (dump->label) {
+			program = program_find_label(dump->label);
+			if (!program) {
+				fprintf(stderr, "[DUMP] no partition labeled \"%s\"\n", dump->label);
+				return -ENOENT;
+			}
+
+			if (!program->num_sectors) {
+				fprintf(stderr, "[DUMP] size of \"%s\" is unknown\n", dump->label);
+				return -EINVAL;
+			}
+
+			dump->partition = program->partition;
+			dump->start_sector = program->start_sector;
+			dump->num_sectors = program->num_sectors;
+			dump->sector_size = program->sector_size;
+		}
+
+		ret = apply(qdl, dump);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * dump_sink_open() - open the output file of a dump
+ * @dump:	dump to be written
+ * @sector_size: sector size of the dumped region
+ *
+ * Raw dumps are written using O_DIRECT, where supported, to keep multi
+ * gigabyte dumps out of the page cache; buffers passed to dump_sink_write()
+ * should therefore be page aligned.
+ *
+ * Return: dump sink, or NULL on failure
+ */
+struct dump_sink *dump_sink_open(struct dump *dump, unsigned sector_size)
+{
+	struct dump_sink *sink;
+	unsigned blk_sz;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	sink = calloc(1, sizeof(*sink));
+	if (!sink)
+		return NULL;
+
+#ifdef O_DIRECT
+	if (!dump->sparse) {
+		sink->fd = open(dump->filename, flags | O_DIRECT, 0644);
+		sink->direct = sink->fd >= 0;
+	}
+#endif
+	if (!sink->direct)
+		sink->fd = open(dump->filename, flags, 0644);
+
+	if (sink->fd < 0) {
+		fprintf(stderr, "[DUMP] unable to open %s\n", dump->filename);
+		free(sink);
+		return NULL;
+	}
+
+	if (dump->sparse) {
+		/* Use 4k blocks, unless the dump isn't 4k aligned */
+		blk_sz = 4096;
+		if ((uint64_t)dump->num_sectors * sector_size % blk_sz)
+			blk_sz = sector_size;
+
+		sink->sparse = sparse_writer_open(sink->fd, blk_sz);
+		if (!sink->sparse) {
+			close(sink->fd);
+			free(sink);
+			return NULL;
+		}
+	}
+
+	return sink;
+}
+
+static int dump_sink_pwrite(struct dump_sink *sink, const void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+#ifdef O_DIRECT
+	/* O_DIRECT requires aligned I/O, fall back for the unaligned tail */
+	if (sink->direct && ((offset | len | (uintptr_t)buf) & (DUMP_HOLE_SIZE - 1))) {
+		fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) & ~O_DIRECT);
+		sink->direct = false;
+	}
+#endif
+
+	while (len) {
+		n = pwrite(sink->fd, buf, len, offset);
+		if (n < 0)
+			return -errno;
+
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/**
+ * dump_sink_write() - append data to the dump
+ * @sink:	dump sink
+ * @buf:	data read from the device
+ * @len:	length of @buf
+ *
+ * All-zero blocks are not written, leaving holes in raw dumps and being
+ * encoded as fill chunks in sparse dumps.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int dump_sink_write(struct dump_sink *sink, const void *buf, size_t len)
+{
+	size_t run = 0;
+	size_t blk;
+	size_t i;
+	int ret;
+
+	if (sink->sparse) {
+		ret = sparse_writer_write(sink->sparse, buf, len);
+		sink->offset += len;
+		return ret;
+	}
+
+	for (i = 0; i < len; i += blk) {
+		blk = len - i < DUMP_HOLE_SIZE ? len - i : DUMP_HOLE_SIZE;
+
+		if (!is_zero_buffer(buf + i, blk)) {
+			run += blk;
+			continue;
+		}
+
+		if (run) {
+			ret = dump_sink_pwrite(sink, buf + i - run, run, sink->offset + i - run);
+			if (ret < 0)
+				return ret;
+			run = 0;
+		}
+	}
+
+	if (run) {
+		ret = dump_sink_pwrite(sink, buf + len - run, run, sink->offset + len - run);
+		if (ret < 0)
+			return ret;
+	}
+
+	sink->offset += len;
+
+	return 0;
+}
+
+/**
+ * dump_sink_close() - finalize and close the dump
+ * @sink:	dump sink, freed by this call
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int dump_sink_close(struct dump_sink *sink)
+{
+	int ret = 0;
+
+	if (sink->sparse)
+		ret = sparse_writer_close(sink->sparse);
+	else if (ftruncate(sink->fd, sink->offset) < 0)
+		ret = -errno;
+
+	close(sink->fd);
+	free(sink);
+
+	return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef __DUMP_H__
+#define __DUMP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct qdl_device;
+struct dump_sink;
+
+struct dump {
+	const char *filename;
+	const char *label;
+	unsigned partition;
+	const char *start_sector;
+	unsigned num_sectors;
+	unsigned sector_size;
+	bool sparse;
+
+	struct dump *next;
+};
+
+int dump_add(const char *spec, bool sparse);
+int dump_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct dump *dump));
+bool dump_need_execute(void);
+
+struct dump_sink *dump_sink_open(struct dump *dump, unsigned sector_size);
+int dump_sink_write(struct dump_sink *sink, const void *buf, size_t len);
+int dump_sink_close(struct dump_sink *sink);
+
+#endif
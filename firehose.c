@@ -37,19 +37,34 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include "bufpool.h"
+#include "decompress.h"
+#include "dump.h"
+#include "fsmap.h"
+#include "hashdb.h"
+#include "journal.h"
+#include "plan.h"
 #include "qdl.h"
+#include "sha256.h"
+#include "source.h"
+#include "sparse.h"
 #include "ufs.h"
+#include "vip.h"
+#include "worker.h"
+#include "xxhash.h"
 
 static void xml_setpropf(xmlNode *node, const char *attr, const char *fmt, ...)
 {
@@ -96,12 +111,124 @@ static xmlNode *firehose_response_parse(const void *buf, size_t len, int *error)
 	return node;
 }
 
+static uint8_t firehose_digest[SHA256_DIGEST_SIZE];
+static bool firehose_digest_valid;
+
+static int firehose_parse_digest(const char *s, uint8_t *digest)
+{
+	unsigned int byte;
+	int i;
+
+	while (isspace(*s))
+		s++;
+
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+		s += 2;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++, s += 2) {
+		if (!isxdigit(s[0]) || !isxdigit(s[1]))
+			return -EINVAL;
+
+		sscanf(s, "%2x", &byte);
+		digest[i] = byte;
+	}
+
+	return 0;
+}
+
+struct firehose_storage_info {
+	uint64_t total_blocks;
+	unsigned block_size;
+	unsigned num_physical;
+	char mem_type[16];
+
+	/* erased sectors of the partition read back as zeros */
+	bool erased_zero;
+};
+
+static struct firehose_storage_info firehose_storage_info;
+static bool firehose_storage_info_valid;
+
+static const char *storage_info_find(const char *s, const char *key)
+{
+	size_t len = strlen(key);
+
+	while ((s = strchr(s, '"')) != NULL) {
+		s++;
+		if (!strncmp(s, key, len) && s[len] == '"') {
+			s += len + 1;
+			while (*s == ' ' || *s == ':')
+				s++;
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * getstorageinfo reports its result as a log entry of the form:
+ * INFO: {"storage_info": {"total_blocks":..., "block_size":..., ...}}
+ */
+static void firehose_parse_storage_info(const char *value)
+{
+	struct firehose_storage_info *info = &firehose_storage_info;
+	const char *s;
+	size_t len;
+
+	s = storage_info_find(value, "total_blocks");
+	if (!s)
+		return;
+	info->total_blocks = strtoull(s, NULL, 10);
+
+	s = storage_info_find(value, "block_size");
+	info->block_size = s ? strtoul(s, NULL, 10) : 0;
+
+	s = storage_info_find(value, "num_physical");
+	info->num_physical = s ? strtoul(s, NULL, 10) : 0;
+
+	/* Reported by some programmers, after the TPRZ bit of UFS provisioning */
+	s = storage_info_find(value, "tprz");
+	info->erased_zero = s && (*s == '1' || !strncmp(s, "true", 4));
+
+	info->mem_type[0] = '\0';
+	s = storage_info_find(value, "mem_type");
+	if (s && *s == '"') {
+		s++;
+		len = strcspn(s, "\"");
+		if (len >= sizeof(info->mem_type))
+			len = sizeof(info->mem_type) - 1;
+		memcpy(info->mem_type, s, len);
+		info->mem_type[len] = '\0';
+	}
+
+	firehose_storage_info_valid = info->total_blocks && info->block_size;
+}
+
 static void firehose_response_log(xmlNode *node)
 {
 	xmlChar *value;
 
 	value = xmlGetProp(node, (xmlChar*)"value");
 	printf("LOG: %s\n", value);
+
+	/* getsha256digest reports its result as a "Digest <hex>" log entry */
+	if (value && !xmlStrncmp(value, (xmlChar*)"Digest ", 7))
+		firehose_digest_valid = !firehose_parse_digest((char*)value + 7, firehose_digest);
+	else if (value && xmlStrstr(value, (xmlChar*)"\"storage_info\""))
+		firehose_parse_storage_info((char*)value);
+}
+
+static bool firehose_response_rawmode(xmlNode *node)
+{
+	xmlChar *value;
+	bool rawmode;
+
+	value = xmlGetProp(node, (xmlChar*)"rawmode");
+	rawmode = value && !xmlStrcmp(value, (xmlChar*)"true");
+	xmlFree(value);
+
+	return rawmode;
 }
 
 static int firehose_read(struct qdl_device *qdl, int wait, int (*response_parser)(xmlNode *node))
@@ -112,6 +239,7 @@ static int firehose_read(struct qdl_device *qdl, int wait, int (*response_parser
 	int error;
 	char *msg;
 	char *end;
+	bool rawmode = false;
 	bool done = false;
 	int ret = -ENXIO;
 	int n;
@@ -157,6 +285,7 @@ static int firehose_read(struct qdl_device *qdl, int wait, int (*response_parser
 						fprintf(stderr, "received response with no parser\n");
 					else
 						ret = response_parser(node);
+					rawmode = firehose_response_rawmode(node);
 					done = true;
 					timeout = 1;
 				}
@@ -165,238 +294,2681 @@ static int firehose_read(struct qdl_device *qdl, int wait, int (*response_parser
 			xmlFreeDoc(nodes->doc);
 		}
 
-		if (wait > 0)
-			timeout = 100;
+		/* Raw data follows immediately, leave it for the caller */
+		if (rawmode)
+			break;
+
+		if (wait > 0)
+			timeout = 100;
+	}
+
+	return ret;
+}
+
+static int firehose_nop_parser(xmlNode *node)
+{
+	xmlChar *value;
+
+	value = xmlGetProp(node, (xmlChar*)"value");
+	return !!xmlStrcmp(value, (xmlChar*)"ACK");
+}
+
+/**
+ * firehose_write_packet() - send a packet to the programmer
+ * @qdl:	qdl device handle
+ * @buf:	packet data
+ * @len:	length of @buf
+ *
+ * With Validated Image Programming each packet has to be described by a
+ * previously sent table of digests, so any table due is sent first.
+ *
+ * Return: number of bytes written, or negative errno on failure
+ */
+static int firehose_write_packet(struct qdl_device *qdl, const void *buf, size_t len)
+{
+	const void *table;
+	size_t table_len;
+	int ret;
+
+	if (vip_generating())
+		vip_gen_packet(buf, len);
+
+	ret = vip_next_table(&table, &table_len);
+	if (ret < 0)
+		return ret;
+
+	if (ret) {
+		ret = qdl_write(qdl, table, table_len, true);
+		if (ret < 0)
+			return ret;
+
+		ret = firehose_read(qdl, -1, firehose_nop_parser);
+		if (ret) {
+			fprintf(stderr, "[VIP] table of digests rejected\n");
+			return -EACCES;
+		}
+	}
+
+	return qdl_write(qdl, buf, len, true);
+}
+
+static int firehose_write(struct qdl_device *qdl, xmlDoc *doc)
+{
+	int saved_errno;
+	xmlChar *s;
+	int len;
+	int ret;
+
+	xmlDocDumpMemory(doc, &s, &len);
+
+	if (qdl_debug)
+		fprintf(stderr, "FIREHOSE WRITE: %s\n", s);
+
+	ret = firehose_write_packet(qdl, s, len);
+	saved_errno = errno;
+	xmlFree(s);
+	return ret < 0 ? -saved_errno : 0;
+}
+
+static size_t max_payload_size = 1048576;
+static bool firehose_configure_acked;
+
+/**
+ * firehose_configure_response_parser() - parse a configure response
+ * @node:	response xmlNode
+ *
+ * Return: max size supported by the remote, or negative errno on failure
+ */
+static int firehose_configure_response_parser(xmlNode *node)
+{
+	xmlChar *payload;
+	xmlChar *value;
+	size_t max_size;
+
+	value = xmlGetProp(node, (xmlChar*)"value");
+	payload = xmlGetProp(node, (xmlChar*)"MaxPayloadSizeToTargetInBytes");
+	if (!value || !payload)
+		return -EINVAL;
+
+	max_size = strtoul((char*)payload, NULL, 10);
+	firehose_configure_acked = !xmlStrcmp(value, (xmlChar*)"ACK");
+
+	/*
+	 * When receiving an ACK the remote may indicate that we should attempt
+	 * a larger payload size
+	 */
+	if (!xmlStrcmp(value, (xmlChar*)"ACK")) {
+		payload = xmlGetProp(node, (xmlChar*)"MaxPayloadSizeToTargetInBytesSupported");
+		if (!payload)
+			return -EINVAL;
+
+		max_size = strtoul((char*)payload, NULL, 10);
+	}
+
+	return max_size;
+}
+
+static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size, bool skip_storage_init, const char *storage)
+{
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	int ret;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"configure", NULL);
+	xml_setpropf(node, "MemoryName", storage);
+	xml_setpropf(node, "MaxPayloadSizeToTargetInBytes", "%d", payload_size);
+	xml_setpropf(node, "verbose", "%d", 0);
+	xml_setpropf(node, "ZLPAwareHost", "%d", 1);
+	xml_setpropf(node, "SkipStorageInit", "%d", skip_storage_init);
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	return firehose_read(qdl, -1, firehose_configure_response_parser);
+}
+
+static int firehose_configure(struct qdl_device *qdl, bool skip_storage_init, const char *storage)
+{
+	bool replaying = vip_enabled() && !vip_generating();
+	int ret;
+
+	/* The signed digests cover the packets as cut by the dry run */
+	if (replaying && vip_get_payload_size())
+		max_payload_size = vip_get_payload_size();
+
+	ret = firehose_send_configure(qdl, max_payload_size, skip_storage_init, storage);
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * Another configure, or other packet sizes, isn't covered by the
+	 * digests; proceed only if the remote accepted the size anyway
+	 */
+	if (replaying && ret != max_payload_size) {
+		if (!firehose_configure_acked) {
+			fprintf(stderr, "[CONFIGURE] programmer proposes max payload size %d, VIP digests were created for %zu\n",
+				ret, max_payload_size);
+			return -EINVAL;
+		}
+	} else if (ret != max_payload_size) {
+		/* Retry if remote proposed different size */
+		ret = firehose_send_configure(qdl, ret, skip_storage_init, storage);
+		if (ret < 0)
+			return ret;
+
+		max_payload_size = ret;
+	}
+
+	/* The remote might refuse the configuration, e.g. if storage init failed */
+	if (!firehose_configure_acked) {
+		fprintf(stderr, "[CONFIGURE] configuration refused by remote\n");
+		return -EIO;
+	}
+
+	if (vip_generating())
+		vip_set_payload_size(max_payload_size);
+
+	if (qdl_debug) {
+		fprintf(stderr, "[CONFIGURE] max payload size: %zu\n",
+			max_payload_size);
+	}
+
+	return 0;
+}
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+/* Largest multiple of the sector size that fits in a payload */
+static size_t firehose_chunk_size(unsigned sector_size)
+{
+	return max_payload_size / sector_size * sector_size;
+}
+
+static struct worker *firehose_worker;
+static unsigned firehose_verify_failures;
+
+/* Amount of an image read ahead looking for zero runs, in up to 64 buffers */
+#define FIREHOSE_ZERO_WINDOW	(16 * 1024 * 1024)
+
+static unsigned firehose_zero_window(void)
+{
+	return MIN(MAX(FIREHOSE_ZERO_WINDOW / max_payload_size, 1), 64);
+}
+
+/*
+ * Allocate the payload buffers of the session, once the payload size is
+ * known: those of an image source and of its read ahead, two for reading
+ * back data from the device and one on loan to the worker. While an image
+ * is read ahead, its ranges may be read again by a second source, to verify
+ * them by read back or to compare them with the journal.
+ */
+static void firehose_pool_create(void)
+{
+	unsigned count = source_buffer_count() + firehose_zero_window() + 1 + 3;
+
+	if (qdl_verify == QDL_VERIFY_READBACK || journal_resuming())
+		count += source_buffer_count();
+
+	bufpool_create(source_buffer_size(max_payload_size), count);
+	source_uring_create();
+}
+
+static void firehose_pool_destroy(void)
+{
+	source_uring_destroy();
+	bufpool_destroy();
+}
+
+struct firehose_hash_job {
+	struct sha256_ctx ctx;
+	const void *buf;
+	size_t len;
+};
+
+static void firehose_hash_chunk(void *data)
+{
+	struct firehose_hash_job *job = data;
+
+	sha256_update(&job->ctx, job->buf, job->len);
+	bufpool_put(job->buf);
+}
+
+static void digest_to_hex(const uint8_t *digest, char *hex)
+{
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+/**
+ * firehose_get_digest() - have the programmer calculate the digest of a range
+ * @qdl:	qdl device handle
+ * @program:	program entry describing the start of the range
+ * @num_sectors: number of sectors of the range
+ * @digest:	SHA-256 of the range, as reported by the programmer
+ *
+ * Return: 0 on success, -EOPNOTSUPP if the programmer refused the request,
+ * -ENODATA if it didn't report a digest, other negative errno on failure
+ */
+static int firehose_get_digest(struct qdl_device *qdl, struct program *program,
+			       unsigned num_sectors, uint8_t *digest)
+{
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	int timeout;
+	int ret;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"getsha256digest", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
+	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
+	xml_setpropf(node, "start_sector", "%s", program->start_sector);
+
+	firehose_digest_valid = false;
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	/* The programmer has to read back the range, allow for ~8MB/s */
+	timeout = 10000 + (uint64_t)num_sectors * program->sector_size / 8192;
+
+	ret = firehose_read(qdl, timeout, firehose_nop_parser);
+	if (ret)
+		return -EOPNOTSUPP;
+
+	if (!firehose_digest_valid)
+		return -ENODATA;
+
+	memcpy(digest, firehose_digest, SHA256_DIGEST_SIZE);
+
+	return 0;
+}
+
+/**
+ * firehose_verify_digest() - compare device side digest of a programmed range
+ * @qdl:	qdl device handle
+ * @program:	program entry that was just flashed
+ * @num_sectors: number of sectors that was streamed
+ * @expected:	SHA-256 of the streamed data, as calculated by the host
+ *
+ * Return: 0 if the digests match, 1 on mismatch, negative errno on failure
+ */
+static int firehose_verify_digest(struct qdl_device *qdl, struct program *program,
+				  unsigned num_sectors, const uint8_t *expected)
+{
+	char expected_hex[SHA256_DIGEST_SIZE * 2 + 1];
+	char actual_hex[SHA256_DIGEST_SIZE * 2 + 1];
+	uint8_t actual[SHA256_DIGEST_SIZE];
+	int ret;
+
+	ret = firehose_get_digest(qdl, program, num_sectors, actual);
+	if (ret == -EOPNOTSUPP) {
+		fprintf(stderr, "[VERIFY] digest of \"%s\" not supported by programmer\n",
+			program->label);
+		return -EINVAL;
+	} else if (ret == -ENODATA) {
+		fprintf(stderr, "[VERIFY] no digest reported for \"%s\"\n", program->label);
+		return -EINVAL;
+	} else if (ret < 0) {
+		return ret;
+	}
+
+	if (memcmp(actual, expected, SHA256_DIGEST_SIZE)) {
+		digest_to_hex(expected, expected_hex);
+		digest_to_hex(actual, actual_hex);
+		fprintf(stderr, "[VERIFY] \"%s\" digest mismatch\n", program->label);
+		fprintf(stderr, "[VERIFY]   expected %s\n", expected_hex);
+		fprintf(stderr, "[VERIFY]   device   %s\n", actual_hex);
+		return 1;
+	}
+
+	fprintf(stderr, "[VERIFY] \"%s\" digest verified\n", program->label);
+	return 0;
+}
+
+struct firehose_compare_job {
+	struct source *src;
+	unsigned sector_size;
+
+	/* remainder of the current source chunk */
+	const uint8_t *src_data;
+	size_t src_len;
+
+	const void *data;
+	size_t len;
+
+	/* index of the first mismatching sector in the chunk, or -1 */
+	long mismatch;
+};
+
+static void firehose_compare_chunk(void *data)
+{
+	struct firehose_compare_job *job = data;
+	const uint8_t *a = job->data;
+	const void *src;
+	size_t offset = 0;
+	size_t len;
+	size_t i;
+	ssize_t n;
+
+	job->mismatch = -1;
+
+	/* Source chunks are whole sectors, but need not line up with the read */
+	while (offset < job->len) {
+		if (!job->src_len) {
+			n = source_next(job->src, &src);
+			if (n < 0)
+				errx(1, "failed to read image: %s", strerror(-n));
+			if (!n)
+				errx(1, "image source ended before read back data");
+
+			job->src_data = src;
+			job->src_len = n;
+		}
+
+		len = MIN(job->len - offset, job->src_len);
+		if (job->mismatch < 0 && memcmp(a + offset, job->src_data, len)) {
+			for (i = 0; i < len; i += job->sector_size) {
+				if (memcmp(a + offset + i, job->src_data + i, job->sector_size)) {
+					job->mismatch = (offset + i) / job->sector_size;
+					break;
+				}
+			}
+		}
+
+		offset += len;
+		job->src_data += len;
+		job->src_len -= len;
+		if (!job->src_len)
+			source_release(job->src);
+	}
+}
+
+static int firehose_read_raw(struct qdl_device *qdl, void *buf, size_t len)
+{
+	size_t offset = 0;
+	int n;
+
+	while (offset < len) {
+		n = qdl_read(qdl, buf + offset, len - offset, 10000);
+		if (n < 0)
+			return n;
+
+		offset += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the image source of a program range, either the plain image or the
+ * segments of an expanded sparse image
+ */
+static struct source *firehose_source_open(struct program *program, int fd, unsigned num_sectors,
+					   const struct source_segment *segs, unsigned nsegs)
+{
+	struct source *src;
+
+	if (segs) {
+		src = source_open_segments(fd, segs, nsegs, program->sector_size,
+					   firehose_chunk_size(program->sector_size));
+	} else {
+		src = source_open(fd, (off_t)program->file_offset * program->sector_size,
+				  (uint64_t)num_sectors * program->sector_size,
+				  program->sector_size,
+				  firehose_chunk_size(program->sector_size));
+	}
+	if (!src)
+		err(1, "failed to open image source");
+
+	return src;
+}
+
+/**
+ * firehose_verify_readback() - read back a programmed range and compare
+ * @qdl:	qdl device handle
+ * @program:	program entry that was just flashed
+ * @num_sectors: number of sectors that was streamed
+ * @fd:		file descriptor of the source image
+ * @segs:	segments of a sparse image, or NULL
+ * @nsegs:	number of segments
+ *
+ * The range is read back in max_payload_size chunks, each chunk being
+ * compared against the source image on a worker thread while the next chunk
+ * is transferred over USB.
+ *
+ * Return: 0 if the data matches, 1 on mismatch, negative errno on failure
+ */
+static int firehose_verify_readback(struct qdl_device *qdl, struct program *program,
+				    unsigned num_sectors, int fd,
+				    const struct source_segment *segs, unsigned nsegs)
+{
+	struct firehose_compare_job job = {0};
+	unsigned long mismatch = 0;
+	unsigned long sector = 0;
+	bool mismatched = false;
+	size_t chunk_size;
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	void *buf[2];
+	unsigned left;
+	int ret;
+	int i = 0;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"read", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
+	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
+	xml_setpropf(node, "start_sector", "%s", program->start_sector);
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret) {
+		fprintf(stderr, "[VERIFY] failed to read back \"%s\"\n", program->label);
+		return -EINVAL;
+	}
+
+	buf[0] = bufpool_get();
+	buf[1] = bufpool_get();
+
+	/* The image is read through the same prefetching source as programming */
+	job.src = firehose_source_open(program, fd, num_sectors, segs, nsegs);
+	job.sector_size = program->sector_size;
+	job.mismatch = -1;
+
+	left = num_sectors;
+	while (left > 0) {
+		chunk_size = MIN(max_payload_size / program->sector_size, left);
+
+		ret = firehose_read_raw(qdl, buf[i], chunk_size * program->sector_size);
+		if (ret < 0) {
+			fprintf(stderr, "[VERIFY] failed to receive \"%s\"\n", program->label);
+			goto out;
+		}
+
+		/* Collect the result of the previous chunk */
+		worker_wait(firehose_worker);
+		if (!mismatched && job.mismatch >= 0) {
+			mismatch = sector + job.mismatch;
+			mismatched = true;
+		}
+
+		sector += job.len / program->sector_size;
+		job.data = buf[i];
+		job.len = chunk_size * program->sector_size;
+		if (!mismatched)
+			worker_submit(firehose_worker, firehose_compare_chunk, &job);
+
+		left -= chunk_size;
+		i ^= 1;
+	}
+
+	worker_wait(firehose_worker);
+	if (!mismatched && job.mismatch >= 0) {
+		mismatch = sector + job.mismatch;
+		mismatched = true;
+	}
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret) {
+		fprintf(stderr, "[VERIFY] read back of \"%s\" failed\n", program->label);
+		goto out;
+	}
+
+	if (mismatched) {
+		fprintf(stderr, "[VERIFY] \"%s\" differs at sector %lu (start_sector %s)\n",
+			program->label, mismatch, program->start_sector);
+		ret = 1;
+	} else {
+		fprintf(stderr, "[VERIFY] \"%s\" read back verified\n", program->label);
+	}
+
+out:
+	worker_wait(firehose_worker);
+	source_close(job.src);
+	bufpool_put(buf[0]);
+	bufpool_put(buf[1]);
+	return ret;
+}
+
+/**
+ * firehose_get_storage_info() - query the geometry of a physical partition
+ * @qdl:	qdl device handle
+ * @partition:	physical partition number
+ * @info:	storage info to fill in
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+static int firehose_get_storage_info(struct qdl_device *qdl, unsigned partition,
+				     struct firehose_storage_info *info)
+{
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	int ret;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"getstorageinfo", NULL);
+	xml_setpropf(node, "physical_partition_number", "%d", partition);
+
+	firehose_storage_info_valid = false;
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret || !firehose_storage_info_valid) {
+		fprintf(stderr, "[STORAGE] failed to get storage info of partition %d\n",
+			partition);
+		return -EINVAL;
+	}
+
+	*info = firehose_storage_info;
+
+	if (qdl_debug) {
+		fprintf(stderr, "[STORAGE] partition %d: %s %" PRIu64 " blocks of %u bytes\n",
+			partition, info->mem_type, info->total_blocks, info->block_size);
+	}
+
+	return 0;
+}
+
+struct firehose_dump_job {
+	struct dump_sink *sink;
+	const void *buf;
+	size_t len;
+	int ret;
+};
+
+static void firehose_dump_chunk(void *data)
+{
+	struct firehose_dump_job *job = data;
+
+	job->ret = dump_sink_write(job->sink, job->buf, job->len);
+}
+
+static uint64_t firehose_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * firehose_dump() - read a region of the storage into a file
+ * @qdl:	qdl device handle
+ * @dump:	region and output file
+ *
+ * The region is received in max_payload_size chunks, while each chunk is
+ * written to the output file by a worker thread.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+static int firehose_dump(struct qdl_device *qdl, struct dump *dump)
+{
+	struct firehose_storage_info info;
+	struct firehose_dump_job job = {0};
+	const char *start_sector = dump->start_sector;
+	unsigned sector_size = dump->sector_size;
+	unsigned num_sectors = dump->num_sectors;
+	struct dump_sink *sink;
+	size_t chunk_size;
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	void *buf[2] = {};
+	unsigned left;
+	uint64_t t0;
+	uint64_t t;
+	int ret;
+	int i = 0;
+
+	if (!start_sector || !sector_size) {
+		ret = firehose_get_storage_info(qdl, dump->partition, &info);
+		if (ret)
+			return ret;
+
+		if (!sector_size)
+			sector_size = info.block_size;
+
+		/* Dump the entire physical partition */
+		if (!start_sector) {
+			start_sector = "0";
+			num_sectors = info.total_blocks;
+		}
+	}
+
+	sink = dump_sink_open(dump, sector_size);
+	if (!sink)
+		return -EIO;
+
+	buf[0] = bufpool_get();
+	buf[1] = bufpool_get();
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"read", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%u", sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%u", num_sectors);
+	xml_setpropf(node, "physical_partition_number", "%u", dump->partition);
+	xml_setpropf(node, "start_sector", "%s", start_sector);
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		goto out;
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret) {
+		fprintf(stderr, "[DUMP] failed to setup read of %s\n", dump->filename);
+		goto out;
+	}
+
+	t0 = firehose_now();
+
+	job.sink = sink;
+
+	left = num_sectors;
+	while (left > 0) {
+		chunk_size = MIN(max_payload_size / sector_size, left);
+
+		ret = firehose_read_raw(qdl, buf[i], chunk_size * sector_size);
+		if (ret < 0) {
+			/* What's left of the data would be taken for responses */
+			fprintf(stderr, "[DUMP] failed to receive %s, aborting session\n",
+				dump->filename);
+			ret = -EPROTO;
+			goto out;
+		}
+
+		worker_wait(firehose_worker);
+
+		/*
+		 * Once writing failed, the rest of the data is still received,
+		 * but dropped, to get to the response of the read
+		 */
+		if (job.ret >= 0) {
+			job.buf = buf[i];
+			job.len = chunk_size * sector_size;
+			worker_submit(firehose_worker, firehose_dump_chunk, &job);
+		}
+
+		left -= chunk_size;
+		i ^= 1;
+	}
+
+	worker_wait(firehose_worker);
+
+	t = firehose_now() - t0;
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret) {
+		fprintf(stderr, "[DUMP] read of %s failed\n", dump->filename);
+	} else if (job.ret < 0) {
+		fprintf(stderr, "[DUMP] failed to write %s: %s\n", dump->filename,
+			strerror(-job.ret));
+		ret = job.ret;
+	} else {
+		fprintf(stderr, "[DUMP] dumped %s successfully at %" PRIu64 "kB/s\n",
+			dump->filename,
+			(uint64_t)((double)sector_size * num_sectors * 1e9 / MAX(t, 1) / 1024));
+	}
+
+out:
+	worker_wait(firehose_worker);
+	if (dump_sink_close(sink) < 0 && !ret)
+		ret = -EIO;
+	bufpool_put(buf[0]);
+	bufpool_put(buf[1]);
+	return ret;
+}
+
+/* Zero runs shorter than this are cheaper to send than to split out */
+#define FIREHOSE_ZERO_RUN_MIN	(1024 * 1024)
+
+/* Granularity of the zero detection */
+#define FIREHOSE_ZERO_BLOCK	(64 * 1024)
+
+/* Largest range programmed by one command while journaling */
+#define FIREHOSE_CHECKPOINT_SIZE	(256 * 1024 * 1024)
+
+/* Smallest range --incremental=probe narrows differences down to */
+#define FIREHOSE_PROBE_MIN	(1024 * 1024)
+
+/* Number of parts a differing range is probed in */
+#define FIREHOSE_PROBE_FANOUT	8
+
+/*
+ * Estimates of the cost of programming and of probing digests, in bytes per
+ * second and seconds per command, refined as they're measured
+ */
+static double firehose_program_rate = 40e6;
+static double firehose_program_overhead = 0.005;
+static double firehose_digest_rate = 100e6;
+static double firehose_digest_overhead = 0.005;
+static double firehose_host_hash_rate = 150e6;
+static bool firehose_probe_unsupported;
+
+struct firehose_erased_range {
+	unsigned partition;
+	unsigned sector_size;
+	uint64_t start;
+	uint64_t end;
+
+	struct firehose_erased_range *next;
+};
+
+/*
+ * Ranges erased during this session, reading back as zeros on partitions
+ * where erased sectors do
+ */
+static struct firehose_erased_range *firehose_erased;
+
+static uint64_t firehose_zeros_skipped;
+static uint64_t firehose_zeros_erased;
+static uint64_t firehose_unchanged;
+
+/* Whether erased sectors read back as zeros, per physical partition */
+enum firehose_erased_content {
+	FIREHOSE_ERASED_UNKNOWN,
+	FIREHOSE_ERASED_ZERO,
+	FIREHOSE_ERASED_ANY,
+};
+
+#define FIREHOSE_MAX_PARTITIONS	32
+
+static enum firehose_erased_content firehose_erased_content[FIREHOSE_MAX_PARTITIONS];
+
+/* Device of the session, for the storage info to be queried once needed */
+static struct qdl_device *firehose_session;
+
+static bool firehose_range_erased(struct program *program, uint64_t start, uint64_t count)
+{
+	struct firehose_erased_range *range;
+
+	for (range = firehose_erased; range; range = range->next) {
+		if (range->partition == program->partition &&
+		    range->sector_size == program->sector_size &&
+		    range->start <= start && start + count <= range->end)
+			return true;
+	}
+
+	return false;
+}
+
+static int firehose_erase(struct qdl_device *qdl, struct program *program)
+{
+	struct journal_op op = {
+		.kind = "erase",
+		.partition = program->partition,
+		.start_sector = program->start_sector,
+		.count = program->num_sectors,
+	};
+	struct firehose_erased_range *range;
+	uint64_t start;
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	int ret;
+
+	if (journal_replay(&op)) {
+		fprintf(stderr, "[RESUME] \"%s\" already erased, skipping\n", program->label);
+		goto erased;
+	}
+
+	if (program_start_sector(program, &start))
+		hashdb_invalidate(program->partition, program->sector_size, start,
+				  program->num_sectors);
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"erase", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%u", program->num_sectors);
+	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
+	xml_setpropf(node, "start_sector", "%s", program->start_sector);
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	ret = firehose_read(qdl, 30000, firehose_nop_parser);
+	if (ret) {
+		fprintf(stderr, "[ERASE] failed to erase \"%s\"\n", program->label);
+		return ret;
+	}
+
+	fprintf(stderr, "[ERASE] erased \"%s\" successfully\n", program->label);
+
+	journal_record(&op);
+
+erased:
+	if (program_start_sector(program, &start)) {
+		range = calloc(1, sizeof(*range));
+		if (range) {
+			range->partition = program->partition;
+			range->sector_size = program->sector_size;
+			range->start = start;
+			range->end = start + program->num_sectors;
+			range->next = firehose_erased;
+			firehose_erased = range;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * firehose_erased_reads_zero() - check if erased sectors reads back as zeros
+ * @qdl:	qdl device handle
+ * @partition:	physical partition
+ *
+ * What an erased sector reads back as depends on the storage, and on UFS on
+ * the provisioning of each LUN, so it's only assumed to be zeros if the
+ * programmer reports so for the partition, or the user says so. The answer
+ * is kept for the rest of the session.
+ */
+static bool firehose_erased_reads_zero(struct qdl_device *qdl, unsigned partition)
+{
+	enum firehose_erased_content *content;
+	struct firehose_storage_info info;
+
+	/* VIP requires the session to be identical to the one digests were made of */
+	if (vip_enabled() || partition >= FIREHOSE_MAX_PARTITIONS)
+		return false;
+
+	content = &firehose_erased_content[partition];
+	if (*content == FIREHOSE_ERASED_UNKNOWN) {
+		if (qdl_erased_zero)
+			*content = FIREHOSE_ERASED_ZERO;
+		else if (!firehose_get_storage_info(qdl, partition, &info) && info.erased_zero)
+			*content = FIREHOSE_ERASED_ZERO;
+		else
+			*content = FIREHOSE_ERASED_ANY;
+	}
+
+	return *content == FIREHOSE_ERASED_ZERO;
+}
+
+/*
+ * firehose_erased_reads_zero() for the device of the session, querying the
+ * storage info of a partition only once a zero range is to be left out
+ */
+static bool firehose_erased_zero(unsigned partition)
+{
+	return firehose_erased_reads_zero(firehose_session, partition);
+}
+
+/*
+ * Time spent on each program entry, split into the round trip setting up
+ * each program command, the streaming of its data and the wait for its final
+ * ACK. Anything else, e.g. erasing or verifying, is accounted as other.
+ */
+struct firehose_timing {
+	char *label;
+	unsigned partition;
+	uint64_t bytes;
+	uint64_t setup_ns;
+	uint64_t stream_ns;
+	uint64_t ack_ns;
+	uint64_t total_ns;
+};
+
+#define FIREHOSE_TIMING_SLOWEST	5
+
+static struct firehose_timing *firehose_timings;
+static unsigned firehose_ntimings;
+static struct firehose_timing *firehose_timing;
+
+static void firehose_timing_begin(struct program *program)
+{
+	struct firehose_timing *timing;
+
+	timing = realloc(firehose_timings, (firehose_ntimings + 1) * sizeof(*timing));
+	if (!timing)
+		err(1, "failed to allocate timing");
+	firehose_timings = timing;
+
+	timing = &firehose_timings[firehose_ntimings++];
+	memset(timing, 0, sizeof(*timing));
+	timing->label = strdup(program->label ? program->label : "");
+	timing->partition = program->partition;
+
+	firehose_timing = timing;
+}
+
+static void firehose_timing_end(uint64_t total_ns)
+{
+	firehose_timing->total_ns = total_ns;
+	firehose_timing = NULL;
+}
+
+static int firehose_timing_cmp(const void *a, const void *b)
+{
+	const struct firehose_timing *ta = *(struct firehose_timing * const *)a;
+	const struct firehose_timing *tb = *(struct firehose_timing * const *)b;
+
+	if (ta->total_ns != tb->total_ns)
+		return ta->total_ns < tb->total_ns ? 1 : -1;
+
+	return 0;
+}
+
+static void firehose_timing_summary(void)
+{
+	struct firehose_timing **sorted;
+	struct firehose_timing sum = {0};
+	struct firehose_timing *timing;
+	uint64_t busy;
+	unsigned i;
+
+	if (!firehose_ntimings)
+		return;
+
+	fprintf(stderr, "[TIMING] %-20s %3s %10s %10s %10s %10s %10s %10s %9s\n",
+		"partition", "lun", "MB", "setup ms", "stream ms", "ack ms", "other ms",
+		"total ms", "MB/s");
+
+	for (i = 0; i <= firehose_ntimings; i++) {
+		if (i < firehose_ntimings) {
+			timing = &firehose_timings[i];
+
+			sum.bytes += timing->bytes;
+			sum.setup_ns += timing->setup_ns;
+			sum.stream_ns += timing->stream_ns;
+			sum.ack_ns += timing->ack_ns;
+			sum.total_ns += timing->total_ns;
+		} else {
+			timing = &sum;
+			timing->label = "total";
+		}
+
+		busy = timing->setup_ns + timing->stream_ns + timing->ack_ns;
+
+		fprintf(stderr, "[TIMING] %-20s ", timing->label);
+		if (timing == &sum)
+			fprintf(stderr, "%3s ", "");
+		else
+			fprintf(stderr, "%3u ", timing->partition);
+		fprintf(stderr, "%10.1f %10.3f %10.3f %10.3f %10.3f %10.3f %9.1f\n",
+			timing->bytes / 1e6,
+			timing->setup_ns / 1e6, timing->stream_ns / 1e6, timing->ack_ns / 1e6,
+			(timing->total_ns - MIN(busy, timing->total_ns)) / 1e6,
+			timing->total_ns / 1e6,
+			busy ? timing->bytes * 1e3 / busy : 0.0);
+	}
+
+	/* Rank the entries taking the most time */
+	sorted = calloc(firehose_ntimings, sizeof(*sorted));
+	if (!sorted)
+		err(1, "failed to allocate timing");
+
+	for (i = 0; i < firehose_ntimings; i++)
+		sorted[i] = &firehose_timings[i];
+	qsort(sorted, firehose_ntimings, sizeof(*sorted), firehose_timing_cmp);
+
+	fprintf(stderr, "[TIMING] slowest:\n");
+	for (i = 0; i < firehose_ntimings && i < FIREHOSE_TIMING_SLOWEST; i++) {
+		fprintf(stderr, "[TIMING] %u. \"%s\" %.3f s, %.1f%% of the time spent programming\n",
+			i + 1, sorted[i]->label, sorted[i]->total_ns / 1e9,
+			sum.total_ns ? 100.0 * sorted[i]->total_ns / sum.total_ns : 0.0);
+	}
+
+	free(sorted);
+}
+
+static void firehose_timing_free(void)
+{
+	unsigned i;
+
+	for (i = 0; i < firehose_ntimings; i++)
+		free(firehose_timings[i].label);
+	free(firehose_timings);
+	firehose_timings = NULL;
+	firehose_ntimings = 0;
+}
+
+static uint64_t firehose_chunk_hash(struct xxh64_ctx *ctx)
+{
+	uint64_t hash = xxh64_final(ctx);
+
+	return hash != HASHDB_UNKNOWN ? hash : 1;
+}
+
+/*
+ * Hashes of each HASHDB_CHUNK_SIZE chunk of an image, taken while it's
+ * programmed from start to end. Any part of the image not programmed, or
+ * programmed out of order, breaks the hashing.
+ */
+struct firehose_hasher {
+	unsigned file_offset;
+	uint64_t *hashes;
+	unsigned count;
+	unsigned n;
+	uint64_t pos;
+	size_t fill;
+	struct xxh64_ctx ctx;
+	bool broken;
+};
+
+static struct firehose_hasher *firehose_hasher;
+
+/* Hash @len bytes at @offset of the range of @program, or zeros without @buf */
+static void firehose_hasher_update(struct program *program, uint64_t offset,
+				   const uint8_t *buf, uint64_t len)
+{
+	static const uint8_t zeros[4096];
+	struct firehose_hasher *h = firehose_hasher;
+	size_t blen;
+
+	if (!h || h->broken)
+		return;
+
+	offset += (uint64_t)(program->file_offset - h->file_offset) * program->sector_size;
+	if (program->file_offset < h->file_offset || offset != h->pos) {
+		h->broken = true;
+		return;
+	}
+
+	h->pos += len;
+
+	while (len) {
+		blen = MIN(HASHDB_CHUNK_SIZE - h->fill, len);
+		if (!buf)
+			blen = MIN(blen, sizeof(zeros));
+
+		xxh64_update(&h->ctx, buf ? buf : zeros, blen);
+		if (buf)
+			buf += blen;
+		len -= blen;
+
+		h->fill += blen;
+		if (h->fill == HASHDB_CHUNK_SIZE && h->n < h->count) {
+			h->hashes[h->n++] = firehose_chunk_hash(&h->ctx);
+			xxh64_init(&h->ctx, 0);
+			h->fill = 0;
+		}
+	}
+}
+
+/* Digest of a range of the image, as journaled when it's programmed */
+static uint64_t firehose_range_digest(struct program *program, int fd, unsigned num_sectors,
+				      const struct source_segment *segs, unsigned nsegs)
+{
+	struct xxh64_ctx ctx;
+	struct source *src;
+	const void *buf;
+	ssize_t len;
+
+	src = firehose_source_open(program, fd, num_sectors, segs, nsegs);
+
+	xxh64_init(&ctx, 0);
+	for (;;) {
+		len = source_next(src, &buf);
+		if (len < 0)
+			errx(1, "failed to read \"%s\": %s", program->filename, strerror(-len));
+		if (!len)
+			break;
+
+		xxh64_update(&ctx, buf, len);
+		source_release(src);
+	}
+
+	source_close(src);
+
+	return xxh64_final(&ctx);
+}
+
+/*
+ * A run of an image read ahead of programming it: data, holding a reference
+ * to its payload buffer, or zeros without a buffer
+ */
+struct firehose_piece {
+	const uint8_t *buf;
+	size_t len;
+
+	/* the last data piece of its buffer */
+	bool last;
+};
+
+/*
+ * The image source of a program entry, read ahead by up to
+ * firehose_zero_window() buffers for the zero runs worth leaving out to be
+ * known before the program command covering the data ahead of them is sent.
+ * Zeros hold no buffers, so zero runs are read ahead regardless of length.
+ */
+struct firehose_feed {
+	struct source *src;
+	const char *filename;
+	size_t block;
+
+	/* what runs of zeros are programmed from */
+	uint8_t *zeros;
+	size_t zeros_len;
+
+	struct firehose_piece *pieces;
+	unsigned head;
+	unsigned count;
+	unsigned size;
+
+	/* buffers referenced by the pieces */
+	unsigned held;
+	size_t taken;
+	bool eof;
+};
+
+static struct firehose_feed *firehose_feed_open(struct program *program, int fd,
+						unsigned num_sectors)
+{
+	struct firehose_feed *feed;
+	size_t block;
+
+	feed = calloc(1, sizeof(*feed));
+	if (!feed)
+		err(1, "failed to allocate image feed");
+
+	block = MIN(FIREHOSE_ZERO_BLOCK, firehose_chunk_size(program->sector_size));
+	feed->block = MAX(block / program->sector_size, 1) * program->sector_size;
+
+	feed->zeros_len = firehose_chunk_size(program->sector_size);
+	feed->zeros = calloc(1, feed->zeros_len);
+	if (!feed->zeros)
+		err(1, "failed to allocate zero buffer");
+
+	feed->filename = program->filename;
+	feed->src = firehose_source_open(program, fd, num_sectors, NULL, 0);
+
+	return feed;
+}
+
+static void firehose_feed_add(struct firehose_feed *feed, const uint8_t *buf, size_t len)
+{
+	struct firehose_piece *piece;
+
+	if (feed->count == feed->size && feed->head) {
+		memmove(feed->pieces, &feed->pieces[feed->head],
+			(feed->count - feed->head) * sizeof(*feed->pieces));
+		feed->count -= feed->head;
+		feed->head = 0;
+	} else if (feed->count == feed->size) {
+		feed->size = feed->size ? feed->size * 2 : 64;
+		feed->pieces = realloc(feed->pieces, feed->size * sizeof(*feed->pieces));
+		if (!feed->pieces)
+			err(1, "failed to allocate image pieces");
+	}
+
+	piece = &feed->pieces[feed->count++];
+	piece->buf = buf;
+	piece->len = len;
+	piece->last = false;
+}
+
+/* Read the next chunk of the image, splitting it into runs of data and zeros */
+static void firehose_feed_pull(struct firehose_feed *feed)
+{
+	struct firehose_piece *piece;
+	const uint8_t *buf;
+	unsigned first;
+	unsigned i;
+	ssize_t len;
+	size_t blen;
+	size_t off;
+	bool zero;
+
+	len = source_next(feed->src, (const void **)&buf);
+	if (len < 0)
+		errx(1, "failed to read \"%s\": %s", feed->filename, strerror(-len));
+	if (!len) {
+		feed->eof = true;
+		return;
+	}
+
+	first = feed->count - feed->head;
+	for (off = 0; off < len; off += blen) {
+		blen = MIN(feed->block, len - off);
+		zero = is_zero_buffer(buf + off, blen);
+
+		/* Extend the previous run of the chunk */
+		if (off && zero == !feed->pieces[feed->count - 1].buf) {
+			feed->pieces[feed->count - 1].len += blen;
+			continue;
+		}
+
+		if (!zero)
+			bufpool_ref(buf + off);
+		firehose_feed_add(feed, zero ? NULL : buf + off, blen);
+	}
+
+	source_release(feed->src);
+
+	for (i = feed->count; i > feed->head + first; i--) {
+		piece = &feed->pieces[i - 1];
+		if (piece->buf) {
+			piece->last = true;
+			feed->held++;
+			break;
+		}
+	}
+}
+
+/*
+ * Length of the run at the head of the feed: the zeros long enough to leave
+ * out, or the data up to the next such run, stopping at @max bytes of data or
+ * once the read ahead is full, in which case @full is set
+ */
+static uint64_t firehose_feed_run(struct firehose_feed *feed, uint64_t max,
+				  bool *zero, bool *full)
+{
+	struct firehose_piece *piece;
+	uint64_t zeros = 0;
+	uint64_t data = 0;
+	unsigned i = 0;
+
+	*full = false;
+
+	for (;;) {
+		if (feed->head + i == feed->count) {
+			if (feed->eof)
+				break;
+
+			if (feed->held >= firehose_zero_window()) {
+				*full = true;
+				break;
+			}
+
+			firehose_feed_pull(feed);
+			continue;
+		}
+
+		piece = &feed->pieces[feed->head + i++];
+		if (!piece->buf) {
+			zeros += piece->len;
+			if (data && zeros >= FIREHOSE_ZERO_RUN_MIN)
+				break;
+			continue;
+		}
+
+		if (zeros >= FIREHOSE_ZERO_RUN_MIN)
+			break;
+
+		/* Zero runs too short to be worth a command of their own are data */
+		data += zeros + piece->len;
+		zeros = 0;
+		if (data >= max)
+			break;
+	}
+
+	*zero = !data && zeros >= FIREHOSE_ZERO_RUN_MIN;
+	if (!data)
+		return zeros;
+
+	return MIN(data, max);
+}
+
+/* Next part of the image, of at most @max bytes, kept until released */
+static ssize_t firehose_feed_next(struct firehose_feed *feed, uint64_t max, const void **buf)
+{
+	struct firehose_piece *piece;
+
+	if (!max)
+		return 0;
+
+	while (feed->head == feed->count && !feed->eof)
+		firehose_feed_pull(feed);
+
+	if (feed->head == feed->count)
+		return 0;
+
+	piece = &feed->pieces[feed->head];
+	feed->taken = MIN(piece->len, max);
+	if (!piece->buf)
+		feed->taken = MIN(feed->taken, feed->zeros_len);
+
+	*buf = piece->buf ? : feed->zeros;
+
+	return feed->taken;
+}
+
+static void firehose_feed_release(struct firehose_feed *feed)
+{
+	struct firehose_piece *piece = &feed->pieces[feed->head];
+
+	if (piece->buf) {
+		if (feed->taken == piece->len)
+			bufpool_put(piece->buf);
+		piece->buf += feed->taken;
+	}
+
+	piece->len -= feed->taken;
+	feed->taken = 0;
+
+	if (!piece->len) {
+		if (piece->last)
+			feed->held--;
+		feed->head++;
+	}
+
+	if (feed->head == feed->count)
+		feed->head = feed->count = 0;
+}
+
+static void firehose_feed_skip(struct firehose_feed *feed, uint64_t len)
+{
+	const void *buf;
+	ssize_t n;
+
+	while (len) {
+		n = firehose_feed_next(feed, len, &buf);
+		if (!n)
+			break;
+
+		firehose_feed_release(feed);
+		len -= n;
+	}
+}
+
+static void firehose_feed_close(struct firehose_feed *feed)
+{
+	unsigned i;
+
+	for (i = feed->head; i < feed->count; i++) {
+		if (feed->pieces[i].buf)
+			bufpool_put(feed->pieces[i].buf);
+	}
+
+	source_close(feed->src);
+	free(feed->pieces);
+	free(feed->zeros);
+	free(feed);
+}
+
+/*
+ * Program a range of the image by one command, reading it from @feed if
+ * given, or else from a source of its own
+ */
+static int firehose_program_range(struct qdl_device *qdl, struct program *program,
+				  int fd, unsigned num_sectors,
+				  const struct source_segment *segs, unsigned nsegs,
+				  struct firehose_feed *feed)
+{
+	struct journal_op op = {
+		.kind = "program",
+		.partition = program->partition,
+		.start_sector = program->start_sector,
+		.count = num_sectors,
+	};
+	enum qdl_verify verify = qdl_verify;
+	struct firehose_hash_job hash;
+	struct xxh64_ctx journal_hash;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint64_t bytes = (uint64_t)num_sectors * program->sector_size;
+	uint64_t streamed = 0;
+	uint64_t start;
+	struct source *src = NULL;
+	const void *buf;
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	ssize_t len;
+	uint64_t t_setup;
+	uint64_t t_stream;
+	uint64_t t_ack;
+	uint64_t t_end;
+	int ret;
+	int n;
+
+	/* A piped image is gone once programmed, it can't be read back */
+	if (verify == QDL_VERIFY_READBACK && source_is_stream(fd)) {
+		fprintf(stderr, "[VERIFY] \"%s\" is read from a pipe, verifying by digest\n",
+			program->label);
+		verify = QDL_VERIFY_DIGEST;
+	}
+
+	/*
+	 * A piped image can't be compared to the journal without consuming it.
+	 * Otherwise the range is only read ahead of programming it while it
+	 * may be the next operation recorded, replaying ending at the first
+	 * that isn't, so at most one range is read twice.
+	 */
+	if (journal_resuming() && !source_is_stream(fd)) {
+		if (journal_expects(&op))
+			op.digest = firehose_range_digest(program, fd, num_sectors, segs, nsegs);
+		if (journal_replay(&op)) {
+			fprintf(stderr, "[RESUME] \"%s\" already programmed at sector %s, skipping\n",
+				program->label, program->start_sector);
+			if (feed)
+				firehose_feed_skip(feed, bytes);
+			return 0;
+		}
+	}
+
+	/* Start prefetching the image while the program command is set up */
+	if (!feed)
+		src = firehose_source_open(program, fd, num_sectors, segs, nsegs);
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"program", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
+	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
+	xml_setpropf(node, "start_sector", "%s", program->start_sector);
+	if (program->filename)
+		xml_setpropf(node, "filename", "%s", program->filename);
+
+	if (program_start_sector(program, &start))
+		hashdb_invalidate(program->partition, program->sector_size, start, num_sectors);
+
+	t_setup = firehose_now();
+
+	ret = firehose_write(qdl, doc);
+	if (ret < 0) {
+		fprintf(stderr, "[PROGRAM] failed to write program command\n");
+		goto out;
+	}
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret) {
+		fprintf(stderr, "[PROGRAM] failed to setup programming\n");
+		goto out;
+	}
+
+	t_stream = firehose_now();
+
+	if (verify == QDL_VERIFY_DIGEST)
+		sha256_init(&hash.ctx);
+
+	xxh64_init(&journal_hash, 0);
+
+	for (;;) {
+		if (feed)
+			len = firehose_feed_next(feed, bytes - streamed, &buf);
+		else
+			len = source_next(src, &buf);
+		if (len < 0)
+			errx(1, "failed to read \"%s\": %s", program->filename, strerror(-len));
+		if (!len)
+			break;
+
+		/*
+		 * Hash the chunk while it's being transferred, the hashing job
+		 * holds its own loan of the buffer and may outlive the release
+		 */
+		if (verify == QDL_VERIFY_DIGEST) {
+			worker_wait(firehose_worker);
+			bufpool_ref(buf);
+			hash.buf = buf;
+			hash.len = len;
+			worker_submit(firehose_worker, firehose_hash_chunk, &hash);
+		}
+
+		if (journal_enabled())
+			xxh64_update(&journal_hash, buf, len);
+
+		/* The segments of an expanded image aren't the image itself */
+		if (firehose_hasher && !segs)
+			firehose_hasher_update(program, streamed, buf, len);
+		else if (firehose_hasher)
+			firehose_hasher->broken = true;
+		streamed += len;
+
+		n = firehose_write_packet(qdl, buf, len);
+		if (n < 0)
+			err(1, "failed to write");
+
+		if (n != len)
+			err(1, "failed to write full sector");
+
+		if (feed)
+			firehose_feed_release(feed);
+		else
+			source_release(src);
+	}
+
+	if (verify == QDL_VERIFY_DIGEST)
+		worker_wait(firehose_worker);
+
+	/* Return the source's buffers before any read back verification */
+	source_close(src);
+	src = NULL;
+
+	t_ack = firehose_now();
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+
+	t_end = firehose_now();
+
+	if (!ret && t_ack > t_stream) {
+		firehose_program_rate = (firehose_program_rate + bytes * 1e9 / (t_ack - t_stream)) / 2;
+		firehose_program_overhead = (firehose_program_overhead +
+					     (t_stream - t_setup + t_end - t_ack) / 1e9) / 2;
+	}
+
+	if (firehose_timing) {
+		firehose_timing->bytes += bytes;
+		firehose_timing->setup_ns += t_stream - t_setup;
+		firehose_timing->stream_ns += t_ack - t_stream;
+		firehose_timing->ack_ns += t_end - t_ack;
+	}
+
+	if (ret) {
+		fprintf(stderr, "[PROGRAM] failed\n");
+	} else {
+		fprintf(stderr,
+			"[PROGRAM] flashed \"%s\" successfully at %" PRIu64 "kB/s\n",
+			program->label,
+			(uint64_t)(bytes * 1e9 / MAX(t_ack - t_stream, 1) / 1024));
+	}
+
+	if (!ret && verify == QDL_VERIFY_DIGEST) {
+		sha256_final(&hash.ctx, digest);
+
+		ret = firehose_verify_digest(qdl, program, num_sectors, digest);
+	} else if (!ret && verify == QDL_VERIFY_READBACK) {
+		ret = firehose_verify_readback(qdl, program, num_sectors, fd, segs, nsegs);
+	}
+
+	if (ret > 0) {
+		firehose_verify_failures++;
+		ret = 0;
+	} else if (!ret && journal_enabled()) {
+		op.digest = xxh64_final(&journal_hash);
+		journal_record(&op);
+	}
+
+out:
+	xmlFreeDoc(doc);
+	source_close(src);
+	return ret;
+}
+
+/*
+ * The programmer acknowledges a program command once all of its data is
+ * written, so while journaling, large ranges of an image are programmed by
+ * several commands, allowing a session to be resumed part way through it.
+ * Compressed images are left whole, as each range would decompress the image
+ * from its start.
+ */
+static int firehose_program_slices(struct qdl_device *qdl, struct program *program,
+				   int fd, unsigned num_sectors, uint64_t start)
+{
+	struct program range;
+	char start_sector[21];
+	unsigned slice;
+	unsigned count;
+	unsigned i;
+	int ret;
+
+	slice = FIREHOSE_CHECKPOINT_SIZE / program->sector_size;
+	if (!journal_enabled() || num_sectors <= slice ||
+	    decompress_detect(fd) != DECOMPRESS_NONE)
+		return firehose_program_range(qdl, program, fd, num_sectors, NULL, 0, NULL);
+
+	for (i = 0; i < num_sectors; i += count) {
+		count = MIN(slice, num_sectors - i);
+
+		range = *program;
+		snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + i);
+		range.start_sector = start_sector;
+		range.file_offset = program->file_offset + i;
+		range.num_sectors = count;
+
+		ret = firehose_program_range(qdl, &range, fd, count, NULL, 0, NULL);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Zero runs are only left out of images on partitions that may read back
+ * zeros once erased. Compressed images are programmed whole, as each range
+ * would decompress the image from its start to verify or resume it.
+ */
+static bool firehose_zero_split(struct program *program, int fd, unsigned num_sectors)
+{
+	if (vip_enabled())
+		return false;
+
+	if (program->partition >= FIREHOSE_MAX_PARTITIONS ||
+	    firehose_erased_content[program->partition] == FIREHOSE_ERASED_ANY)
+		return false;
+
+	if ((uint64_t)num_sectors * program->sector_size < FIREHOSE_ZERO_RUN_MIN)
+		return false;
+
+	return decompress_detect(fd) == DECOMPRESS_NONE;
+}
+
+/*
+ * Program the image in ranges, leaving out its runs of zeros as they're read
+ * ahead. These are skipped if the target range was erased earlier in the
+ * session, or erased otherwise, relying on erased sectors reading back as
+ * zeros. A long run of data is programmed by commands reaching further past
+ * the read ahead each time, keeping the commands few at the cost of
+ * programming the zero runs within their reach.
+ */
+static int firehose_program_split(struct qdl_device *qdl, struct program *program,
+				  int fd, unsigned num_sectors, uint64_t start)
+{
+	struct firehose_feed *feed;
+	struct program range;
+	char start_sector[21];
+	uint64_t skipped = 0;
+	uint64_t erased = 0;
+	uint64_t sector = 0;
+	uint64_t reach = 0;
+	uint64_t count;
+	uint64_t max;
+	uint64_t len;
+	bool split = true;
+	bool full;
+	bool zero;
+	int ret = 0;
+
+	/* While journaling, ranges are programmed in checkpoints */
+	max = journal_enabled() ? FIREHOSE_CHECKPOINT_SIZE : UINT64_MAX;
+
+	feed = firehose_feed_open(program, fd, num_sectors);
+
+	while (sector < num_sectors && !ret) {
+		count = num_sectors - sector;
+		zero = false;
+		full = false;
+
+		if (split) {
+			len = firehose_feed_run(feed, max, &zero, &full);
+			if (!len)
+				break;
+
+			/* Only ask about the partition once there's a zero run */
+			if (zero && !firehose_erased_zero(program->partition)) {
+				split = false;
+				continue;
+			}
+
+			if (full) {
+				reach = MIN(reach ? reach * 2 : len, FIREHOSE_CHECKPOINT_SIZE);
+				len = MIN(len + reach, max);
+			} else {
+				reach = 0;
+			}
+
+			count = MIN(count, len / program->sector_size);
+		} else {
+			count = MIN(count, max / program->sector_size);
+		}
+
+		range = *program;
+		snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + sector);
+		range.start_sector = start_sector;
+		range.file_offset = program->file_offset + sector;
+		range.num_sectors = count;
+
+		if (!zero) {
+			ret = firehose_program_range(qdl, &range, fd, count, NULL, 0, feed);
+			sector += count;
+			continue;
+		}
+
+		if (firehose_range_erased(program, start + sector, count)) {
+			skipped += count * program->sector_size;
+		} else {
+			ret = firehose_erase(qdl, &range);
+			erased += count * program->sector_size;
+		}
+
+		/* What's left out reads back as zeros */
+		firehose_feed_skip(feed, count * program->sector_size);
+		firehose_hasher_update(program, sector * program->sector_size,
+				       NULL, count * program->sector_size);
+		sector += count;
+	}
+
+	firehose_feed_close(feed);
+
+	if (!ret && (skipped || erased)) {
+		fprintf(stderr, "[PROGRAM] \"%s\": %" PRIu64 " kB of zeros skipped, %" PRIu64 " kB erased\n",
+			program->label, skipped / 1024, erased / 1024);
+	}
+
+	firehose_zeros_skipped += skipped;
+	firehose_zeros_erased += erased;
+
+	return ret;
+}
+
+/*
+ * A gap in an expanded sparse image is left alone, as fastboot does, unless
+ * erased sectors read back as zeros; in which case it's erased, making the
+ * result match the image expanded by simg2img.
+ */
+static bool firehose_sparse_gap(struct program *program, const struct sparse_extent *ext,
+				unsigned blk_sz)
+{
+	if (ext->type == SPARSE_EXTENT_DONT_CARE)
+		return true;
+
+	return ext->type == SPARSE_EXTENT_FILL && !ext->fill &&
+	       ext->blocks * blk_sz >= FIREHOSE_ZERO_RUN_MIN &&
+	       firehose_erased_zero(program->partition);
+}
+
+static int firehose_sparse_gap_erase(struct qdl_device *qdl, struct program *program,
+				     uint64_t start, uint64_t sector, uint64_t count,
+				     uint64_t *skipped, uint64_t *erased)
+{
+	struct program range;
+	char start_sector[21];
+
+	if (!firehose_erased_zero(program->partition)) {
+		*skipped += count * program->sector_size;
+		return 0;
+	}
+
+	if (firehose_range_erased(program, start + sector, count)) {
+		*skipped += count * program->sector_size;
+		return 0;
+	}
+
+	range = *program;
+	snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + sector);
+	range.start_sector = start_sector;
+	range.num_sectors = count;
+
+	*erased += count * program->sector_size;
+
+	return firehose_erase(qdl, &range);
+}
+
+/*
+ * Program the extents of an expanded sparse image, @limit sectors of it:
+ * raw and fill extents are streamed as ranges, while the gaps between them
+ * are skipped or erased.
+ */
+static int firehose_program_extents(struct qdl_device *qdl, struct program *program, int fd,
+				    uint64_t start, unsigned blk_sz, uint64_t limit,
+				    const struct sparse_extent *extents, unsigned count_ext,
+				    const char *kind)
+{
+	struct source_segment *segs = NULL;
+	const struct sparse_extent *ext;
+	struct program range;
+	char start_sector[21];
+	uint64_t skipped = 0;
+	uint64_t erased = 0;
+	uint64_t sectors;
+	uint64_t sector;
+	uint64_t count;
+	unsigned spb;
+	unsigned nsegs;
+	unsigned i;
+	unsigned j;
+	int ret = 0;
+
+	spb = blk_sz / program->sector_size;
+
+	segs = calloc(count_ext ? count_ext : 1, sizeof(*segs));
+	if (!segs)
+		err(1, "failed to allocate sparse segments");
+
+	for (i = 0; i < count_ext && !ret; i = j) {
+		ext = &extents[i];
+		sector = ext->block * spb;
+		if (sector >= limit)
+			break;
+
+		if (firehose_sparse_gap(program, ext, blk_sz)) {
+			count = MIN(ext->blocks * spb, limit - sector);
+			ret = firehose_sparse_gap_erase(qdl, program, start, sector, count,
+							&skipped, &erased);
+			j = i + 1;
+			continue;
+		}
+
+		/* Stream consecutive raw and fill extents as one range */
+		sectors = 0;
+		nsegs = 0;
+		for (j = i; j < count_ext && !firehose_sparse_gap(program, &extents[j], blk_sz); j++) {
+			ext = &extents[j];
+			if (sector + sectors >= limit)
+				break;
+
+			count = MIN(ext->blocks * spb, limit - sector - sectors);
+			segs[nsegs].len = count * program->sector_size;
+			segs[nsegs].offset = ext->offset;
+			segs[nsegs].fill = ext->type == SPARSE_EXTENT_FILL;
+			segs[nsegs].pattern = ext->fill;
+			nsegs++;
+
+			sectors += count;
+		}
+
+		range = *program;
+		snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + sector);
+		range.start_sector = start_sector;
+		range.num_sectors = sectors;
+
+		ret = firehose_program_range(qdl, &range, fd, sectors, segs, nsegs, NULL);
+	}
+
+	if (!ret) {
+		fprintf(stderr, "[PROGRAM] \"%s\": %s, %" PRIu64 " kB skipped, %" PRIu64 " kB erased\n",
+			program->label, kind, skipped / 1024, erased / 1024);
+	}
+
+	firehose_zeros_skipped += skipped;
+	firehose_zeros_erased += erased;
+
+	free(segs);
+
+	return ret;
+}
+
+/*
+ * Program an Android sparse image without expanding it
+ */
+static int firehose_program_sparse(struct qdl_device *qdl, struct program *program, int fd)
+{
+	struct sparse_extent *extents;
+	uint64_t total_blks;
+	uint64_t limit;
+	uint64_t start;
+	unsigned count_ext;
+	unsigned blk_sz;
+	int ret;
+
+	ret = sparse_read_extents(fd, (off_t)program->file_offset * program->sector_size,
+				  &blk_sz, &total_blks, &extents, &count_ext);
+	if (ret < 0) {
+		fprintf(stderr, "[PROGRAM] \"%s\" is not a valid sparse image\n", program->filename);
+		return ret;
+	}
+
+	if (blk_sz % program->sector_size) {
+		fprintf(stderr, "[PROGRAM] \"%s\" block size %u isn't a multiple of the sector size\n",
+			program->filename, blk_sz);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!program_start_sector(program, &start)) {
+		fprintf(stderr, "[PROGRAM] sparse image \"%s\" needs a numeric start_sector\n",
+			program->filename);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	limit = total_blks * (blk_sz / program->sector_size);
+	if (program->num_sectors && program->num_sectors < limit) {
+		fprintf(stderr, "[PROGRAM] %s truncated to %d\n",
+			program->label,
+			program->num_sectors * program->sector_size);
+		limit = program->num_sectors;
+	}
+
+	ret = firehose_program_extents(qdl, program, fd, start, blk_sz, limit,
+				       extents, count_ext, "sparse");
+
+out:
+	free(extents);
+	return ret;
+}
+
+/*
+ * Program only the blocks in use of a filesystem image, returning -ENOTSUP
+ * if the image isn't suitable, for it to be programmed in full
+ */
+static int firehose_program_allocated(struct qdl_device *qdl, struct program *program, int fd,
+				      unsigned num_sectors, uint64_t start)
+{
+	struct sparse_extent *extents;
+	uint64_t total_blks;
+	unsigned count_ext;
+	const char *name;
+	unsigned blk_sz;
+	int ret;
+
+	ret = fsmap_read(fd, (off_t)program->file_offset * program->sector_size,
+			 (uint64_t)num_sectors * program->sector_size, FIREHOSE_ZERO_RUN_MIN,
+			 &blk_sz, &total_blks, &extents, &count_ext, &name);
+	if (ret < 0)
+		return -ENOTSUP;
+
+	if (blk_sz % program->sector_size) {
+		free(extents);
+		return -ENOTSUP;
+	}
+
+	ret = firehose_program_extents(qdl, program, fd, start, blk_sz, num_sectors,
+				       extents, count_ext, name);
+	free(extents);
+
+	return ret;
+}
+
+/* Program @num_sectors of a regular image file */
+static int firehose_program_file(struct qdl_device *qdl, struct program *program, int fd,
+				 unsigned num_sectors)
+{
+	uint64_t start;
+	int ret;
+
+	if (qdl_allocated_only && program_start_sector(program, &start)) {
+		ret = firehose_program_allocated(qdl, program, fd, num_sectors, start);
+		if (ret != -ENOTSUP)
+			return ret;
+	}
+
+	if (!program_start_sector(program, &start))
+		return firehose_program_range(qdl, program, fd, num_sectors, NULL, 0, NULL);
+
+	if (firehose_zero_split(program, fd, num_sectors))
+		return firehose_program_split(qdl, program, fd, num_sectors, start);
+
+	return firehose_program_slices(qdl, program, fd, num_sectors, start);
+}
+
+/*
+ * Hash each HASHDB_CHUNK_SIZE chunk of the range of the image to program,
+ * unless cached from an earlier session
+ */
+static uint64_t *firehose_image_hashes(struct program *program, int fd,
+				       unsigned num_sectors, unsigned *count)
+{
+	uint64_t offset = (uint64_t)program->file_offset * program->sector_size;
+	uint64_t length = (uint64_t)num_sectors * program->sector_size;
+	struct xxh64_ctx ctx;
+	struct source *src;
+	const uint8_t *buf;
+	uint64_t *hashes;
+	size_t fill = 0;
+	size_t blen;
+	size_t off;
+	ssize_t len;
+	unsigned n = 0;
+
+	*count = (length + HASHDB_CHUNK_SIZE - 1) / HASHDB_CHUNK_SIZE;
+
+	hashes = calloc(*count ? *count : 1, sizeof(*hashes));
+	if (!hashes)
+		err(1, "failed to allocate image hashes");
+
+	if (hashdb_cache_lookup(fd, offset, length, hashes, *count))
+		return hashes;
+
+	src = firehose_source_open(program, fd, num_sectors, NULL, 0);
+
+	xxh64_init(&ctx, 0);
+	for (;;) {
+		len = source_next(src, (const void **)&buf);
+		if (len < 0)
+			errx(1, "failed to read \"%s\": %s", program->filename, strerror(-len));
+		if (!len)
+			break;
+
+		for (off = 0; off < len; off += blen) {
+			blen = MIN(HASHDB_CHUNK_SIZE - fill, len - off);
+			xxh64_update(&ctx, buf + off, blen);
+
+			fill += blen;
+			if (fill == HASHDB_CHUNK_SIZE && n < *count) {
+				hashes[n++] = firehose_chunk_hash(&ctx);
+				xxh64_init(&ctx, 0);
+				fill = 0;
+			}
+		}
+
+		source_release(src);
+	}
+
+	if (fill && n < *count)
+		hashes[n++] = firehose_chunk_hash(&ctx);
+
+	source_close(src);
+
+	hashdb_cache_store(fd, offset, length, hashes, *count);
+
+	return hashes;
+}
+
+/*
+ * Compare the digest of an unchanged chunk, picked at random, with that of
+ * the storage, catching the storage having been modified since its hashes
+ * were recorded.
+ *
+ * Return: 0 if the chunk matches, 1 if it doesn't, negative errno on failure
+ */
+static int firehose_spot_check(struct qdl_device *qdl, struct program *program, int fd,
+			       unsigned num_sectors, uint64_t start,
+			       const bool *changed, unsigned count, unsigned unchanged)
+{
+	uint8_t expected[SHA256_DIGEST_SIZE];
+	uint8_t actual[SHA256_DIGEST_SIZE];
+	struct sha256_ctx ctx;
+	struct program range;
+	char start_sector[21];
+	struct source *src;
+	const void *buf;
+	unsigned sectors;
+	unsigned pick;
+	unsigned spc;
+	unsigned i;
+	ssize_t len;
+	int ret;
+
+	spc = HASHDB_CHUNK_SIZE / program->sector_size;
+
+	pick = firehose_now() % unchanged;
+	for (i = 0; i < count; i++) {
+		if (!changed[i] && !pick--)
+			break;
+	}
+
+	sectors = MIN(spc, num_sectors - i * spc);
+
+	range = *program;
+	snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + (uint64_t)i * spc);
+	range.start_sector = start_sector;
+	range.file_offset = program->file_offset + i * spc;
+	range.num_sectors = sectors;
+
+	src = firehose_source_open(&range, fd, sectors, NULL, 0);
+
+	sha256_init(&ctx);
+	for (;;) {
+		len = source_next(src, &buf);
+		if (len < 0)
+			errx(1, "failed to read \"%s\": %s", program->filename, strerror(-len));
+		if (!len)
+			break;
+
+		sha256_update(&ctx, buf, len);
+		source_release(src);
+	}
+	sha256_final(&ctx, expected);
+
+	source_close(src);
+
+	ret = firehose_get_digest(qdl, &range, sectors, actual);
+	if (ret < 0)
+		return ret;
+
+	return memcmp(expected, actual, SHA256_DIGEST_SIZE) ? 1 : 0;
+}
+
+/*
+ * Program the whole image, with nothing recorded of the storage to compare
+ * it with, recording the image's hashes as taken while it's programmed
+ * rather than reading it ahead of programming it.
+ */
+static int firehose_program_hashing(struct qdl_device *qdl, struct program *program,
+				    int fd, unsigned num_sectors, uint64_t start)
+{
+	uint64_t offset = (uint64_t)program->file_offset * program->sector_size;
+	uint64_t length = (uint64_t)num_sectors * program->sector_size;
+	unsigned failures = firehose_verify_failures;
+	struct firehose_hasher hasher = {0};
+	int ret;
+
+	hasher.file_offset = program->file_offset;
+	hasher.count = (length + HASHDB_CHUNK_SIZE - 1) / HASHDB_CHUNK_SIZE;
+	hasher.hashes = calloc(hasher.count ? hasher.count : 1, sizeof(*hasher.hashes));
+	if (!hasher.hashes)
+		err(1, "failed to allocate image hashes");
+	xxh64_init(&hasher.ctx, 0);
+
+	firehose_hasher = &hasher;
+	ret = firehose_program_file(qdl, program, fd, num_sectors);
+	firehose_hasher = NULL;
+
+	if (hasher.fill && hasher.n < hasher.count)
+		hasher.hashes[hasher.n++] = firehose_chunk_hash(&hasher.ctx);
+
+	/*
+	 * Parts left out, e.g. by --allocated-only or a resumed session, hold
+	 * whatever was there before
+	 */
+	if (!ret && firehose_verify_failures == failures && !hasher.broken &&
+	    hasher.pos == length && hasher.n == hasher.count) {
+		hashdb_record(program->partition, program->sector_size, start,
+			      num_sectors, hasher.hashes, hasher.count);
+		hashdb_cache_store(fd, offset, length, hasher.hashes, hasher.count);
+	}
+
+	free(hasher.hashes);
+
+	return ret;
+}
+
+/*
+ * Program only the chunks of the image that differ from the hashes recorded
+ * of the storage by an earlier session, recording the image's hashes.
+ *
+ * The image has to be hashed ahead of programming it, to know which chunks
+ * to leave out. The hashes are cached per image file, so each version of an
+ * image is only read an extra time once, on the first device it's flashed
+ * to with history to compare against.
+ */
+static int firehose_program_incremental(struct qdl_device *qdl, struct program *program,
+					int fd, unsigned num_sectors, uint64_t start)
+{
+	unsigned failures = firehose_verify_failures;
+	struct program range;
+	char start_sector[21];
+	uint64_t programmed = 0;
+	uint64_t *hashes;
+	uint64_t first;
+	uint64_t sectors;
+	unsigned count;
+	unsigned spc;
+	unsigned i;
+	unsigned j;
+	bool *changed;
+	int unchanged;
+	int ret = 0;
+
+	if (!hashdb_known(program->partition, program->sector_size, start))
+		return firehose_program_hashing(qdl, program, fd, num_sectors, start);
+
+	spc = HASHDB_CHUNK_SIZE / program->sector_size;
+
+	hashes = firehose_image_hashes(program, fd, num_sectors, &count);
+
+	changed = calloc(count ? count : 1, sizeof(*changed));
+	if (!changed)
+		err(1, "failed to allocate image hashes");
+
+	unchanged = hashdb_compare(program->partition, program->sector_size, start,
+				   hashes, count, changed);
+	if (unchanged > 0) {
+		ret = firehose_spot_check(qdl, program, fd, num_sectors, start,
+					  changed, count, unchanged);
+		if (ret < 0) {
+			fprintf(stderr, "[INCREMENTAL] programmer can't report the digest of \"%s\", programming it in full\n",
+				program->label);
+			unchanged = 0;
+		} else if (ret > 0) {
+			fprintf(stderr, "[INCREMENTAL] \"%s\" was modified since last programmed, programming it in full\n",
+				program->label);
+			unchanged = 0;
+		}
+	}
+
+	if (unchanged <= 0) {
+		ret = firehose_program_file(qdl, program, fd, num_sectors);
+		goto out;
+	}
+
+	ret = 0;
+	for (i = 0; i < count && !ret; i = j) {
+		if (!changed[i]) {
+			j = i + 1;
+			continue;
+		}
+
+		for (j = i; j < count && changed[j]; j++)
+			;
+
+		first = (uint64_t)i * spc;
+		sectors = MIN((uint64_t)j * spc, num_sectors) - first;
+
+		range = *program;
+		snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + first);
+		range.start_sector = start_sector;
+		range.file_offset = program->file_offset + first;
+		range.num_sectors = sectors;
+
+		ret = firehose_program_slices(qdl, &range, fd, sectors, start + first);
+		programmed += sectors;
+	}
+
+	if (!ret) {
+		fprintf(stderr, "[INCREMENTAL] \"%s\": %d of %u chunks unchanged, %" PRIu64 " kB not programmed\n",
+			program->label, unchanged, count,
+			(num_sectors - programmed) * program->sector_size / 1024);
+		firehose_unchanged += (num_sectors - programmed) * program->sector_size;
+	}
+
+out:
+	/* Chunks left out by --allocated-only hold whatever was there before */
+	if (!ret && firehose_verify_failures == failures &&
+	    (unchanged > 0 || !qdl_allocated_only)) {
+		hashdb_record(program->partition, program->sector_size, start,
+			      num_sectors, hashes, count);
 	}
 
+	free(changed);
+	free(hashes);
+
 	return ret;
 }
 
-static int firehose_write(struct qdl_device *qdl, xmlDoc *doc)
+struct firehose_probe {
+	uint64_t first;
+	uint64_t count;
+
+	/* host side hashing of the range, on a worker thread */
+	int fd;
+	off_t offset;
+	uint64_t length;
+	unsigned sector_size;
+	uint64_t ns;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	uint8_t device[SHA256_DIGEST_SIZE];
+};
+
+static void firehose_probe_hash(void *data)
 {
-	int saved_errno;
-	xmlChar *s;
-	int len;
-	int ret;
+	struct firehose_probe *probe = data;
+	struct sha256_ctx ctx;
+	struct source *src;
+	const void *buf;
+	uint64_t t0;
+	ssize_t len;
+
+	t0 = firehose_now();
+
+	/* The range is zero padded past the end of the image by the source */
+	src = source_open(probe->fd, probe->offset, probe->length, probe->sector_size,
+			  firehose_chunk_size(probe->sector_size));
+	if (!src)
+		err(1, "failed to open image source");
+
+	sha256_init(&ctx);
+	for (;;) {
+		len = source_next(src, &buf);
+		if (len < 0)
+			errx(1, "failed to read image: %s", strerror(-len));
+		if (!len)
+			break;
 
-	xmlDocDumpMemory(doc, &s, &len);
+		sha256_update(&ctx, buf, len);
+		source_release(src);
+	}
+	sha256_final(&ctx, probe->digest);
 
-	if (qdl_debug)
-		fprintf(stderr, "FIREHOSE WRITE: %s\n", s);
+	source_close(src);
 
-	ret = qdl_write(qdl, s, len, true);
-	saved_errno = errno;
-	xmlFree(s);
-	return ret < 0 ? -saved_errno : 0;
+	probe->ns = firehose_now() - t0;
 }
 
-static int firehose_nop_parser(xmlNode *node)
+static double firehose_probe_cost(uint64_t bytes, unsigned nprobes, unsigned threads)
 {
-	xmlChar *value;
+	double rate = MIN(firehose_digest_rate, firehose_host_hash_rate * MIN(nprobes, threads));
 
-	value = xmlGetProp(node, (xmlChar*)"value");
-	return !!xmlStrcmp(value, (xmlChar*)"ACK");
+	return nprobes * firehose_digest_overhead + bytes / rate;
 }
 
-static size_t max_payload_size = 1048576;
+static double firehose_program_cost(uint64_t bytes)
+{
+	return firehose_program_overhead + bytes / firehose_program_rate;
+}
 
-/**
- * firehose_configure_response_parser() - parse a configure response
- * @node:	response xmlNode
- *
- * Return: max size supported by the remote, or negative errno on failure
+/*
+ * A differing range is probed further if it pays off should only one of its
+ * parts differ, otherwise it's programmed as a whole
  */
-static int firehose_configure_response_parser(xmlNode *node)
+static bool firehose_probe_split(uint64_t bytes, unsigned threads)
 {
-	xmlChar *payload;
-	xmlChar *value;
-	size_t max_size;
+	uint64_t part = bytes / FIREHOSE_PROBE_FANOUT;
 
-	value = xmlGetProp(node, (xmlChar*)"value");
-	payload = xmlGetProp(node, (xmlChar*)"MaxPayloadSizeToTargetInBytes");
-	if (!value || !payload)
-		return -EINVAL;
+	if (part < FIREHOSE_PROBE_MIN)
+		return false;
 
-	max_size = strtoul((char*)payload, NULL, 10);
-
-	/*
-	 * When receiving an ACK the remote may indicate that we should attempt
-	 * a larger payload size
-	 */
-	if (!xmlStrcmp(value, (xmlChar*)"ACK")) {
-		payload = xmlGetProp(node, (xmlChar*)"MaxPayloadSizeToTargetInBytesSupported");
-		if (!payload)
-			return -EINVAL;
+	return firehose_probe_cost(bytes, FIREHOSE_PROBE_FANOUT, threads) +
+	       firehose_program_cost(part) < firehose_program_cost(bytes);
+}
 
-		max_size = strtoul((char*)payload, NULL, 10);
+/* Split @count sectors from @first into @n parts, aligned to FIREHOSE_PROBE_MIN */
+static void firehose_probe_add(struct firehose_probe **probes, unsigned *nprobes,
+			       uint64_t first, uint64_t count, unsigned n,
+			       unsigned sector_size)
+{
+	uint64_t align = MAX(FIREHOSE_PROBE_MIN / sector_size, 1);
+	uint64_t part;
+	uint64_t off;
+
+	part = (count + n - 1) / n;
+	part = (part + align - 1) / align * align;
+
+	*probes = realloc(*probes, (*nprobes + n) * sizeof(**probes));
+	if (!*probes)
+		err(1, "failed to allocate probes");
+
+	for (off = 0; off < count; off += part) {
+		memset(&(*probes)[*nprobes], 0, sizeof(**probes));
+		(*probes)[*nprobes].first = first + off;
+		(*probes)[*nprobes].count = MIN(part, count - off);
+		(*nprobes)++;
 	}
+}
 
-	return max_size;
+static int firehose_probe_cmp(const void *a, const void *b)
+{
+	const struct firehose_probe *pa = a;
+	const struct firehose_probe *pb = b;
+
+	if (pa->first != pb->first)
+		return pa->first < pb->first ? -1 : 1;
+
+	return 0;
 }
 
-static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size, bool skip_storage_init, const char *storage)
+/*
+ * Compare digests of the storage, reported by the programmer, with those of
+ * the image, narrowing down the differing ranges like a Merkle tree: each
+ * differing range is probed again in parts, for as long as that's expected
+ * to take less time than programming it. The host hashes each range while
+ * the programmer does the same, and only the differing ranges are
+ * programmed.
+ */
+static int firehose_program_probe(struct qdl_device *qdl, struct program *program,
+				  int fd, unsigned num_sectors, uint64_t start)
 {
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
-	int ret;
+	uint64_t bytes = (uint64_t)num_sectors * program->sector_size;
+	struct firehose_probe *probes = NULL;
+	struct firehose_probe *diffs = NULL;
+	struct firehose_probe *next = NULL;
+	struct firehose_probe *probe;
+	struct worker_pool *pool;
+	struct program range;
+	char start_sector[21];
+	uint64_t programmed = 0;
+	uint64_t level_bytes;
+	uint64_t device_ns;
+	uint64_t host_ns;
+	uint64_t first;
+	uint64_t count;
+	uint64_t t0;
+	unsigned requests = 0;
+	unsigned nprobes = 0;
+	unsigned ndiffs = 0;
+	unsigned nnext;
+	unsigned threads;
+	unsigned best = 1;
+	unsigned i;
+	unsigned j;
+	unsigned n;
+	long ncpus;
+	bool split;
+	int ret = 0;
+
+	if (firehose_probe_unsupported || decompress_detect(fd) != DECOMPRESS_NONE)
+		return firehose_program_file(qdl, program, fd, num_sectors);
 
-	doc = xmlNewDoc((xmlChar*)"1.0");
-	root = xmlNewNode(NULL, (xmlChar*)"data");
-	xmlDocSetRootElement(doc, root);
+	/*
+	 * Ranges read from the mapping are hashed in parallel. Reading them
+	 * directly or through the read queue takes buffers of the pool and
+	 * changes the flags of the file, so those are hashed one at a time.
+	 */
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = ncpus > 0 ? ncpus : 1;
+	if (source_direct != SOURCE_DIRECT_NEVER || source_queue_depth)
+		threads = 1;
+
+	/* Probe first in as many parts as makes it quickest to hash it all */
+	for (n = 2; n <= FIREHOSE_PROBE_FANOUT * 8 && bytes / n >= FIREHOSE_PROBE_MIN; n *= 2) {
+		if (firehose_probe_cost(bytes, n, threads) < firehose_probe_cost(bytes, best, threads))
+			best = n;
+	}
 
-	node = xmlNewChild(root, NULL, (xmlChar*)"configure", NULL);
-	xml_setpropf(node, "MemoryName", storage);
-	xml_setpropf(node, "MaxPayloadSizeToTargetInBytes", "%d", payload_size);
-	xml_setpropf(node, "verbose", "%d", 0);
-	xml_setpropf(node, "ZLPAwareHost", "%d", 1);
-	xml_setpropf(node, "SkipStorageInit", "%d", skip_storage_init);
+	if (firehose_probe_cost(bytes, best, threads) >= firehose_program_cost(bytes))
+		return firehose_program_file(qdl, program, fd, num_sectors);
 
-	ret = firehose_write(qdl, doc);
-	xmlFreeDoc(doc);
-	if (ret < 0)
-		return ret;
+	firehose_probe_add(&probes, &nprobes, 0, num_sectors, best, program->sector_size);
 
-	return firehose_read(qdl, -1, firehose_configure_response_parser);
-}
+	pool = worker_pool_create(threads);
 
-static int firehose_configure(struct qdl_device *qdl, bool skip_storage_init, const char *storage)
-{
-	int ret;
+	while (nprobes && !ret) {
+		level_bytes = 0;
+		device_ns = 0;
+		host_ns = 0;
 
-	ret = firehose_send_configure(qdl, max_payload_size, skip_storage_init, storage);
-	if (ret < 0)
-		return ret;
+		/* The programmer works through its digests while the host hashes */
+		for (i = 0; i < nprobes && !ret; i++) {
+			probe = &probes[i];
+			probe->fd = fd;
+			probe->offset = ((off_t)program->file_offset + probe->first) * program->sector_size;
+			probe->length = probe->count * program->sector_size;
+			probe->sector_size = program->sector_size;
+			worker_pool_submit(pool, firehose_probe_hash, probe);
 
-	/* Retry if remote proposed different size */
-	if (ret != max_payload_size) {
-		ret = firehose_send_configure(qdl, ret, skip_storage_init, storage);
-		if (ret < 0)
-			return ret;
+			range = *program;
+			snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + probe->first);
+			range.start_sector = start_sector;
+			range.num_sectors = probe->count;
 
-		max_payload_size = ret;
-	}
+			t0 = firehose_now();
+			ret = firehose_get_digest(qdl, &range, probe->count, probe->device);
+			device_ns += firehose_now() - t0;
 
-	if (qdl_debug) {
-		fprintf(stderr, "[CONFIGURE] max payload size: %zu\n",
-			max_payload_size);
-	}
+			level_bytes += probe->length;
+			requests++;
+		}
 
-	return 0;
-}
+		worker_pool_wait(pool);
 
-#define MIN(x, y) ((x) < (y) ? (x) : (y))
-#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+		if (ret)
+			break;
 
-static int firehose_program(struct qdl_device *qdl, struct program *program, int fd)
-{
-	unsigned num_sectors;
-	struct stat sb;
-	size_t chunk_size;
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
-	void *buf;
-	time_t t0;
-	time_t t;
-	int left;
-	int ret;
-	int n;
+		for (i = 0; i < nprobes; i++)
+			host_ns += probes[i].ns;
 
-	num_sectors = program->num_sectors;
+		/* Refine the estimates by what was just measured */
+		if (device_ns > nprobes * firehose_digest_overhead * 1e9) {
+			firehose_digest_rate = (firehose_digest_rate + level_bytes /
+						(device_ns / 1e9 - nprobes * firehose_digest_overhead)) / 2;
+		}
+		if (host_ns)
+			firehose_host_hash_rate = (firehose_host_hash_rate + level_bytes * 1e9 / host_ns) / 2;
+
+		for (i = 0, n = 0; i < nprobes; i++)
+			n += !!memcmp(probes[i].digest, probes[i].device, SHA256_DIGEST_SIZE);
+
+		/* Differences all over aren't worth narrowing down any further */
+		split = nprobes < FIREHOSE_PROBE_FANOUT || n * 2 <= nprobes;
+
+		nnext = 0;
+		for (i = 0; i < nprobes; i++) {
+			probe = &probes[i];
+			if (!memcmp(probe->digest, probe->device, SHA256_DIGEST_SIZE))
+				continue;
+
+			if (split && firehose_probe_split(probe->length, threads)) {
+				firehose_probe_add(&next, &nnext, probe->first, probe->count,
+						   FIREHOSE_PROBE_FANOUT, program->sector_size);
+			} else {
+				diffs = realloc(diffs, (ndiffs + 1) * sizeof(*diffs));
+				if (!diffs)
+					err(1, "failed to allocate probes");
+				diffs[ndiffs++] = *probe;
+			}
+		}
 
-	ret = fstat(fd, &sb);
-	if (ret < 0)
-		err(1, "failed to stat \"%s\"\n", program->filename);
+		free(probes);
+		probes = next;
+		nprobes = nnext;
+		next = NULL;
+	}
 
-	num_sectors = (sb.st_size + program->sector_size - 1) / program->sector_size;
+	worker_pool_destroy(pool);
+	free(probes);
 
-	if (program->num_sectors && num_sectors > program->num_sectors) {
-		fprintf(stderr, "[PROGRAM] %s truncated to %d\n",
-			program->label,
-			program->num_sectors * program->sector_size);
-		num_sectors = program->num_sectors;
+	if (ret) {
+		fprintf(stderr, "[INCREMENTAL] programmer can't report the digest of \"%s\", programming in full\n",
+			program->label);
+		firehose_probe_unsupported = true;
+		free(diffs);
+		return firehose_program_file(qdl, program, fd, num_sectors);
 	}
 
-	buf = malloc(max_payload_size);
-	if (!buf)
-		err(1, "failed to allocate sector buffer");
+	/* Program the differing ranges in order, merging adjacent ones */
+	qsort(diffs, ndiffs, sizeof(*diffs), firehose_probe_cmp);
 
-	doc = xmlNewDoc((xmlChar*)"1.0");
-	root = xmlNewNode(NULL, (xmlChar*)"data");
-	xmlDocSetRootElement(doc, root);
+	for (i = 0; i < ndiffs && !ret; i = j) {
+		first = diffs[i].first;
+		count = diffs[i].count;
+		for (j = i + 1; j < ndiffs && diffs[j].first == first + count; j++)
+			count += diffs[j].count;
 
-	node = xmlNewChild(root, NULL, (xmlChar*)"program", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
-	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
-	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
-	xml_setpropf(node, "start_sector", "%s", program->start_sector);
-	if (program->filename)
-		xml_setpropf(node, "filename", "%s", program->filename);
+		range = *program;
+		snprintf(start_sector, sizeof(start_sector), "%" PRIu64, start + first);
+		range.start_sector = start_sector;
+		range.file_offset = program->file_offset + first;
+		range.num_sectors = count;
 
-	ret = firehose_write(qdl, doc);
-	if (ret < 0) {
-		fprintf(stderr, "[PROGRAM] failed to write program command\n");
-		goto out;
+		ret = firehose_program_slices(qdl, &range, fd, count, start + first);
+		programmed += count;
 	}
 
-	ret = firehose_read(qdl, -1, firehose_nop_parser);
-	if (ret) {
-		fprintf(stderr, "[PROGRAM] failed to setup programming\n");
-		goto out;
-	}
+	free(diffs);
 
-	t0 = time(NULL);
+	if (!ret) {
+		fprintf(stderr, "[INCREMENTAL] \"%s\": %u digests compared, %" PRIu64 " kB unchanged, %" PRIu64 " kB programmed\n",
+			program->label, requests,
+			(num_sectors - programmed) * program->sector_size / 1024,
+			programmed * program->sector_size / 1024);
+		firehose_unchanged += (num_sectors - programmed) * program->sector_size;
+	}
 
-	lseek(fd, program->file_offset * program->sector_size, SEEK_SET);
-	left = num_sectors;
-	while (left > 0) {
-		chunk_size = MIN(max_payload_size / program->sector_size, left);
+	return ret;
+}
 
-		n = read(fd, buf, chunk_size * program->sector_size);
-		if (n < 0)
-			err(1, "failed to read");
+static int firehose_program_image(struct qdl_device *qdl, struct program *program, int fd)
+{
+	unsigned num_sectors;
+	uint64_t start;
+	uint64_t size;
+	int ret;
 
-		if (n < max_payload_size)
-			memset(buf + n, 0, max_payload_size - n);
+	if (program->erase)
+		return firehose_erase(qdl, program);
 
-		n = qdl_write(qdl, buf, chunk_size * program->sector_size, true);
-		if (n < 0)
-			err(1, "failed to write");
+	if (program->sparse)
+		return firehose_program_sparse(qdl, program, fd);
 
-		if (n != chunk_size * program->sector_size)
-			err(1, "failed to write full sector");
+	/* A piped image is streamed once, sized by the program entry */
+	if (source_is_stream(fd)) {
+		if (!program->num_sectors) {
+			fprintf(stderr, "[PROGRAM] \"%s\" is read from a pipe and needs num_partition_sectors\n",
+				program->label);
+			return -EINVAL;
+		}
 
-		left -= chunk_size;
+		return firehose_program_range(qdl, program, fd, program->num_sectors, NULL, 0, NULL);
 	}
 
-	t = time(NULL) - t0;
+	ret = source_file_size(fd, &size);
+	if (ret < 0)
+		errx(1, "failed to get the size of \"%s\": %s", program->filename, strerror(-ret));
 
-	ret = firehose_read(qdl, -1, firehose_nop_parser);
-	if (ret) {
-		fprintf(stderr, "[PROGRAM] failed\n");
-	} else if (t) {
-		fprintf(stderr,
-			"[PROGRAM] flashed \"%s\" successfully at %ldkB/s\n",
+	num_sectors = program_sector_count(program, size);
+	if (program->num_sectors && (uint64_t)num_sectors * program->sector_size < size) {
+		fprintf(stderr, "[PROGRAM] %s truncated to %d\n",
 			program->label,
-			program->sector_size * num_sectors / t / 1024);
-	} else {
-		fprintf(stderr, "[PROGRAM] flashed \"%s\" successfully\n",
-			program->label);
+			program->num_sectors * program->sector_size);
 	}
 
-out:
-	xmlFreeDoc(doc);
+	if (qdl_incremental == QDL_INCREMENTAL_HISTORY && hashdb_enabled() &&
+	    program_start_sector(program, &start))
+		return firehose_program_incremental(qdl, program, fd, num_sectors, start);
+
+	if (qdl_incremental == QDL_INCREMENTAL_PROBE && program_start_sector(program, &start))
+		return firehose_program_probe(qdl, program, fd, num_sectors, start);
+
+	return firehose_program_file(qdl, program, fd, num_sectors);
+}
+
+static int firehose_program(struct qdl_device *qdl, struct program *program, int fd)
+{
+	uint64_t t0;
+	int ret;
+
+	firehose_timing_begin(program);
+	t0 = firehose_now();
+
+	ret = firehose_program_image(qdl, program, fd);
+
+	firehose_timing_end(firehose_now() - t0);
+
 	return ret;
 }
 
 static int firehose_apply_patch(struct qdl_device *qdl, struct patch *patch)
 {
+	struct journal_op op = {
+		.kind = "patch",
+		.partition = patch->partition,
+		.start_sector = patch->start_sector,
+		.count = patch->byte_offset,
+	};
+	char value[256];
+	uint64_t start;
 	xmlNode *root;
 	xmlNode *node;
+	char *end;
 	xmlDoc *doc;
 	int ret;
 
+	snprintf(value, sizeof(value), "%u %s", patch->size_in_bytes, patch->value);
+	op.digest = xxh64(value, strlen(value), 0);
+	if (journal_replay(&op)) {
+		fprintf(stderr, "[RESUME] \"%s\" already applied, skipping\n", patch->what);
+		return 0;
+	}
+
+	/* Patches relative to the end of the storage don't touch recorded ranges */
+	start = strtoull(patch->start_sector, &end, 10);
+	if (*patch->start_sector && !*end && patch->sector_size) {
+		hashdb_invalidate(patch->partition, patch->sector_size,
+				  start + patch->byte_offset / patch->sector_size,
+				  (patch->byte_offset % patch->sector_size + patch->size_in_bytes +
+				   patch->sector_size - 1) / patch->sector_size);
+	}
+
 	printf("%s\n", patch->what);
 
 	doc = xmlNewDoc((xmlChar*)"1.0");
@@ -419,6 +2991,8 @@ static int firehose_apply_patch(struct qdl_device *qdl, struct patch *patch)
 	ret = firehose_read(qdl, -1, firehose_nop_parser);
 	if (ret)
 		fprintf(stderr, "[APPLY PATCH] %d\n", ret);
+	else
+		journal_record(&op);
 
 out:
 	xmlFreeDoc(doc);
@@ -548,7 +3122,14 @@ static int firehose_set_bootable(struct qdl_device *qdl, int part)
 	return 0;
 }
 
-static int firehose_reset(struct qdl_device *qdl)
+/**
+ * firehose_power() - request a power state change of the device
+ * @qdl:	qdl device handle
+ * @action:	"reset" to reboot, "reset_to_edl" to reboot back into EDL
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+static int firehose_power(struct qdl_device *qdl, const char *action)
 {
 	xmlNode *root;
 	xmlNode *node;
@@ -560,7 +3141,7 @@ static int firehose_reset(struct qdl_device *qdl)
 	xmlDocSetRootElement(doc, root);
 
 	node = xmlNewChild(root, NULL, (xmlChar*)"power", NULL);
-	xml_setpropf(node, "value", "reset");
+	xml_setpropf(node, "value", "%s", action);
 
 	ret = firehose_write(qdl, doc);
 	xmlFreeDoc(doc);
@@ -570,15 +3151,80 @@ static int firehose_reset(struct qdl_device *qdl)
 	return firehose_read(qdl, -1, firehose_nop_parser);
 }
 
+/* Set when firehose_probe() found the programmer to be running already */
+static bool firehose_running;
+
+/**
+ * firehose_probe() - check if the device is already running the programmer
+ * @qdl:	qdl device handle
+ *
+ * A device which was left in firehose by a previous session doesn't send a
+ * Sahara HELLO, so rather than uploading the programmer again check if it
+ * responds to a firehose <nop>.
+ *
+ * Return: 0 if firehose responded, negative errno otherwise
+ */
+int firehose_probe(struct qdl_device *qdl)
+{
+	char buf[4096];
+	xmlNode *root;
+	xmlDoc *doc;
+	int ret;
+
+	/* Discard anything left over from the previous session */
+	while (qdl_read(qdl, buf, sizeof(buf), 100) >= 0)
+		;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+	xmlNewChild(root, NULL, (xmlChar*)"nop", NULL);
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	ret = firehose_read(qdl, 1000, firehose_nop_parser);
+	if (ret < 0)
+		return ret;
+
+	firehose_running = true;
+
+	return 0;
+}
+
 int firehose_run(struct qdl_device *qdl, const char *incdir, const char *storage)
 {
+	bool provisioned = false;
 	int bootable;
 	int ret;
 
-	/* Wait for the firehose payload to boot */
-	sleep(3);
+	if (!firehose_running) {
+		/* Wait for the firehose payload to boot */
+		sleep(3);
 
-	firehose_read(qdl, 1000, NULL);
+		firehose_read(qdl, 1000, NULL);
+	}
+	firehose_running = false;
+
+	if (dump_need_execute()) {
+		ret = firehose_configure(qdl, false, storage);
+		if (ret)
+			return ret;
+
+		firehose_pool_create();
+		firehose_worker = worker_create();
+		ret = dump_execute(qdl, firehose_dump);
+		worker_destroy(firehose_worker);
+		firehose_worker = NULL;
+		firehose_pool_destroy();
+		if (ret)
+			return ret;
+
+		firehose_power(qdl, "reset");
+		return 0;
+	}
 
 	if(ufs_need_provisioning()) {
 		ret = firehose_configure(qdl, true, storage);
@@ -590,17 +3236,75 @@ int firehose_run(struct qdl_device *qdl, const char *incdir, const char *storage
 			printf("UFS provisioning succeeded\n");
 		else
 			printf("UFS provisioning failed\n");
-		return ret;
+
+		if (ret || (!program_need_execute() && !patch_need_execute()))
+			return ret;
+
+		provisioned = true;
 	}
 
+	/* Initialize the storage, picking up any new UFS configuration */
 	ret = firehose_configure(qdl, false, storage);
+	if (ret && provisioned) {
+		/*
+		 * The programmer can't use the new configuration without a
+		 * reset, come back in EDL and let the caller restart the session
+		 */
+		printf("storage not available after provisioning, resetting device\n");
+		firehose_power(qdl, "reset_to_edl");
+		return -EAGAIN;
+	}
 	if (ret)
 		return ret;
 
+	/*
+	 * Erased content is checked per partition as zero ranges come up;
+	 * provisioning might have changed the answers since last time
+	 */
+	memset(firehose_erased_content, 0, sizeof(firehose_erased_content));
+	firehose_session = qdl;
+
+	/* The zeros pass reads the images through the session's buffers */
+	firehose_pool_create();
+
+	ret = plan_optimize(PLAN_STAGE_ERASED_ZERO, incdir, firehose_erased_zero);
+	if (ret) {
+		firehose_pool_destroy();
+		return ret;
+	}
+
+	if (qdl_verify != QDL_VERIFY_NONE)
+		firehose_worker = worker_create();
+
 	ret = program_execute(qdl, firehose_program, incdir);
+
+	worker_destroy(firehose_worker);
+	firehose_worker = NULL;
+	firehose_pool_destroy();
+
+	firehose_timing_summary();
+	firehose_timing_free();
+
 	if (ret)
 		return ret;
 
+	if (firehose_zeros_skipped || firehose_zeros_erased) {
+		fprintf(stderr, "[PROGRAM] %" PRIu64 " kB not transferred, %" PRIu64 " kB skipped and %" PRIu64 " kB erased\n",
+			(firehose_zeros_skipped + firehose_zeros_erased) / 1024,
+			firehose_zeros_skipped / 1024, firehose_zeros_erased / 1024);
+	}
+
+	if (firehose_unchanged) {
+		fprintf(stderr, "[INCREMENTAL] %" PRIu64 " kB unchanged since last programmed, not transferred\n",
+			firehose_unchanged / 1024);
+	}
+
+	if (firehose_verify_failures) {
+		fprintf(stderr, "[VERIFY] %u partition(s) failed verification\n",
+			firehose_verify_failures);
+		return -EIO;
+	}
+
 	ret = patch_execute(qdl, firehose_apply_patch);
 	if (ret)
 		return ret;
@@ -611,7 +3315,7 @@ int firehose_run(struct qdl_device *qdl, const char *incdir, const char *storage
 	else
 		firehose_set_bootable(qdl, bootable);
 
-	firehose_reset(qdl);
+	firehose_power(qdl, "reset");
 
 	return 0;
 }
@@ -0,0 +1,656 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fsmap.h"
+
+/*
+ * Raw filesystem images are mostly free space. The allocation metadata of
+ * ext4 (block bitmaps) and f2fs (segment information table) tells which
+ * blocks are in use, the image is then described as the extents of an
+ * expanded sparse image: in use blocks as raw extents, read from the image,
+ * and free blocks as don't care extents.
+ *
+ * Filesystem metadata is always kept, as is everything following the
+ * filesystem in the image, e.g. an AVB hashtree and footer. Anything that
+ * isn't understood, such as an ext4 journal in need of recovery, results in
+ * the image being programmed in full.
+ */
+#define EXT4_SUPER_MAGIC		0xef53
+#define EXT4_SUPER_OFFSET		1024
+
+#define EXT4_COMPAT_SPARSE_SUPER2	0x0200
+#define EXT4_INCOMPAT_RECOVER		0x0004
+#define EXT4_INCOMPAT_META_BG		0x0010
+#define EXT4_INCOMPAT_64BIT		0x0080
+#define EXT4_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT4_RO_COMPAT_GDT_CSUM		0x0010
+#define EXT4_RO_COMPAT_BIGALLOC		0x0200
+#define EXT4_RO_COMPAT_METADATA_CSUM	0x0400
+
+#define EXT4_BG_BLOCK_UNINIT		0x0002
+
+#define F2FS_SUPER_MAGIC		0xf2f52010
+#define F2FS_SUPER_OFFSET		1024
+#define F2FS_BLKSIZE			4096
+
+#define F2FS_CP_UMOUNT_FLAG		0x0001
+#define F2FS_CP_COMPACT_SUM_FLAG	0x0004
+#define F2FS_CP_LARGE_NAT_BITMAP_FLAG	0x0400
+
+#define F2FS_SIT_ENTRY_SIZE		74
+#define F2FS_SIT_ENTRY_PER_BLOCK	(F2FS_BLKSIZE / F2FS_SIT_ENTRY_SIZE)
+#define F2FS_SIT_VBLOCKS_MASK		0x03ff
+#define F2FS_SIT_JOURNAL_ENTRY_SIZE	(4 + F2FS_SIT_ENTRY_SIZE)
+#define F2FS_SIT_JOURNAL_ENTRIES	6
+#define F2FS_SUM_JOURNAL_SIZE		507
+#define F2FS_SUM_ENTRIES_SIZE		(512 * 7)
+#define F2FS_CURSEG_COLD_DATA		2
+#define F2FS_NR_CURSEG_TYPE		3
+
+struct fsmap {
+	int fd;
+	off_t offset;
+	uint64_t size;
+
+	unsigned blk_sz;
+	uint64_t nblocks;
+	uint8_t *used;
+};
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static int fsmap_pread(struct fsmap *map, void *buf, size_t len, uint64_t pos)
+{
+	ssize_t n;
+
+	n = pread(map->fd, buf, len, map->offset + pos);
+	if (n < 0)
+		return -errno;
+	if ((size_t)n != len)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int fsmap_read_block(struct fsmap *map, void *buf, uint64_t block)
+{
+	return fsmap_pread(map, buf, map->blk_sz, block * map->blk_sz);
+}
+
+static void fsmap_mark(struct fsmap *map, uint64_t block, uint64_t count)
+{
+	uint64_t end;
+
+	if (block >= map->nblocks)
+		return;
+
+	end = count < map->nblocks - block ? block + count : map->nblocks;
+	for (; block < end; block++)
+		map->used[block / 8] |= 1 << (block % 8);
+}
+
+static bool fsmap_used(struct fsmap *map, uint64_t block)
+{
+	return map->used[block / 8] & (1 << (block % 8));
+}
+
+static bool ext4_is_power_of(unsigned group, unsigned base)
+{
+	while (group > 1 && !(group % base))
+		group /= base;
+
+	return group == 1;
+}
+
+static bool ext4_has_super(const uint8_t *sb, unsigned group)
+{
+	if (group == 0)
+		return true;
+
+	if (get_le32(sb + 0x5c) & EXT4_COMPAT_SPARSE_SUPER2)
+		return group == get_le32(sb + 0x24c) || group == get_le32(sb + 0x250);
+
+	if (!(get_le32(sb + 0x64) & EXT4_RO_COMPAT_SPARSE_SUPER))
+		return true;
+
+	return group == 1 || ext4_is_power_of(group, 3) ||
+	       ext4_is_power_of(group, 5) || ext4_is_power_of(group, 7);
+}
+
+static int fsmap_ext4(struct fsmap *map, uint64_t *fs_blocks)
+{
+	uint64_t block_bitmap;
+	uint64_t inode_bitmap;
+	uint64_t inode_table;
+	unsigned itable_blocks;
+	unsigned reserved_gdt;
+	unsigned gdt_blocks;
+	unsigned desc_size;
+	unsigned inode_size;
+	uint64_t first_data;
+	uint32_t ro_compat;
+	uint32_t incompat;
+	unsigned ngroups;
+	uint64_t blocks;
+	uint64_t start;
+	uint64_t count;
+	uint8_t *bitmap = NULL;
+	uint8_t *gdt = NULL;
+	const uint8_t *desc;
+	uint8_t sb[1024];
+	unsigned bpg;
+	unsigned ipg;
+	unsigned g;
+	uint64_t i;
+	bool csum;
+	int ret;
+
+	ret = fsmap_pread(map, sb, sizeof(sb), EXT4_SUPER_OFFSET);
+	if (ret < 0)
+		return ret;
+
+	if (get_le16(sb + 0x38) != EXT4_SUPER_MAGIC || get_le32(sb + 0x18) > 6)
+		return -ENOTSUP;
+
+	incompat = get_le32(sb + 0x60);
+	ro_compat = get_le32(sb + 0x64);
+
+	/* A journal to replay, or unusual layouts, are left to the filesystem */
+	if (incompat & (EXT4_INCOMPAT_RECOVER | EXT4_INCOMPAT_META_BG) ||
+	    ro_compat & EXT4_RO_COMPAT_BIGALLOC)
+		return -ENOTSUP;
+
+	map->blk_sz = 1024 << get_le32(sb + 0x18);
+
+	blocks = get_le32(sb + 0x04);
+	if (incompat & EXT4_INCOMPAT_64BIT)
+		blocks |= (uint64_t)get_le32(sb + 0x150) << 32;
+
+	first_data = get_le32(sb + 0x14);
+	bpg = get_le32(sb + 0x20);
+	ipg = get_le32(sb + 0x28);
+	inode_size = get_le32(sb + 0x4c) ? get_le16(sb + 0x58) : 128;
+	desc_size = incompat & EXT4_INCOMPAT_64BIT ? get_le16(sb + 0xfe) : 32;
+	reserved_gdt = get_le16(sb + 0xce);
+	csum = ro_compat & (EXT4_RO_COMPAT_GDT_CSUM | EXT4_RO_COMPAT_METADATA_CSUM);
+
+	if (!bpg || !ipg || !inode_size || desc_size < 32 || blocks <= first_data)
+		return -EINVAL;
+
+	ngroups = (blocks - first_data + bpg - 1) / bpg;
+	gdt_blocks = ((uint64_t)ngroups * desc_size + map->blk_sz - 1) / map->blk_sz;
+	itable_blocks = ((uint64_t)ipg * inode_size + map->blk_sz - 1) / map->blk_sz;
+
+	map->nblocks = (map->size + map->blk_sz - 1) / map->blk_sz;
+	map->used = calloc((map->nblocks + 7) / 8, 1);
+	gdt = malloc((size_t)gdt_blocks * map->blk_sz);
+	bitmap = malloc(map->blk_sz);
+	if (!map->used || !gdt || !bitmap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = fsmap_pread(map, gdt, (size_t)gdt_blocks * map->blk_sz,
+			  (first_data + 1) * map->blk_sz);
+	if (ret < 0)
+		goto out;
+
+	/* Boot block, superblock and group descriptors */
+	fsmap_mark(map, 0, first_data + 1 + gdt_blocks + reserved_gdt);
+
+	for (g = 0; g < ngroups; g++) {
+		desc = gdt + (size_t)g * desc_size;
+
+		block_bitmap = get_le32(desc + 0x00);
+		inode_bitmap = get_le32(desc + 0x04);
+		inode_table = get_le32(desc + 0x08);
+		if (desc_size >= 64) {
+			block_bitmap |= (uint64_t)get_le32(desc + 0x20) << 32;
+			inode_bitmap |= (uint64_t)get_le32(desc + 0x24) << 32;
+			inode_table |= (uint64_t)get_le32(desc + 0x28) << 32;
+		}
+
+		start = first_data + (uint64_t)g * bpg;
+		count = blocks - start < bpg ? blocks - start : bpg;
+
+		/*
+		 * The group's metadata is kept regardless of the bitmap, which
+		 * isn't initialized for groups with no blocks in use
+		 */
+		if (ext4_has_super(sb, g))
+			fsmap_mark(map, start, 1 + gdt_blocks + reserved_gdt);
+		fsmap_mark(map, block_bitmap, 1);
+		fsmap_mark(map, inode_bitmap, 1);
+		fsmap_mark(map, inode_table, itable_blocks);
+
+		if (csum && get_le16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT)
+			continue;
+
+		if (block_bitmap >= blocks) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		ret = fsmap_read_block(map, bitmap, block_bitmap);
+		if (ret < 0)
+			goto out;
+
+		for (i = 0; i < count; i++) {
+			if (bitmap[i / 8] & (1 << (i % 8)))
+				fsmap_mark(map, start + i, 1);
+		}
+	}
+
+	*fs_blocks = blocks;
+
+out:
+	free(bitmap);
+	free(gdt);
+	return ret;
+}
+
+static uint32_t f2fs_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+	}
+
+	return crc;
+}
+
+/* f2fs bitmaps are indexed from the most significant bit of each byte */
+static bool f2fs_test_bit(const uint8_t *bitmap, unsigned nr)
+{
+	return bitmap[nr / 8] & (0x80 >> (nr % 8));
+}
+
+static bool f2fs_cp_valid(const uint8_t *cp)
+{
+	uint32_t offset = get_le32(cp + 0xa4);
+	uint32_t crc;
+
+	if (offset > F2FS_BLKSIZE - 4)
+		return false;
+
+	/* The checksum covers the block, except for the checksum itself */
+	crc = f2fs_crc32(F2FS_SUPER_MAGIC, cp, offset);
+	if (offset < F2FS_BLKSIZE - 4)
+		crc = f2fs_crc32(crc, cp + offset + 4, F2FS_BLKSIZE - offset - 4);
+
+	return crc == get_le32(cp + offset);
+}
+
+/*
+ * Read the most recent valid checkpoint pack, returning its first block and
+ * the following payload blocks, holding the version bitmaps of large
+ * filesystems.
+ */
+static int f2fs_read_cp(struct fsmap *map, const uint8_t *sb, uint8_t **cp, uint64_t *cp_start)
+{
+	unsigned blocks_per_seg = 1 << get_le32(sb + 0x14);
+	unsigned payload = get_le32(sb + 0x680);
+	uint64_t version = 0;
+	uint64_t start;
+	uint8_t *buf;
+	uint8_t *last;
+	unsigned total;
+	unsigned pack;
+	int ret = -EINVAL;
+
+	if (payload >= blocks_per_seg)
+		return -EINVAL;
+
+	buf = malloc((size_t)(1 + payload) * F2FS_BLKSIZE);
+	last = malloc(F2FS_BLKSIZE);
+	*cp = malloc((size_t)(1 + payload) * F2FS_BLKSIZE);
+	if (!buf || !last || !*cp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (pack = 0; pack < 2; pack++) {
+		start = get_le32(sb + 0x4c) + pack * blocks_per_seg;
+
+		if (fsmap_pread(map, buf, (size_t)(1 + payload) * F2FS_BLKSIZE, start * F2FS_BLKSIZE) < 0)
+			continue;
+
+		total = get_le32(buf + 0x88);
+		if (!f2fs_cp_valid(buf) || total < 2 || total > blocks_per_seg)
+			continue;
+
+		if (fsmap_read_block(map, last, start + total - 1) < 0 ||
+		    !f2fs_cp_valid(last) || get_le64(last) != get_le64(buf))
+			continue;
+
+		if (ret == 0 && get_le64(buf) <= version)
+			continue;
+
+		memcpy(*cp, buf, (size_t)(1 + payload) * F2FS_BLKSIZE);
+		version = get_le64(buf);
+		*cp_start = start;
+		ret = 0;
+	}
+
+out:
+	free(last);
+	free(buf);
+	if (ret < 0) {
+		free(*cp);
+		*cp = NULL;
+	}
+
+	return ret;
+}
+
+static void f2fs_mark_segment(struct fsmap *map, uint64_t main_blkaddr, unsigned log_bps,
+			      uint32_t segno, const uint8_t *entry)
+{
+	uint64_t start = main_blkaddr + ((uint64_t)segno << log_bps);
+	const uint8_t *valid_map = entry + 2;
+	unsigned i;
+
+	if (!(get_le16(entry) & F2FS_SIT_VBLOCKS_MASK))
+		return;
+
+	for (i = 0; i < 1u << log_bps; i++) {
+		if (f2fs_test_bit(valid_map, i))
+			fsmap_mark(map, start + i, 1);
+	}
+}
+
+static int fsmap_f2fs(struct fsmap *map, uint64_t *fs_blocks)
+{
+	const uint8_t *journal = NULL;
+	const uint8_t *sit_bitmap;
+	const uint8_t *entry;
+	uint64_t main_blkaddr;
+	uint64_t sit_blkaddr;
+	uint64_t sit_blocks;
+	uint64_t cp_start;
+	uint64_t sum_block;
+	uint64_t addr;
+	uint32_t segment_count_main;
+	uint32_t sit_bitmap_size;
+	uint32_t flags;
+	uint32_t segno;
+	unsigned log_bps;
+	unsigned n_sits = 0;
+	unsigned payload;
+	unsigned blk_off;
+	unsigned cur_off = UINT32_MAX;
+	uint8_t *sum = NULL;
+	uint8_t *blk = NULL;
+	uint8_t *cp = NULL;
+	uint8_t sb[2048];
+	unsigned i;
+	int ret;
+
+	ret = fsmap_pread(map, sb, sizeof(sb), F2FS_SUPER_OFFSET);
+	if (ret < 0)
+		return ret;
+
+	if (get_le32(sb) != F2FS_SUPER_MAGIC)
+		return -ENOTSUP;
+
+	/* Only 4k blocks and 2 MiB segments, i.e. all f2fs images, are handled */
+	log_bps = get_le32(sb + 0x14);
+	if (get_le32(sb + 0x10) != 12 || log_bps != 9)
+		return -ENOTSUP;
+
+	map->blk_sz = F2FS_BLKSIZE;
+	map->nblocks = (map->size + map->blk_sz - 1) / map->blk_sz;
+	map->used = calloc((map->nblocks + 7) / 8, 1);
+	blk = malloc(F2FS_BLKSIZE);
+	sum = malloc(F2FS_BLKSIZE);
+	if (!map->used || !blk || !sum) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = f2fs_read_cp(map, sb, &cp, &cp_start);
+	if (ret < 0)
+		goto out;
+
+	/* Data written since the last checkpoint is only found by roll forward */
+	flags = get_le32(cp + 0x84);
+	if (!(flags & F2FS_CP_UMOUNT_FLAG)) {
+		ret = -ENOTSUP;
+		goto out;
+	}
+
+	sit_blkaddr = get_le32(sb + 0x50);
+	main_blkaddr = get_le32(sb + 0x5c);
+	segment_count_main = get_le32(sb + 0x44);
+	sit_blocks = (uint64_t)(get_le32(sb + 0x38) / 2) << log_bps;
+	payload = get_le32(sb + 0x680);
+
+	sit_bitmap_size = get_le32(cp + 0x9c);
+	if (flags & F2FS_CP_LARGE_NAT_BITMAP_FLAG)
+		sit_bitmap = cp + 0xc0 + get_le32(cp + 0xa0) + 4;
+	else if (payload)
+		sit_bitmap = cp + F2FS_BLKSIZE;
+	else
+		sit_bitmap = cp + 0xc0;
+
+	if (sit_bitmap + sit_bitmap_size > cp + (size_t)(1 + payload) * F2FS_BLKSIZE ||
+	    (uint64_t)sit_bitmap_size * 8 * F2FS_SIT_ENTRY_PER_BLOCK < segment_count_main) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Recent SIT updates are journaled in the cold data summary */
+	sum_block = cp_start + get_le32(cp + 0x8c);
+	if (flags & F2FS_CP_COMPACT_SUM_FLAG) {
+		ret = fsmap_read_block(map, sum, sum_block);
+		journal = sum + F2FS_SUM_JOURNAL_SIZE;
+	} else {
+		ret = fsmap_read_block(map, sum, sum_block + F2FS_CURSEG_COLD_DATA);
+		journal = sum + F2FS_SUM_ENTRIES_SIZE;
+	}
+	if (ret < 0)
+		goto out;
+
+	n_sits = get_le16(journal);
+	if (n_sits > F2FS_SIT_JOURNAL_ENTRIES) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Everything ahead of the main area is filesystem metadata */
+	fsmap_mark(map, 0, main_blkaddr);
+
+	for (segno = 0; segno < segment_count_main; segno++) {
+		blk_off = segno / F2FS_SIT_ENTRY_PER_BLOCK;
+		if (blk_off != cur_off) {
+			addr = sit_blkaddr + blk_off;
+			if (f2fs_test_bit(sit_bitmap, blk_off))
+				addr += sit_blocks;
+
+			ret = fsmap_read_block(map, blk, addr);
+			if (ret < 0)
+				goto out;
+			cur_off = blk_off;
+		}
+
+		entry = blk + (segno % F2FS_SIT_ENTRY_PER_BLOCK) * F2FS_SIT_ENTRY_SIZE;
+		for (i = 0; i < n_sits; i++) {
+			if (get_le32(journal + 2 + i * F2FS_SIT_JOURNAL_ENTRY_SIZE) == segno)
+				entry = journal + 2 + i * F2FS_SIT_JOURNAL_ENTRY_SIZE + 4;
+		}
+
+		f2fs_mark_segment(map, main_blkaddr, log_bps, segno, entry);
+	}
+
+	/* The segments being logged to are kept in full */
+	for (i = 0; i < F2FS_NR_CURSEG_TYPE; i++) {
+		segno = get_le32(cp + 0x24 + i * 4);
+		if (segno < segment_count_main)
+			fsmap_mark(map, main_blkaddr + ((uint64_t)segno << log_bps), 1u << log_bps);
+
+		segno = get_le32(cp + 0x54 + i * 4);
+		if (segno < segment_count_main)
+			fsmap_mark(map, main_blkaddr + ((uint64_t)segno << log_bps), 1u << log_bps);
+	}
+
+	*fs_blocks = main_blkaddr + ((uint64_t)segment_count_main << log_bps);
+
+out:
+	free(cp);
+	free(sum);
+	free(blk);
+	return ret;
+}
+
+static int fsmap_add(struct sparse_extent **list, unsigned *count, unsigned *size,
+		     enum sparse_extent_type type, uint64_t block, uint64_t blocks, off_t offset)
+{
+	struct sparse_extent *ext;
+
+	if (*count && (*list)[*count - 1].type == type) {
+		(*list)[*count - 1].blocks += blocks;
+		return 0;
+	}
+
+	if (*count == *size) {
+		*size = *size ? *size * 2 : 64;
+		ext = realloc(*list, *size * sizeof(**list));
+		if (!ext)
+			return -ENOMEM;
+		*list = ext;
+	}
+
+	ext = &(*list)[(*count)++];
+	ext->type = type;
+	ext->block = block;
+	ext->blocks = blocks;
+	ext->offset = offset;
+	ext->fill = 0;
+
+	return 0;
+}
+
+/**
+ * fsmap_read() - describe the blocks in use of a filesystem image
+ * @fd:		file descriptor of the image
+ * @offset:	offset of the image in the file
+ * @size:	size of the image
+ * @min_gap:	free space shorter than this, in bytes, is kept
+ * @blk_sz:	block size of the filesystem
+ * @total_blks:	size of the image, in blocks
+ * @extents:	allocated array of extents covering the image
+ * @count:	number of extents
+ * @name:	name of the filesystem
+ *
+ * Return: 0 on success, -ENOTSUP if the image doesn't hold a supported
+ * filesystem, other negative errno on failure
+ */
+int fsmap_read(int fd, off_t offset, uint64_t size, uint64_t min_gap,
+	       unsigned *blk_sz, uint64_t *total_blks,
+	       struct sparse_extent **extents, unsigned *count, const char **name)
+{
+	struct sparse_extent *list = NULL;
+	struct fsmap map = {
+		.fd = fd,
+		.offset = offset,
+		.size = size,
+	};
+	uint64_t fs_blocks = 0;
+	uint64_t block;
+	uint64_t run;
+	unsigned size_ext = 0;
+	unsigned n = 0;
+	bool used;
+	int ret;
+
+	*name = "ext4";
+	ret = fsmap_ext4(&map, &fs_blocks);
+	if (ret == -ENOTSUP) {
+		*name = "f2fs";
+		ret = fsmap_f2fs(&map, &fs_blocks);
+	}
+	if (ret < 0)
+		goto out;
+
+	/* Everything following the filesystem is kept */
+	if (fs_blocks < map.nblocks)
+		fsmap_mark(&map, fs_blocks, map.nblocks - fs_blocks);
+
+	for (block = 0; block < map.nblocks && !ret; block += run) {
+		used = fsmap_used(&map, block);
+		for (run = 1; block + run < map.nblocks; run++) {
+			if (fsmap_used(&map, block + run) != used)
+				break;
+		}
+
+		/* Keep short free runs, not worth a command of their own */
+		if (!used && run * map.blk_sz < min_gap && block && block + run < map.nblocks)
+			used = true;
+
+		ret = fsmap_add(&list, &n, &size_ext,
+				used ? SPARSE_EXTENT_RAW : SPARSE_EXTENT_DONT_CARE,
+				block, run, offset + block * map.blk_sz);
+	}
+	if (ret < 0)
+		goto out;
+
+	*blk_sz = map.blk_sz;
+	*total_blks = map.nblocks;
+	*extents = list;
+	*count = n;
+	list = NULL;
+
+out:
+	free(list);
+	free(map.used);
+	return ret;
+}
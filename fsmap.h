@@ -0,0 +1,13 @@
+#ifndef __FSMAP_H__
+#define __FSMAP_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sparse.h"
+
+int fsmap_read(int fd, off_t offset, uint64_t size, uint64_t min_gap,
+	       unsigned *blk_sz, uint64_t *total_blks,
+	       struct sparse_extent **extents, unsigned *count, const char **name);
+
+#endif
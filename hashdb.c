@@ -0,0 +1,601 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/stat.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hashdb.h"
+
+/*
+ * The hash database records, per device, the xxh64 of each HASHDB_CHUNK_SIZE
+ * chunk of the ranges last programmed, for a later session to program only
+ * the chunks of an image that differ.
+ *
+ * The database is an append only log of "range" records, holding the hashes
+ * of a programmed range, and "invalidate" records, written before a range
+ * of the storage is modified. A session cut short thereby leaves the hashes
+ * of anything it might have touched invalidated. The log is compacted when
+ * opened.
+ *
+ * The hashes of images are cached by file identity in a log of "image"
+ * records, so unchanged images aren't read again to be compared.
+ */
+#define HASHDB_MAGIC		"qdl-hashdb 1"
+#define HASHDB_CACHE_MAGIC	"qdl-image-hashes 1"
+
+/* Images kept in the cache when it's compacted */
+#define HASHDB_CACHE_KEEP	256
+
+struct hashdb_range {
+	unsigned partition;
+	unsigned sector_size;
+	uint64_t start;
+	uint64_t num_sectors;
+	uint64_t *hashes;
+	unsigned count;
+};
+
+struct hashdb_image {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	long mtime_nsec;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t *hashes;
+	unsigned count;
+};
+
+static FILE *hashdb_fp;
+static struct hashdb_range *hashdb_ranges;
+static unsigned hashdb_nranges;
+
+static FILE *hashdb_cache_fp;
+static struct hashdb_image *hashdb_images;
+static unsigned hashdb_nimages;
+
+static void hashdb_sync(FILE *fp)
+{
+	if (fflush(fp) || fsync(fileno(fp)))
+		fprintf(stderr, "[INCREMENTAL] failed to write hash database\n");
+}
+
+static int hashdb_read_hashes(FILE *fp, unsigned count, uint64_t **hashes)
+{
+	unsigned i;
+
+	*hashes = calloc(count ? count : 1, sizeof(**hashes));
+	if (!*hashes)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		if (fscanf(fp, "%" SCNx64, &(*hashes)[i]) != 1) {
+			free(*hashes);
+			*hashes = NULL;
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static void hashdb_write_hashes(FILE *fp, const uint64_t *hashes, unsigned count)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		fprintf(fp, "%016" PRIx64 "%c", hashes[i], (i % 4 == 3 || i == count - 1) ? '\n' : ' ');
+}
+
+/* Forget the hashes of chunks overlapping a range of the storage */
+static void hashdb_apply_invalidate(unsigned partition, unsigned sector_size,
+				    uint64_t start, uint64_t count)
+{
+	struct hashdb_range *range;
+	uint64_t begin = start * sector_size;
+	uint64_t end = (start + count) * sector_size;
+	uint64_t base;
+	uint64_t first;
+	uint64_t last;
+	unsigned i;
+
+	for (i = 0; i < hashdb_nranges; i++) {
+		range = &hashdb_ranges[i];
+		if (range->partition != partition)
+			continue;
+
+		base = range->start * range->sector_size;
+		if (end <= base || begin >= base + range->num_sectors * range->sector_size)
+			continue;
+
+		first = begin > base ? (begin - base) / HASHDB_CHUNK_SIZE : 0;
+		last = (end - base + HASHDB_CHUNK_SIZE - 1) / HASHDB_CHUNK_SIZE;
+		for (; first < last && first < range->count; first++)
+			range->hashes[first] = HASHDB_UNKNOWN;
+	}
+}
+
+static struct hashdb_range *hashdb_find(unsigned partition, unsigned sector_size, uint64_t start)
+{
+	unsigned i;
+
+	for (i = 0; i < hashdb_nranges; i++) {
+		if (hashdb_ranges[i].partition == partition &&
+		    hashdb_ranges[i].sector_size == sector_size &&
+		    hashdb_ranges[i].start == start)
+			return &hashdb_ranges[i];
+	}
+
+	return NULL;
+}
+
+static int hashdb_apply_range(unsigned partition, unsigned sector_size, uint64_t start,
+			      uint64_t num_sectors, uint64_t *hashes, unsigned count)
+{
+	struct hashdb_range *range;
+
+	hashdb_apply_invalidate(partition, sector_size, start, num_sectors);
+
+	range = hashdb_find(partition, sector_size, start);
+	if (!range) {
+		range = realloc(hashdb_ranges, (hashdb_nranges + 1) * sizeof(*range));
+		if (!range)
+			return -ENOMEM;
+		hashdb_ranges = range;
+		range = &hashdb_ranges[hashdb_nranges++];
+	} else {
+		free(range->hashes);
+	}
+
+	range->partition = partition;
+	range->sector_size = sector_size;
+	range->start = start;
+	range->num_sectors = num_sectors;
+	range->hashes = hashes;
+	range->count = count;
+
+	return 0;
+}
+
+static void hashdb_load(const char *path)
+{
+	uint64_t num_sectors;
+	unsigned sector_size;
+	unsigned partition;
+	uint64_t *hashes;
+	uint64_t start;
+	unsigned count;
+	char kind[16];
+	char line[64];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	if (!fgets(line, sizeof(line), fp) ||
+	    strcmp(line, HASHDB_MAGIC " " HASHDB_CHUNK_SIZE_STR "\n")) {
+		fprintf(stderr, "[INCREMENTAL] ignoring incompatible hash database %s\n", path);
+		fclose(fp);
+		return;
+	}
+
+	/* A session cut short might have left the last record incomplete */
+	while (fscanf(fp, "%15s %u %u %" SCNu64 " %" SCNu64, kind, &partition,
+		      &sector_size, &start, &num_sectors) == 5) {
+		if (!strcmp(kind, "invalidate")) {
+			hashdb_apply_invalidate(partition, sector_size, start, num_sectors);
+		} else if (!strcmp(kind, "range")) {
+			if (fscanf(fp, "%u", &count) != 1 ||
+			    hashdb_read_hashes(fp, count, &hashes) < 0)
+				break;
+
+			if (hashdb_apply_range(partition, sector_size, start, num_sectors,
+					       hashes, count) < 0)
+				free(hashes);
+		} else {
+			break;
+		}
+	}
+
+	fclose(fp);
+}
+
+static void hashdb_write_range(FILE *fp, const struct hashdb_range *range)
+{
+	fprintf(fp, "range %u %u %" PRIu64 " %" PRIu64 " %u\n",
+		range->partition, range->sector_size, range->start,
+		range->num_sectors, range->count);
+	hashdb_write_hashes(fp, range->hashes, range->count);
+}
+
+/**
+ * hashdb_open() - open the hash database of a device
+ * @path:	path of the database
+ * @create:	create the database if it doesn't exist
+ *
+ * Without @create, a missing database is left missing, as there's nothing
+ * in it to invalidate.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int hashdb_open(const char *path, bool create)
+{
+	struct hashdb_range *range;
+	char tmp[4096];
+	unsigned valid;
+	unsigned i;
+	unsigned j;
+	FILE *fp;
+
+	if (!create && access(path, F_OK) < 0)
+		return -ENOENT;
+
+	hashdb_load(path);
+
+	/* Compact the log, dropping ranges with nothing left to compare */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		fprintf(stderr, "[INCREMENTAL] unable to create %s\n", tmp);
+		hashdb_close();
+		return -errno;
+	}
+
+	fprintf(fp, "%s %s\n", HASHDB_MAGIC, HASHDB_CHUNK_SIZE_STR);
+	for (i = 0; i < hashdb_nranges; i++) {
+		range = &hashdb_ranges[i];
+		for (j = 0, valid = 0; j < range->count; j++)
+			valid += range->hashes[j] != HASHDB_UNKNOWN;
+
+		if (valid)
+			hashdb_write_range(fp, range);
+	}
+
+	hashdb_sync(fp);
+	if (fclose(fp) || rename(tmp, path) < 0) {
+		fprintf(stderr, "[INCREMENTAL] failed to write %s\n", path);
+		unlink(tmp);
+		hashdb_close();
+		return -EIO;
+	}
+
+	hashdb_fp = fopen(path, "a");
+	if (!hashdb_fp) {
+		hashdb_close();
+		return -errno;
+	}
+
+	return 0;
+}
+
+bool hashdb_enabled(void)
+{
+	return !!hashdb_fp;
+}
+
+/**
+ * hashdb_invalidate() - forget the hashes of a range about to be modified
+ * @partition:	physical partition of the range
+ * @sector_size: sector size of the range
+ * @start:	first sector of the range
+ * @count:	number of sectors of the range
+ */
+void hashdb_invalidate(unsigned partition, unsigned sector_size, uint64_t start, uint64_t count)
+{
+	if (!hashdb_fp)
+		return;
+
+	hashdb_apply_invalidate(partition, sector_size, start, count);
+
+	fprintf(hashdb_fp, "invalidate %u %u %" PRIu64 " %" PRIu64 "\n",
+		partition, sector_size, start, count);
+	hashdb_sync(hashdb_fp);
+}
+
+/**
+ * hashdb_record() - record the hashes of a programmed range
+ * @partition:	physical partition of the range
+ * @sector_size: sector size of the range
+ * @start:	first sector of the range
+ * @num_sectors: number of sectors of the range
+ * @hashes:	hashes of each chunk of the range
+ * @count:	number of chunks
+ */
+void hashdb_record(unsigned partition, unsigned sector_size, uint64_t start,
+		   uint64_t num_sectors, const uint64_t *hashes, unsigned count)
+{
+	uint64_t *copy;
+
+	if (!hashdb_fp)
+		return;
+
+	copy = malloc((count ? count : 1) * sizeof(*copy));
+	if (!copy)
+		return;
+	memcpy(copy, hashes, count * sizeof(*copy));
+
+	if (hashdb_apply_range(partition, sector_size, start, num_sectors, copy, count) < 0) {
+		free(copy);
+		return;
+	}
+
+	hashdb_write_range(hashdb_fp, hashdb_find(partition, sector_size, start));
+	hashdb_sync(hashdb_fp);
+}
+
+/**
+ * hashdb_known() - check if any chunk of a range of the storage is known
+ * @partition:	physical partition of the range
+ * @sector_size: sector size of the range
+ * @start:	first sector of the range
+ *
+ * Return: true if hashdb_compare() may find unchanged chunks in the range
+ */
+bool hashdb_known(unsigned partition, unsigned sector_size, uint64_t start)
+{
+	struct hashdb_range *range;
+	unsigned i;
+
+	range = hashdb_find(partition, sector_size, start);
+	if (!range)
+		return false;
+
+	for (i = 0; i < range->count; i++) {
+		if (range->hashes[i] != HASHDB_UNKNOWN)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * hashdb_compare() - find the chunks of a range that differ from the storage
+ * @partition:	physical partition of the range
+ * @sector_size: sector size of the range
+ * @start:	first sector of the range
+ * @hashes:	hashes of each chunk of the data to program
+ * @count:	number of chunks
+ * @changed:	set for each chunk that differs, or isn't known
+ *
+ * Return: number of unchanged chunks, -ENOENT if nothing is known of the range
+ */
+int hashdb_compare(unsigned partition, unsigned sector_size, uint64_t start,
+		   const uint64_t *hashes, unsigned count, bool *changed)
+{
+	struct hashdb_range *range;
+	unsigned unchanged = 0;
+	unsigned i;
+
+	range = hashdb_find(partition, sector_size, start);
+	if (!range)
+		return -ENOENT;
+
+	for (i = 0; i < count; i++) {
+		changed[i] = i >= range->count || range->hashes[i] == HASHDB_UNKNOWN ||
+			     range->hashes[i] != hashes[i];
+		unchanged += !changed[i];
+	}
+
+	return unchanged;
+}
+
+void hashdb_close(void)
+{
+	unsigned i;
+
+	if (hashdb_fp)
+		fclose(hashdb_fp);
+	hashdb_fp = NULL;
+
+	for (i = 0; i < hashdb_nranges; i++)
+		free(hashdb_ranges[i].hashes);
+	free(hashdb_ranges);
+	hashdb_ranges = NULL;
+	hashdb_nranges = 0;
+
+	if (hashdb_cache_fp)
+		fclose(hashdb_cache_fp);
+	hashdb_cache_fp = NULL;
+
+	for (i = 0; i < hashdb_nimages; i++)
+		free(hashdb_images[i].hashes);
+	free(hashdb_images);
+	hashdb_images = NULL;
+	hashdb_nimages = 0;
+}
+
+static void hashdb_write_image(FILE *fp, const struct hashdb_image *image)
+{
+	fprintf(fp, "image %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64 " %ld %" PRIu64 " %" PRIu64 " %u\n",
+		image->dev, image->ino, image->size, image->mtime_sec, image->mtime_nsec,
+		image->offset, image->length, image->count);
+	hashdb_write_hashes(fp, image->hashes, image->count);
+}
+
+/**
+ * hashdb_cache_open() - open the cache of image hashes
+ * @path:	path of the cache
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int hashdb_cache_open(const char *path)
+{
+	struct hashdb_image image;
+	struct hashdb_image *images;
+	char tmp[4096];
+	char line[64];
+	unsigned first;
+	unsigned i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp && fgets(line, sizeof(line), fp) &&
+	    !strcmp(line, HASHDB_CACHE_MAGIC " " HASHDB_CHUNK_SIZE_STR "\n")) {
+		while (fscanf(fp, " image %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64 " %ld %" SCNu64 " %" SCNu64 " %u",
+			      &image.dev, &image.ino, &image.size, &image.mtime_sec,
+			      &image.mtime_nsec, &image.offset, &image.length, &image.count) == 8) {
+			if (hashdb_read_hashes(fp, image.count, &image.hashes) < 0)
+				break;
+
+			images = realloc(hashdb_images, (hashdb_nimages + 1) * sizeof(*images));
+			if (!images) {
+				free(image.hashes);
+				break;
+			}
+			hashdb_images = images;
+			hashdb_images[hashdb_nimages++] = image;
+		}
+	}
+	if (fp)
+		fclose(fp);
+
+	/* Keep the most recently added images */
+	first = hashdb_nimages > HASHDB_CACHE_KEEP ? hashdb_nimages - HASHDB_CACHE_KEEP : 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return -errno;
+
+	fprintf(fp, "%s %s\n", HASHDB_CACHE_MAGIC, HASHDB_CHUNK_SIZE_STR);
+	for (i = first; i < hashdb_nimages; i++)
+		hashdb_write_image(fp, &hashdb_images[i]);
+
+	if (fclose(fp) || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -EIO;
+	}
+
+	hashdb_cache_fp = fopen(path, "a");
+	if (!hashdb_cache_fp)
+		return -errno;
+
+	return 0;
+}
+
+static void hashdb_image_key(int fd, uint64_t offset, uint64_t length,
+			     struct hashdb_image *image)
+{
+	struct stat sb;
+
+	memset(image, 0, sizeof(*image));
+
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+		return;
+
+	image->dev = sb.st_dev;
+	image->ino = sb.st_ino;
+	image->size = sb.st_size;
+	image->mtime_sec = sb.st_mtim.tv_sec;
+	image->mtime_nsec = sb.st_mtim.tv_nsec;
+	image->offset = offset;
+	image->length = length;
+}
+
+static bool hashdb_image_match(const struct hashdb_image *a, const struct hashdb_image *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	       a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+	       a->offset == b->offset && a->length == b->length;
+}
+
+/**
+ * hashdb_cache_lookup() - find the cached hashes of a range of an image
+ * @fd:		file descriptor of the image
+ * @offset:	offset of the range in the image
+ * @length:	length of the range
+ * @hashes:	filled with the hashes of each chunk of the range
+ * @count:	number of chunks
+ *
+ * Return: true if the hashes were found
+ */
+bool hashdb_cache_lookup(int fd, uint64_t offset, uint64_t length,
+			 uint64_t *hashes, unsigned count)
+{
+	struct hashdb_image key;
+	unsigned i;
+
+	hashdb_image_key(fd, offset, length, &key);
+	if (!key.ino)
+		return false;
+
+	for (i = hashdb_nimages; i-- > 0;) {
+		if (hashdb_image_match(&hashdb_images[i], &key) &&
+		    hashdb_images[i].count == count) {
+			memcpy(hashes, hashdb_images[i].hashes, count * sizeof(*hashes));
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * hashdb_cache_store() - cache the hashes of a range of an image
+ * @fd:		file descriptor of the image
+ * @offset:	offset of the range in the image
+ * @length:	length of the range
+ * @hashes:	hashes of each chunk of the range
+ * @count:	number of chunks
+ */
+void hashdb_cache_store(int fd, uint64_t offset, uint64_t length,
+			const uint64_t *hashes, unsigned count)
+{
+	struct hashdb_image *images;
+	struct hashdb_image image;
+
+	hashdb_image_key(fd, offset, length, &image);
+	if (!image.ino || !hashdb_cache_fp)
+		return;
+
+	image.count = count;
+	image.hashes = malloc((count ? count : 1) * sizeof(*hashes));
+	if (!image.hashes)
+		return;
+	memcpy(image.hashes, hashes, count * sizeof(*hashes));
+
+	images = realloc(hashdb_images, (hashdb_nimages + 1) * sizeof(*images));
+	if (!images) {
+		free(image.hashes);
+		return;
+	}
+	hashdb_images = images;
+	hashdb_images[hashdb_nimages++] = image;
+
+	hashdb_write_image(hashdb_cache_fp, &image);
+	fflush(hashdb_cache_fp);
+}
@@ -0,0 +1,29 @@
+#ifndef __HASHDB_H__
+#define __HASHDB_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HASHDB_CHUNK_SIZE	(1024 * 1024)
+#define HASHDB_CHUNK_SIZE_STR	"1048576"
+
+/* Hash of a chunk of unknown content, chunk hashes are never zero */
+#define HASHDB_UNKNOWN		0
+
+int hashdb_open(const char *path, bool create);
+bool hashdb_enabled(void);
+void hashdb_invalidate(unsigned partition, unsigned sector_size, uint64_t start, uint64_t count);
+void hashdb_record(unsigned partition, unsigned sector_size, uint64_t start,
+		   uint64_t num_sectors, const uint64_t *hashes, unsigned count);
+bool hashdb_known(unsigned partition, unsigned sector_size, uint64_t start);
+int hashdb_compare(unsigned partition, unsigned sector_size, uint64_t start,
+		   const uint64_t *hashes, unsigned count, bool *changed);
+void hashdb_close(void);
+
+int hashdb_cache_open(const char *path);
+bool hashdb_cache_lookup(int fd, uint64_t offset, uint64_t length,
+			 uint64_t *hashes, unsigned count);
+void hashdb_cache_store(int fd, uint64_t offset, uint64_t length,
+			const uint64_t *hashes, unsigned count);
+
+#endif
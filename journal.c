@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+/*
+ * The journal records the program, erase and patch operations of a session
+ * as they are acknowledged by the programmer, one line each, following a
+ * header naming the device and the manifest (the program and patch files) of
+ * the session. Each line is synced to disk as it's written, so the journal
+ * survives the session being cut short.
+ *
+ * A resumed session replays the journal: the operations it issues are
+ * compared in order against the recorded ones, and skipped as long as they
+ * match, including the digest of the programmed data. Once an operation
+ * differs, the remaining records are dropped and the session continues as
+ * normal, as only a prefix of the operations is known to reflect the state
+ * of the device.
+ *
+ * A session running to completion ends the journal with a "complete" line,
+ * there's nothing to resume and the device may have changed since.
+ */
+#define JOURNAL_MAGIC	"qdl-journal 1"
+#define JOURNAL_COMPLETE	"complete"
+
+static FILE *journal_fp;
+static const char *journal_file;
+
+static char **journal_ops;
+static unsigned journal_nops;
+static unsigned journal_next;
+static unsigned journal_skipped;
+
+static void journal_format(const struct journal_op *op, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s %u %s %" PRIu64 " %016" PRIx64,
+		 op->kind, op->partition, op->start_sector, op->count, op->digest);
+}
+
+static void journal_write(const char *line)
+{
+	fprintf(journal_fp, "%s\n", line);
+	if (fflush(journal_fp) || fsync(fileno(journal_fp))) {
+		fprintf(stderr, "[JOURNAL] failed to write %s, no longer journaling\n",
+			journal_file);
+		fclose(journal_fp);
+		journal_fp = NULL;
+	}
+}
+
+static void journal_end_replay(void)
+{
+	unsigned i;
+
+	for (i = 0; i < journal_nops; i++)
+		free(journal_ops[i]);
+	free(journal_ops);
+
+	journal_ops = NULL;
+	journal_nops = 0;
+	journal_next = 0;
+}
+
+/* Load the operations of a journal with the header @header */
+static void journal_load(const char *path, const char *header)
+{
+	size_t size = 0;
+	size_t hlen = 0;
+	char *line = NULL;
+	ssize_t len;
+	bool complete = false;
+	char **ops;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "[RESUME] no journal at %s, flashing everything\n", path);
+		return;
+	}
+
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] != '\n')
+			break;
+
+		if (hlen < strlen(header)) {
+			if (strncmp(header + hlen, line, len))
+				break;
+
+			hlen += len;
+			continue;
+		}
+
+		line[len - 1] = '\0';
+
+		if (!strcmp(line, JOURNAL_COMPLETE)) {
+			complete = true;
+			break;
+		}
+
+		ops = realloc(journal_ops, (journal_nops + 1) * sizeof(*ops));
+		if (!ops)
+			break;
+		journal_ops = ops;
+		journal_ops[journal_nops++] = strdup(line);
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (hlen < strlen(header)) {
+		fprintf(stderr, "[RESUME] %s is for another device or manifest, flashing everything\n",
+			path);
+		journal_end_replay();
+	} else if (complete) {
+		fprintf(stderr, "[RESUME] session recorded in %s completed, flashing everything\n",
+			path);
+		journal_end_replay();
+	}
+}
+
+/**
+ * journal_open() - start journaling the session
+ * @path:	path of the journal
+ * @serial:	serial number of the device
+ * @manifest:	digest of the program and patch files of the session
+ * @resume:	skip the operations recorded by an earlier session
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int journal_open(const char *path, const char *serial,
+		 const uint8_t manifest[SHA256_DIGEST_SIZE], bool resume)
+{
+	char header[256];
+	size_t off;
+	int i;
+
+	off = snprintf(header, sizeof(header), "%s\ndevice %s\nmanifest ", JOURNAL_MAGIC, serial);
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		off += snprintf(header + off, sizeof(header) - off, "%02x", manifest[i]);
+	snprintf(header + off, sizeof(header) - off, "\n");
+
+	if (resume)
+		journal_load(path, header);
+
+	journal_fp = fopen(path, "w");
+	if (!journal_fp) {
+		fprintf(stderr, "[JOURNAL] unable to create %s\n", path);
+		journal_end_replay();
+		return -errno;
+	}
+
+	journal_file = path;
+
+	fputs(header, journal_fp);
+	if (fflush(journal_fp) || fsync(fileno(journal_fp))) {
+		fprintf(stderr, "[JOURNAL] failed to write %s\n", path);
+		journal_close();
+		return -EIO;
+	}
+
+	if (journal_nops)
+		fprintf(stderr, "[RESUME] %u operations recorded in %s\n", journal_nops, path);
+
+	return 0;
+}
+
+bool journal_enabled(void)
+{
+	return !!journal_fp;
+}
+
+/**
+ * journal_resuming() - check if recorded operations remain to be replayed
+ *
+ * Return: true if journal_replay() may skip the next operation
+ */
+bool journal_resuming(void)
+{
+	return journal_next < journal_nops;
+}
+
+/**
+ * journal_expects() - check if an operation may be the next one recorded
+ * @op:		the next operation of the session, its digest not yet known
+ *
+ * Return: true if the next recorded operation matches @op but for the digest
+ */
+bool journal_expects(const struct journal_op *op)
+{
+	char line[256];
+	size_t len;
+
+	if (!journal_resuming())
+		return false;
+
+	/* The digest is the last field of the line */
+	journal_format(op, line, sizeof(line));
+	len = strrchr(line, ' ') - line + 1;
+
+	return !strncmp(line, journal_ops[journal_next], len);
+}
+
+/**
+ * journal_replay() - check if an operation was completed by an earlier session
+ * @op:		the next operation of the session
+ *
+ * The operation is kept in the journal if it's the next one recorded,
+ * otherwise replaying ends and any following records are dropped.
+ *
+ * Return: true if the operation should be skipped
+ */
+bool journal_replay(const struct journal_op *op)
+{
+	char line[256];
+
+	if (!journal_resuming())
+		return false;
+
+	journal_format(op, line, sizeof(line));
+	if (strcmp(line, journal_ops[journal_next])) {
+		fprintf(stderr, "[RESUME] session differs from %s from here on, %u operations left to replay are dropped\n",
+			journal_file, journal_nops - journal_next);
+		journal_end_replay();
+		return false;
+	}
+
+	journal_next++;
+	journal_skipped++;
+
+	if (journal_fp)
+		journal_write(line);
+
+	return true;
+}
+
+/**
+ * journal_record() - record a completed operation
+ * @op:		operation acknowledged by the programmer
+ */
+void journal_record(const struct journal_op *op)
+{
+	char line[256];
+
+	/* Whatever is left to replay no longer follows on from this */
+	if (journal_resuming())
+		journal_end_replay();
+
+	if (!journal_fp)
+		return;
+
+	journal_format(op, line, sizeof(line));
+	journal_write(line);
+}
+
+/**
+ * journal_complete() - record that the session ran to completion
+ *
+ * A later session won't resume from a completed journal.
+ */
+void journal_complete(void)
+{
+	if (journal_fp)
+		journal_write(JOURNAL_COMPLETE);
+}
+
+void journal_close(void)
+{
+	if (journal_skipped)
+		fprintf(stderr, "[RESUME] %u operations completed by an earlier session skipped\n",
+			journal_skipped);
+
+	if (journal_fp)
+		fclose(journal_fp);
+	journal_fp = NULL;
+
+	journal_end_replay();
+	journal_skipped = 0;
+}
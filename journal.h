@@ -0,0 +1,32 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * An operation of the session, @count being the number of sectors of a
+ * program or erase, or the byte offset of a patch, and @digest the xxh64 of
+ * the programmed data or of the patched value
+ */
+struct journal_op {
+	const char *kind;
+	unsigned partition;
+	const char *start_sector;
+	uint64_t count;
+	uint64_t digest;
+};
+
+int journal_open(const char *path, const char *serial,
+		 const uint8_t manifest[SHA256_DIGEST_SIZE], bool resume);
+bool journal_enabled(void);
+bool journal_resuming(void);
+bool journal_expects(const struct journal_op *op);
+bool journal_replay(const struct journal_op *op);
+void journal_record(const struct journal_op *op);
+void journal_complete(void);
+void journal_close(void);
+
+#endif
@@ -29,6 +29,9 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -58,6 +61,11 @@ int patch_load(const char *patch_file)
 		if (node->type != XML_ELEMENT_NODE)
 			continue;
 
+		/* The program entries of a flash plan are loaded by program_load() */
+		if (!xmlStrcmp(root->name, (xmlChar*)"plan") &&
+		    !xmlStrcmp(node->name, (xmlChar*)"program"))
+			continue;
+
 		if (xmlStrcmp(node->name, (xmlChar*)"patch")) {
 			fprintf(stderr, "[PATCH] unrecognized tag \"%s\", ignoring\n", node->name);
 			continue;
@@ -96,6 +104,91 @@ int patch_load(const char *patch_file)
 	return 0;
 }
 	
+/* Whether the value of @patch is computed from the contents of the storage */
+static bool patch_reads_storage(struct patch *patch)
+{
+	return patch->value && strstr(patch->value, "CRC32");
+}
+
+static bool patch_same_bytes(struct patch *a, struct patch *b)
+{
+	return a->partition == b->partition &&
+	       a->sector_size == b->sector_size &&
+	       a->byte_offset == b->byte_offset &&
+	       a->size_in_bytes == b->size_in_bytes &&
+	       a->start_sector && b->start_sector &&
+	       !strcmp(a->start_sector, b->start_sector);
+}
+
+/**
+ * patch_fold() - drop patches without effect on the storage
+ *
+ * Patches of files on the host are never applied to the device, and a patch
+ * is overwritten by a later patch of the same bytes, as long as the
+ * storage isn't read in between, e.g. by a CRC32 value.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int patch_fold(void)
+{
+	struct patch **link = &patches;
+	struct patch *patch;
+	struct patch *later;
+	unsigned folded = 0;
+	bool overwritten;
+
+	patches_last = NULL;
+
+	while ((patch = *link)) {
+		overwritten = false;
+
+		if (patch->filename && !strcmp(patch->filename, "DISK")) {
+			for (later = patch->next; later; later = later->next) {
+				if (patch_reads_storage(later))
+					break;
+
+				if (later->filename && !strcmp(later->filename, "DISK") &&
+				    patch_same_bytes(patch, later)) {
+					overwritten = true;
+					break;
+				}
+			}
+		} else {
+			overwritten = true;
+		}
+
+		if (overwritten) {
+			*link = patch->next;
+			free(patch);
+			folded++;
+			continue;
+		}
+
+		patches_last = patch;
+		link = &patch->next;
+	}
+
+	if (folded)
+		fprintf(stderr, "[PATCH] dropped %u patches without effect on the storage\n", folded);
+
+	return 0;
+}
+
+/**
+ * patch_list() - the patches, in the order to be applied
+ *
+ * Returns the first patch, or NULL.
+ */
+struct patch *patch_list(void)
+{
+	return patches;
+}
+
+bool patch_need_execute(void)
+{
+	return !!patches;
+}
+
 int patch_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct patch *patch))
 {
 	struct patch *patch;
@@ -1,6 +1,8 @@
 #ifndef __PATCH_H__
 #define __PATCH_H__
 
+#include <stdbool.h>
+
 struct qdl_device;
 
 struct patch {
@@ -17,6 +19,9 @@ struct patch {
 };
 
 int patch_load(const char *patch_file);
+int patch_fold(void);
+struct patch *patch_list(void);
+bool patch_need_execute(void);
 int patch_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct patch *patch));
 
 #endif
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/tree.h>
+
+#include "patch.h"
+#include "plan.h"
+#include "program.h"
+#include "qdl.h"
+
+/* Estimates of the storage, until measured while programming */
+#define PLAN_PROGRAM_RATE	40e6
+#define PLAN_COMMAND_OVERHEAD	0.005
+
+/*
+ * The program entries and patches form the flash plan, each pass rewriting
+ * them into an equivalent plan, cheaper to execute
+ */
+struct plan_pass {
+	const char *name;
+	enum plan_stage stage;
+
+	/* rewrites the program entries, or the patches */
+	int (*programs)(const char *incdir);
+	int (*patches)(void);
+	int (*erased)(const char *incdir, bool (*erased_zero)(unsigned partition));
+
+	bool enabled;
+};
+
+static struct plan_pass plan_passes[] = {
+	{ .name = "dedup", .stage = PLAN_STAGE_HOST, .programs = program_dedup,
+	  .enabled = true },
+	{ .name = "order", .stage = PLAN_STAGE_HOST, .programs = program_order },
+	{ .name = "coalesce", .stage = PLAN_STAGE_HOST, .programs = program_coalesce },
+	{ .name = "patches", .stage = PLAN_STAGE_HOST, .patches = patch_fold,
+	  .enabled = true },
+	{ .name = "zeros", .stage = PLAN_STAGE_ERASED_ZERO, .erased = program_erase_zeros,
+	  .enabled = true },
+};
+
+#define PLAN_NUM_PASSES	(sizeof(plan_passes) / sizeof(plan_passes[0]))
+
+/**
+ * plan_select() - select the passes to optimize the flash plan with
+ * @passes:	comma separated pass names, or "none"
+ *
+ * Passes run in their fixed order, regardless of the order given. Without a
+ * selection only the passes keeping the order of the program files run.
+ *
+ * Returns 0 on success, -EINVAL if a pass is unknown.
+ */
+int plan_select(const char *passes)
+{
+	const char *name = passes;
+	size_t len;
+	unsigned i;
+
+	for (i = 0; i < PLAN_NUM_PASSES; i++)
+		plan_passes[i].enabled = false;
+
+	if (!strcmp(passes, "none"))
+		return 0;
+
+	while (*name) {
+		len = strcspn(name, ",");
+
+		for (i = 0; i < PLAN_NUM_PASSES; i++) {
+			if (strlen(plan_passes[i].name) == len &&
+			    !strncmp(plan_passes[i].name, name, len))
+				break;
+		}
+
+		if (i == PLAN_NUM_PASSES) {
+			fprintf(stderr, "[PLAN] unknown pass \"%.*s\"\n", (int)len, name);
+			return -EINVAL;
+		}
+
+		plan_passes[i].enabled = true;
+
+		name += len;
+		if (*name == ',')
+			name++;
+	}
+
+	return 0;
+}
+
+/**
+ * plan_optimize() - run the selected passes of a stage over the flash plan
+ * @stage:	stage of the passes to run
+ * @incdir:	include directory of the image files
+ * @erased_zero: whether erased sectors of a physical partition read as zeros,
+ *		for the passes of PLAN_STAGE_ERASED_ZERO
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int plan_optimize(enum plan_stage stage, const char *incdir,
+		  bool (*erased_zero)(unsigned partition))
+{
+	struct plan_pass *pass;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < PLAN_NUM_PASSES; i++) {
+		pass = &plan_passes[i];
+		if (!pass->enabled || pass->stage != stage)
+			continue;
+
+		if (pass->programs)
+			ret = pass->programs(incdir);
+		else if (pass->patches)
+			ret = pass->patches();
+		else
+			ret = pass->erased(incdir, erased_zero);
+		if (ret < 0) {
+			fprintf(stderr, "[PLAN] pass \"%s\" failed: %s\n", pass->name, strerror(-ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static const char *plan_op(struct program *program, const char *incdir)
+{
+	uint64_t count;
+
+	if (program->erase)
+		return "erase";
+	if (!program->filename)
+		return "skip";
+	if (program->sparse)
+		return "sparse";
+	if (!program_written(program, incdir, &count))
+		return "missing";
+
+	return "program";
+}
+
+/**
+ * plan_cost() - estimate the time to execute the flash plan
+ * @incdir:	include directory of the image files
+ * @bytes:	number of bytes to transfer
+ * @commands:	number of commands to issue
+ *
+ * Return: estimated time in seconds
+ */
+double plan_cost(const char *incdir, uint64_t *bytes, unsigned *commands)
+{
+	struct program *program;
+	struct patch *patch;
+	uint64_t count;
+
+	*bytes = 0;
+	*commands = 0;
+
+	for (program = program_list(); program; program = program->next) {
+		if (program->erased || program->replaced || !program_written(program, incdir, &count))
+			continue;
+
+		if (!program->erase)
+			*bytes += count * program->sector_size;
+		(*commands)++;
+	}
+
+	for (patch = patch_list(); patch; patch = patch->next) {
+		if (patch->filename && !strcmp(patch->filename, "DISK"))
+			(*commands)++;
+	}
+
+	return *bytes / PLAN_PROGRAM_RATE + *commands * PLAN_COMMAND_OVERHEAD;
+}
+
+/**
+ * plan_print() - print the flash plan
+ * @incdir:	include directory of the image files
+ *
+ * Each operation is listed with its range, source and the operations it has
+ * to follow, followed by the estimated cost of the plan. Passes of
+ * PLAN_STAGE_ERASED_ZERO are only noted, as they run once a device is attached.
+ */
+void plan_print(const char *incdir)
+{
+	struct program *program;
+	struct program *other;
+	struct patch *patch;
+	uint64_t count;
+	uint64_t bytes;
+	unsigned commands;
+	unsigned i = 0;
+	unsigned j;
+	double cost;
+	bool first;
+
+	printf("%4s  %-8s %3s %20s %10s  %-32s %s\n",
+	       "#", "op", "LUN", "start_sector", "sectors", "source", "label");
+
+	for (program = program_list(); program; program = program->next) {
+		if (program->erased || program->replaced)
+			continue;
+
+		if (!program_written(program, incdir, &count))
+			count = program->num_sectors;
+
+		printf("%4u  %-8s %3u %20s %10" PRIu64 "  %-24s+%-7u %s",
+		       i, plan_op(program, incdir), program->partition,
+		       program->start_sector ? : "", count,
+		       program->erase ? "" : program->filename ? : "",
+		       program->erase ? 0 : program->file_offset,
+		       program->label ? : "");
+
+		first = true;
+		for (other = program_list(), j = 0; other != program; other = other->next) {
+			if (other->erased || other->replaced)
+				continue;
+
+			if (program_depends(other, program, incdir)) {
+				printf("%s%u", first ? " after " : ",", j);
+				first = false;
+			}
+			j++;
+		}
+		printf("\n");
+		i++;
+	}
+
+	for (patch = patch_list(); patch; patch = patch->next) {
+		printf("%4u  %-8s %3u %20s %10u  %-32s %s\n",
+		       i++, "patch", patch->partition, patch->start_sector ? : "",
+		       patch->size_in_bytes, patch->value ? : "", patch->what ? : "");
+	}
+
+	cost = plan_cost(incdir, &bytes, &commands);
+	printf("%" PRIu64 " kB in %u commands, estimated %.1f s\n",
+	       bytes / 1024, commands, cost);
+
+	/* These depend on the storage info of the device flashed */
+	for (j = 0; j < PLAN_NUM_PASSES; j++) {
+		if (plan_passes[j].enabled && plan_passes[j].stage == PLAN_STAGE_ERASED_ZERO)
+			printf("pass \"%s\" is decided per device when flashing, not shown\n",
+			       plan_passes[j].name);
+	}
+}
+
+static void plan_setpropf(xmlNode *node, const char *attr, const char *fmt, ...)
+{
+	xmlChar buf[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf((char*)buf, sizeof(buf), fmt, ap);
+	xmlSetProp(node, (xmlChar*)attr, buf);
+	va_end(ap);
+}
+
+/**
+ * plan_save() - write the flash plan to a file
+ * @path:	path of the plan file
+ *
+ * The plan file is loaded like a program file, executing the program entries
+ * and patches as planned. Passes of PLAN_STAGE_ERASED_ZERO have not run yet,
+ * and run again when the plan is flashed.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int plan_save(const char *path)
+{
+	struct program *program;
+	struct patch *patch;
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	int ret = 0;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"plan");
+	xmlDocSetRootElement(doc, root);
+
+	for (program = program_list(); program; program = program->next) {
+		if (program->erase || program->erased || program->replaced)
+			continue;
+
+		node = xmlNewChild(root, NULL, (xmlChar*)"program", NULL);
+		plan_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%u", program->sector_size);
+		plan_setpropf(node, "file_sector_offset", "%u", program->file_offset);
+		plan_setpropf(node, "filename", "%s", program->filename ? : "");
+		plan_setpropf(node, "label", "%s", program->label ? : "");
+		plan_setpropf(node, "num_partition_sectors", "%u", program->num_sectors);
+		plan_setpropf(node, "physical_partition_number", "%u", program->partition);
+		plan_setpropf(node, "start_sector", "%s", program->start_sector ? : "");
+		plan_setpropf(node, "sparse", "%s", program->sparse ? "true" : "false");
+	}
+
+	for (patch = patch_list(); patch; patch = patch->next) {
+		node = xmlNewChild(root, NULL, (xmlChar*)"patch", NULL);
+		plan_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%u", patch->sector_size);
+		plan_setpropf(node, "byte_offset", "%u", patch->byte_offset);
+		plan_setpropf(node, "filename", "%s", patch->filename ? : "");
+		plan_setpropf(node, "physical_partition_number", "%u", patch->partition);
+		plan_setpropf(node, "size_in_bytes", "%u", patch->size_in_bytes);
+		plan_setpropf(node, "start_sector", "%s", patch->start_sector ? : "");
+		plan_setpropf(node, "value", "%s", patch->value ? : "");
+		plan_setpropf(node, "what", "%s", patch->what ? : "");
+	}
+
+	if (xmlSaveFormatFileEnc(path, doc, "UTF-8", 1) < 0)
+		ret = -EIO;
+
+	xmlFreeDoc(doc);
+
+	return ret;
+}
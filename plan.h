@@ -0,0 +1,21 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum plan_stage {
+	/* passes depending only on the program files and images */
+	PLAN_STAGE_HOST,
+	/* passes depending on which partitions read back zeros once erased */
+	PLAN_STAGE_ERASED_ZERO,
+};
+
+int plan_select(const char *passes);
+int plan_optimize(enum plan_stage stage, const char *incdir,
+		  bool (*erased_zero)(unsigned partition));
+double plan_cost(const char *incdir, uint64_t *bytes, unsigned *commands);
+void plan_print(const char *incdir);
+int plan_save(const char *path);
+
+#endif
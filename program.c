@@ -28,20 +28,46 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/stat.h>
+#include <ctype.h>
+#include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+#include "decompress.h"
 #include "program.h"
 #include "qdl.h"
+#include "source.h"
+#include "worker.h"
+
+/* Upper bound of image data hinted to the page cache ahead of programming */
+#define PROGRAM_READAHEAD_BUDGET	(64 * 1024 * 1024)
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* Granularity of the comparison of images against those of the base build */
+#define PROGRAM_DELTA_BLOCK	(1024 * 1024)
+
+/* Amount of each image compared by one job of the delta planner */
+#define PROGRAM_DELTA_SPAN	(64 * 1024 * 1024)
 		
 static struct program *programes;
 static struct program *programes_last;
 
-int program_load(const char *program_file)
+/* Program entries of the base build, see program_load_base() */
+static struct program *base_programes;
+static struct program *base_programes_last;
+
+static int program_parse(const char *program_file, struct program **head,
+			 struct program **tail)
 {
 	struct program *program;
 	xmlNode *node;
@@ -60,6 +86,11 @@ int program_load(const char *program_file)
 		if (node->type != XML_ELEMENT_NODE)
 			continue;
 
+		/* The patches of a flash plan are loaded by patch_load() */
+		if (!xmlStrcmp(root->name, (xmlChar*)"plan") &&
+		    !xmlStrcmp(node->name, (xmlChar*)"patch"))
+			continue;
+
 		if (xmlStrcmp(node->name, (xmlChar*)"program")) {
 			fprintf(stderr, "[PROGRAM] unrecognized tag \"%s\", ignoring\n", node->name);
 			continue;
@@ -76,6 +107,7 @@ int program_load(const char *program_file)
 		program->num_sectors = attr_as_unsigned(node, "num_partition_sectors", &errors);
 		program->partition = attr_as_unsigned(node, "physical_partition_number", &errors);
 		program->start_sector = attr_as_string(node, "start_sector", &errors);
+		program->sparse = attr_as_bool(node, "sparse");
 
 		if (errors) {
 			fprintf(stderr, "[PROGRAM] errors while parsing program\n");
@@ -83,12 +115,12 @@ int program_load(const char *program_file)
 			continue;
 		}
 
-		if (programes) {
-			programes_last->next = program;
-			programes_last = program;
+		if (*head) {
+			(*tail)->next = program;
+			*tail = program;
 		} else {
-			programes = program;
-			programes_last = program;
+			*head = program;
+			*tail = program;
 		}
 	}
 
@@ -96,34 +128,152 @@ int program_load(const char *program_file)
 
 	return 0;
 }
+
+int program_load(const char *program_file)
+{
+	return program_parse(program_file, &programes, &programes_last);
+}
+
+/**
+ * program_load_base() - load the program file of the base build
+ * @program_file:	program file of the build the device is known to hold
+ *
+ * The entries are only used by program_delta(), to find the image each
+ * program entry replaces.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int program_load_base(const char *program_file)
+{
+	return program_parse(program_file, &base_programes, &base_programes_last);
+}
 	
+static const char *program_path(struct program *program, const char *incdir, char *tmp)
+{
+	const char *filename;
+
+	filename = program->filename;
+	if (incdir) {
+		snprintf(tmp, PATH_MAX, "%s/%s", incdir, filename);
+		if (access(tmp, F_OK) != -1)
+			filename = tmp;
+	}
+
+	return filename;
+}
+
+/* An image named "-" is read from stdin */
+static int program_open(struct program *program, const char *incdir)
+{
+	char tmp[PATH_MAX];
+
+	if (!strcmp(program->filename, "-"))
+		return dup(STDIN_FILENO);
+
+	return open(program_path(program, incdir, tmp), O_RDONLY);
+}
+
+/*
+ * Images read from stdin or a pipe can only be read once, when programmed;
+ * opening a named pipe ahead of time would block, or cut off its writer.
+ */
+static bool program_is_stream(struct program *program, const char *incdir)
+{
+	char tmp[PATH_MAX];
+	struct stat sb;
+
+	if (!strcmp(program->filename, "-"))
+		return true;
+
+	if (stat(program_path(program, incdir, tmp), &sb) < 0)
+		return true;
+
+	return S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode);
+}
+
+/*
+ * Ask the kernel to start reading the images of the entries following
+ * @current, within the budget, so that the first chunk of each partition is
+ * already in the page cache when its turn comes.
+ */
+static void program_readahead(struct program *current, const char *incdir)
+{
+#ifdef POSIX_FADV_WILLNEED
+	struct program *program;
+	size_t pending = 0;
+	struct stat sb;
+	uint64_t len;
+	off_t offset;
+	int fd;
+
+	/* Direct I/O bypasses the page cache, so don't fill it */
+	if (source_direct != SOURCE_DIRECT_NEVER)
+		return;
+
+	for (program = current->next; program && pending < PROGRAM_READAHEAD_BUDGET;
+	     program = program->next) {
+		if (program->erase || program->erased || program->replaced || !program->filename)
+			continue;
+
+		if (program_is_stream(program, incdir))
+			continue;
+
+		if (!program->readahead) {
+			fd = program_open(program, incdir);
+			if (fd < 0)
+				continue;
+
+			if (!fstat(fd, &sb)) {
+				offset = (off_t)program->file_offset * program->sector_size;
+				len = (uint64_t)program_sector_count(program, sb.st_size) * program->sector_size;
+				if (offset >= sb.st_size)
+					len = 0;
+				else if (len > sb.st_size - offset)
+					len = sb.st_size - offset;
+				if (len > PROGRAM_READAHEAD_BUDGET - pending)
+					len = PROGRAM_READAHEAD_BUDGET - pending;
+
+				if (len && !posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED))
+					program->readahead = len;
+			}
+
+			close(fd);
+		}
+
+		pending += program->readahead;
+	}
+#endif
+}
+
 int program_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct program *program, int fd),
 		    const char *incdir)
 {
 	struct program *program;
-	const char *filename;
-	char tmp[PATH_MAX];
 	int ret;
 	int fd;
 
 	for (program = programes; program; program = program->next) {
-		if (!program->filename)
+		if (program->erased || program->replaced)
 			continue;
 
-		filename = program->filename;
-		if (incdir) {
-			snprintf(tmp, PATH_MAX, "%s/%s", incdir, filename);
-			if (access(tmp, F_OK) != -1)
-				filename = tmp;
+		if (program->erase) {
+			ret = apply(qdl, program, -1);
+			if (ret)
+				return ret;
+			continue;
 		}
 
-		fd = open(filename, O_RDONLY);
+		if (!program->filename)
+			continue;
 
+		fd = program_open(program, incdir);
 		if (fd < 0) {
 			printf("Unable to open %s...ignoring\n", program->filename);
 			continue;
 		}
 
+		program_readahead(program, incdir);
+
 		ret = apply(qdl, program, fd);
 
 		close(fd);
@@ -134,6 +284,959 @@ int program_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl,
 	return 0;
 }
 
+bool program_need_execute(void)
+{
+	return !!programes;
+}
+
+/**
+ * program_sector_count() - number of sectors to program
+ * @program:	program entry
+ * @size:	size of the image file
+ *
+ * Returns the size of the image in sectors, limited to the size of the
+ * partition.
+ */
+unsigned program_sector_count(struct program *program, off_t size)
+{
+	unsigned num_sectors;
+
+	num_sectors = (size + program->sector_size - 1) / program->sector_size;
+	if (program->num_sectors && num_sectors > program->num_sectors)
+		num_sectors = program->num_sectors;
+
+	return num_sectors;
+}
+
+/**
+ * program_start_sector() - numeric start sector of a program entry
+ * @program:	program entry
+ * @sector:	start sector
+ *
+ * Return: true if the start sector is a plain number, false if it's an
+ * expression (e.g. relative to the end of the disk)
+ */
+bool program_start_sector(struct program *program, uint64_t *sector)
+{
+	char *end;
+
+	if (!program->start_sector || !isdigit(program->start_sector[0]))
+		return false;
+
+	*sector = strtoull(program->start_sector, &end, 10);
+
+	return *end == '\0';
+}
+
+struct program_range {
+	struct program *program;
+	uint64_t start;
+	uint64_t end;
+};
+
+static int program_range_cmp(const void *a, const void *b)
+{
+	const struct program_range *ra = a;
+	const struct program_range *rb = b;
+
+	if (ra->program->partition != rb->program->partition)
+		return ra->program->partition < rb->program->partition ? -1 : 1;
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+static struct program *program_new_erase(struct program_range *range, unsigned count)
+{
+	struct program *program;
+	size_t len = 1;
+	char tmp[32];
+	char *label;
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		len += strlen(range[i].program->label ? : "") + 1;
+
+	label = calloc(1, len);
+	for (i = 0; i < count; i++) {
+		if (i)
+			strcat(label, ",");
+		strcat(label, range[i].program->label ? : "");
+	}
+
+	snprintf(tmp, sizeof(tmp), "%" PRIu64, range[0].start);
+
+	program = calloc(1, sizeof(struct program));
+	program->sector_size = range[0].program->sector_size;
+	program->label = label;
+	program->num_sectors = range[count - 1].end - range[0].start;
+	program->partition = range[0].program->partition;
+	program->start_sector = strdup(tmp);
+	program->erase = true;
+
+	return program;
+}
+
+/**
+ * program_erase_zeros() - replace zero filled images with erase commands
+ * @incdir:	include directory of the image files
+ * @erased_zero: whether erased sectors of a physical partition read as zeros
+ *
+ * Program entries where the programmed range of the image consists of only
+ * zeros are replaced by erase commands, merging adjacent ranges into as few
+ * commands as possible. The erase commands are executed before any program
+ * entry, so zero ranges overlapping other program entries are left alone.
+ *
+ * Only entries of physical partitions where erased sectors read back as
+ * zeros are considered.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int program_erase_zeros(const char *incdir, bool (*erased_zero)(unsigned partition))
+{
+	struct program_range *ranges;
+	struct program_range *range;
+	struct program *erases = NULL;
+	struct program *erase;
+	struct program *program;
+	struct program *other;
+	uint64_t other_start;
+	uint64_t other_end;
+	uint64_t saved = 0;
+	uint64_t start;
+	struct stat sb;
+	unsigned num_sectors;
+	unsigned nranges = 0;
+	unsigned nerases = 0;
+	unsigned count;
+	unsigned i;
+	int fd;
+
+	for (program = programes, i = 0; program; program = program->next)
+		i++;
+
+	ranges = calloc(i, sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	for (program = programes; program; program = program->next) {
+		if (!program->filename || program->erase || program->erased ||
+		    program->replaced || program->sparse)
+			continue;
+
+		if (program_is_stream(program, incdir))
+			continue;
+
+		if (!program_start_sector(program, &start))
+			continue;
+
+		fd = program_open(program, incdir);
+		if (fd < 0)
+			continue;
+
+		if (fstat(fd, &sb) < 0 || !sb.st_size) {
+			close(fd);
+			continue;
+		}
+
+		/* Only ask about the partition once there's a zero range to erase */
+		num_sectors = program_sector_count(program, sb.st_size);
+		if (source_is_zero(fd, (off_t)program->file_offset * program->sector_size,
+				   (uint64_t)num_sectors * program->sector_size, program->sector_size) &&
+		    erased_zero(program->partition)) {
+			range = &ranges[nranges++];
+			range->program = program;
+			range->start = start;
+			range->end = start + num_sectors;
+		}
+
+		close(fd);
+	}
+
+	/* Drop zero ranges that overlap with other program entries */
+	for (i = 0; i < nranges; i++) {
+		range = &ranges[i];
+
+		for (other = programes; other; other = other->next) {
+			if (other == range->program || other->replaced || !other->filename ||
+			    other->partition != range->program->partition)
+				continue;
+
+			/* Ranges relative to the end of the storage may overlap anything */
+			if (program_start_sector(other, &other_start)) {
+				other_end = other->num_sectors ? other_start + other->num_sectors : UINT64_MAX;
+			} else {
+				other_start = 0;
+				other_end = UINT64_MAX;
+			}
+
+			if (other_start < range->end && range->start < other_end) {
+				range->program = NULL;
+				break;
+			}
+		}
+	}
+
+	for (i = 0, count = 0; i < nranges; i++) {
+		if (ranges[i].program)
+			ranges[count++] = ranges[i];
+	}
+	nranges = count;
+
+	qsort(ranges, nranges, sizeof(*ranges), program_range_cmp);
+
+	for (i = 0; i < nranges; i += count) {
+		for (count = 1; i + count < nranges; count++) {
+			range = &ranges[i + count];
+
+			if (range->program->partition != ranges[i].program->partition ||
+			    range->program->sector_size != ranges[i].program->sector_size ||
+			    range->start != ranges[i + count - 1].end)
+				break;
+		}
+
+		erase = program_new_erase(&ranges[i], count);
+		erase->next = erases;
+		erases = erase;
+		nerases++;
+
+		for (range = &ranges[i]; range < &ranges[i + count]; range++) {
+			range->program->erased = true;
+			saved += (range->end - range->start) * range->program->sector_size;
+		}
+	}
+
+	free(ranges);
+
+	/* Erase commands go first, so that later program entries takes precedence */
+	while (erases) {
+		erase = erases;
+		erases = erase->next;
+
+		erase->next = programes;
+		programes = erase;
+		if (!programes_last)
+			programes_last = erase;
+	}
+
+	if (nerases) {
+		fprintf(stderr, "[PROGRAM] replaced %u zero filled images (%" PRIu64 " kB) with %u erase commands\n",
+			nranges, saved / 1024, nerases);
+	}
+
+	return 0;
+}
+
+struct program_delta {
+	struct program *program;
+	struct program *base;
+	int fd;
+	int base_fd;
+	uint64_t start;
+	unsigned num_sectors;
+
+	/* bytes the base build programmed, beyond that the storage is unknown */
+	uint64_t base_bytes;
+
+	unsigned nblocks;
+	bool *changed;
+};
+
+struct program_delta_job {
+	struct program_delta *delta;
+	unsigned first;
+	unsigned count;
+};
+
+static struct program *program_find_base(struct program *program)
+{
+	struct program *base;
+
+	for (base = base_programes; base; base = base->next) {
+		if (base->partition == program->partition &&
+		    base->sector_size == program->sector_size &&
+		    base->start_sector && !strcmp(base->start_sector, program->start_sector))
+			return base;
+	}
+
+	return NULL;
+}
+
+/* Read @len bytes at @offset, padding what's beyond the end of the file with zeros */
+static int program_delta_read(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(fd, buf + done, len - done, offset + done);
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			break;
+
+		done += n;
+	}
+
+	memset(buf + done, 0, len - done);
+
+	return 0;
+}
+
+static void program_delta_compare(void *arg)
+{
+	struct program_delta_job *job = arg;
+	struct program_delta *delta = job->delta;
+	struct program *program = delta->program;
+	struct program *base = delta->base;
+	uint64_t bytes = (uint64_t)delta->num_sectors * program->sector_size;
+	uint8_t *base_buf;
+	uint64_t offset;
+	uint8_t *buf;
+	size_t len;
+	unsigned i;
+
+	buf = malloc(PROGRAM_DELTA_BLOCK);
+	base_buf = malloc(PROGRAM_DELTA_BLOCK);
+	if (!buf || !base_buf)
+		err(1, "failed to allocate delta buffers");
+
+	for (i = job->first; i < job->first + job->count; i++) {
+		offset = (uint64_t)i * PROGRAM_DELTA_BLOCK;
+		len = MIN(PROGRAM_DELTA_BLOCK, bytes - offset);
+
+		if (offset + len > delta->base_bytes ||
+		    program_delta_read(delta->fd, buf, len,
+				       (off_t)program->file_offset * program->sector_size + offset) < 0 ||
+		    program_delta_read(delta->base_fd, base_buf, len,
+				       (off_t)base->file_offset * base->sector_size + offset) < 0) {
+			delta->changed[i] = true;
+			continue;
+		}
+
+		delta->changed[i] = !!memcmp(buf, base_buf, len);
+	}
+
+	free(base_buf);
+	free(buf);
+}
+
+/*
+ * Open the image of @program and that of the base build it replaces, if the
+ * two can be compared block by block
+ */
+static bool program_delta_open(struct program_delta *delta, const char *base_dir,
+			       const char *incdir)
+{
+	struct program *program = delta->program;
+	char path[PATH_MAX];
+	struct program *base;
+	struct stat sb;
+	off_t base_size;
+
+	if (!program->filename || program->erase || program->erased || program->sparse)
+		return false;
+
+	if (!program_start_sector(program, &delta->start) ||
+	    PROGRAM_DELTA_BLOCK % program->sector_size)
+		return false;
+
+	if (program_is_stream(program, incdir))
+		return false;
+
+	base = program_find_base(program);
+	if (!base || !base->filename || base->sparse) {
+		fprintf(stderr, "[DELTA] \"%s\" isn't part of the base build, programming in full\n",
+			program->label);
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", base_dir, base->filename);
+	if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		fprintf(stderr, "[DELTA] base image %s not found, programming \"%s\" in full\n",
+			path, program->label);
+		return false;
+	}
+	base_size = sb.st_size;
+
+	delta->fd = program_open(program, incdir);
+	if (delta->fd < 0)
+		return false;
+
+	delta->base_fd = open(path, O_RDONLY);
+	if (delta->base_fd < 0)
+		goto close_fd;
+
+	if (fstat(delta->fd, &sb) < 0 || !sb.st_size)
+		goto close_base;
+
+	/* Compressed images would have to be inflated to be compared */
+	if (decompress_detect(delta->fd) != DECOMPRESS_NONE ||
+	    decompress_detect(delta->base_fd) != DECOMPRESS_NONE)
+		goto close_base;
+
+	delta->base = base;
+	delta->num_sectors = program_sector_count(program, sb.st_size);
+	delta->base_bytes = (uint64_t)program_sector_count(base, base_size) * base->sector_size;
+	delta->nblocks = ((uint64_t)delta->num_sectors * program->sector_size +
+			  PROGRAM_DELTA_BLOCK - 1) / PROGRAM_DELTA_BLOCK;
+	delta->changed = calloc(delta->nblocks, sizeof(bool));
+	if (!delta->changed)
+		err(1, "failed to allocate delta");
+
+	return true;
+
+close_base:
+	close(delta->base_fd);
+	delta->base_fd = -1;
+close_fd:
+	close(delta->fd);
+	delta->fd = -1;
+
+	return false;
+}
+
+static struct program *program_new_slice(struct program *program, uint64_t start,
+					 unsigned first, unsigned count)
+{
+	struct program *slice;
+	char tmp[32];
+
+	snprintf(tmp, sizeof(tmp), "%" PRIu64, start + first);
+
+	slice = calloc(1, sizeof(struct program));
+	slice->sector_size = program->sector_size;
+	slice->file_offset = program->file_offset + first;
+	slice->filename = program->filename;
+	slice->label = program->label;
+	slice->num_sectors = count;
+	slice->partition = program->partition;
+	slice->start_sector = strdup(tmp);
+
+	return slice;
+}
+
+/**
+ * program_delta() - reduce the program entries to what differs from a base build
+ * @base_dir:	directory of the base build
+ * @incdir:	include directory of the image files
+ *
+ * Each program entry is compared, block by block and in parallel, with the
+ * image programmed at the same location by the base build, as loaded by
+ * program_load_base(). The entry is replaced by entries programming only the
+ * differing blocks, adjacent ones merged, or by none if the image is
+ * unchanged. Entries that can't be compared are left as they are.
+ *
+ * Must only be used if the device is known to hold the base build.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int program_delta(const char *base_dir, const char *incdir)
+{
+	struct program_delta_job *jobs;
+	struct program_delta *deltas;
+	struct program_delta *delta;
+	struct worker_pool *pool;
+	struct program *program;
+	struct program *slice;
+	struct program *last;
+	uint64_t unchanged = 0;
+	uint64_t changed = 0;
+	uint64_t bytes;
+	unsigned per_job = PROGRAM_DELTA_SPAN / PROGRAM_DELTA_BLOCK;
+	unsigned spb;
+	unsigned ndeltas = 0;
+	unsigned njobs = 0;
+	unsigned first;
+	unsigned end;
+	unsigned i;
+	unsigned b;
+	unsigned e;
+
+	for (program = programes; program; program = program->next)
+		ndeltas++;
+
+	deltas = calloc(ndeltas, sizeof(*deltas));
+	if (!deltas)
+		return -ENOMEM;
+
+	for (program = programes, i = 0; program; program = program->next, i++) {
+		delta = &deltas[i];
+		delta->program = program;
+		delta->fd = -1;
+		delta->base_fd = -1;
+
+		if (program_delta_open(delta, base_dir, incdir))
+			njobs += (delta->nblocks + per_job - 1) / per_job;
+	}
+
+	jobs = calloc(njobs, sizeof(*jobs));
+	if (!jobs && njobs) {
+		free(deltas);
+		return -ENOMEM;
+	}
+
+	pool = worker_pool_create(0);
+
+	for (i = 0, njobs = 0; i < ndeltas; i++) {
+		delta = &deltas[i];
+		if (!delta->changed)
+			continue;
+
+		for (first = 0; first < delta->nblocks; first += per_job) {
+			jobs[njobs].delta = delta;
+			jobs[njobs].first = first;
+			jobs[njobs].count = MIN(per_job, delta->nblocks - first);
+			worker_pool_submit(pool, program_delta_compare, &jobs[njobs]);
+			njobs++;
+		}
+	}
+
+	worker_pool_wait(pool);
+	worker_pool_destroy(pool);
+	free(jobs);
+
+	/* Follow each compared entry by slices covering the differing blocks */
+	for (i = 0; i < ndeltas; i++) {
+		delta = &deltas[i];
+		if (!delta->changed)
+			continue;
+
+		program = delta->program;
+		spb = PROGRAM_DELTA_BLOCK / program->sector_size;
+		bytes = 0;
+		last = program;
+
+		for (b = 0; b < delta->nblocks; b = e) {
+			if (!delta->changed[b]) {
+				e = b + 1;
+				continue;
+			}
+
+			for (e = b + 1; e < delta->nblocks && delta->changed[e]; e++)
+				;
+
+			first = b * spb;
+			end = MIN(e * spb, delta->num_sectors);
+
+			slice = program_new_slice(program, delta->start, first, end - first);
+			slice->next = last->next;
+			last->next = slice;
+			last = slice;
+
+			bytes += (uint64_t)(end - first) * program->sector_size;
+		}
+
+		if (programes_last == program)
+			programes_last = last;
+
+		program->replaced = true;
+
+		fprintf(stderr, "[DELTA] \"%s\": %" PRIu64 " kB unchanged, %" PRIu64 " kB to program\n",
+			program->label,
+			((uint64_t)delta->num_sectors * program->sector_size - bytes) / 1024,
+			bytes / 1024);
+
+		unchanged += (uint64_t)delta->num_sectors * program->sector_size - bytes;
+		changed += bytes;
+
+		free(delta->changed);
+		close(delta->base_fd);
+		close(delta->fd);
+	}
+
+	free(deltas);
+
+	fprintf(stderr, "[DELTA] %" PRIu64 " kB unchanged since the base build, %" PRIu64 " kB to program\n",
+		unchanged / 1024, changed / 1024);
+
+	return 0;
+}
+
+/**
+ * program_written() - number of sectors written by a program entry
+ * @program:	program entry
+ * @incdir:	include directory of the image files
+ * @count:	number of sectors
+ *
+ * Sparse images are estimated by the size of the file.
+ *
+ * Return: true if known, false if not, e.g. the image can't be opened
+ */
+bool program_written(struct program *program, const char *incdir, uint64_t *count)
+{
+	uint64_t size;
+	int ret;
+	int fd;
+
+	if (program->erase) {
+		*count = program->num_sectors;
+		return true;
+	}
+
+	if (!program->filename)
+		return false;
+
+	/* A stream is programmed as large as the program entry says */
+	if (program_is_stream(program, incdir)) {
+		*count = program->num_sectors;
+		return !!program->num_sectors;
+	}
+
+	fd = program_open(program, incdir);
+	if (fd < 0)
+		return false;
+
+	ret = source_file_size(fd, &size);
+	close(fd);
+	if (ret < 0)
+		return false;
+
+	*count = program_sector_count(program, size);
+
+	return true;
+}
+
+/**
+ * program_dedup() - drop program entries overwritten by later ones
+ * @incdir:	include directory of the image files
+ *
+ * Entries that the storage would only hold until a later entry, writing
+ * at least the same sectors, is programmed are dropped. Entries read from
+ * streams are kept, to be read as the writer expects.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int program_dedup(const char *incdir)
+{
+	struct program *program;
+	struct program *later;
+	uint64_t later_start;
+	uint64_t later_count;
+	uint64_t dropped = 0;
+	uint64_t start;
+	uint64_t count;
+	unsigned n = 0;
+
+	for (program = programes; program; program = program->next) {
+		if (program->erased || program->replaced || program->sparse)
+			continue;
+
+		if (!program_start_sector(program, &start) ||
+		    !program_written(program, incdir, &count) || !count)
+			continue;
+
+		if (!program->erase && program_is_stream(program, incdir))
+			continue;
+
+		for (later = program->next; later; later = later->next) {
+			if (later->erased || later->replaced || later->sparse ||
+			    later->partition != program->partition ||
+			    later->sector_size != program->sector_size)
+				continue;
+
+			if (!program_start_sector(later, &later_start) ||
+			    later_start > start ||
+			    !program_written(later, incdir, &later_count) ||
+			    later_start + later_count < start + count)
+				continue;
+
+			program->replaced = true;
+			dropped += count * program->sector_size;
+			n++;
+			break;
+		}
+	}
+
+	if (n) {
+		fprintf(stderr, "[PROGRAM] dropped %u entries (%" PRIu64 " kB) overwritten by later ones\n",
+			n, dropped / 1024);
+	}
+
+	return 0;
+}
+
+struct program_order {
+	struct program *program;
+	uint64_t key;
+	uint64_t start;
+	uint64_t end;
+	bool stream;
+
+	/* earlier entries that have to be programmed first */
+	unsigned pending;
+	bool placed;
+};
+
+static void program_order_init(struct program_order *entry, struct program *program,
+			       const char *incdir)
+{
+	entry->program = program;
+	entry->stream = program->filename && !program->erase &&
+			program_is_stream(program, incdir);
+
+	/* Ranges relative to the end of the storage may overlap anything */
+	if (program_start_sector(program, &entry->start)) {
+		entry->key = entry->start;
+		entry->end = program->num_sectors ? entry->start + program->num_sectors : UINT64_MAX;
+	} else {
+		entry->key = UINT64_MAX;
+		entry->start = 0;
+		entry->end = UINT64_MAX;
+	}
+}
+
+static bool program_order_depends(struct program_order *a, struct program_order *b)
+{
+	if (a->program->erased || a->program->replaced ||
+	    b->program->erased || b->program->replaced)
+		return false;
+
+	if (a->stream && b->stream)
+		return true;
+
+	if (a->program->partition != b->program->partition)
+		return false;
+
+	return a->start < b->end && b->start < a->end;
+}
+
+/**
+ * program_depends() - whether a program entry has to be programmed first
+ * @a:		program entry, preceding @b in the program files
+ * @b:		program entry
+ * @incdir:	include directory of the image files
+ *
+ * Overlapping entries are programmed in the given order, so the last one
+ * wins, and streams are read in the order the writer feeds them.
+ *
+ * Return: true if @a has to be programmed before @b
+ */
+bool program_depends(struct program *a, struct program *b, const char *incdir)
+{
+	struct program_order ea = {};
+	struct program_order eb = {};
+
+	program_order_init(&ea, a, incdir);
+	program_order_init(&eb, b, incdir);
+
+	return program_order_depends(&ea, &eb);
+}
+
+static bool program_order_before(struct program_order *a, struct program_order *b)
+{
+	if (a->program->partition != b->program->partition)
+		return a->program->partition < b->program->partition;
+
+	return a->key < b->key;
+}
+
+/**
+ * program_order() - order the program entries for sequential writes
+ * @incdir:	include directory of the image files
+ *
+ * Program entries are ordered by physical partition and start sector, as
+ * long as every entry still follows those it depends on, see
+ * program_depends().
+ *
+ * Patches are applied, and the boot partition selected, once all entries are
+ * programmed, so neither depends on the order.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int program_order(const char *incdir)
+{
+	struct program_order *entries;
+	struct program_order *entry;
+	struct program_order *best;
+	struct program *program;
+	unsigned *order;
+	unsigned moved = 0;
+	unsigned count = 0;
+	unsigned n = 0;
+	unsigned i;
+	unsigned j;
+
+	for (program = programes; program; program = program->next)
+		count++;
+
+	if (count < 2)
+		return 0;
+
+	entries = calloc(count, sizeof(*entries));
+	order = calloc(count, sizeof(*order));
+	if (!entries || !order) {
+		free(entries);
+		free(order);
+		return -ENOMEM;
+	}
+
+	for (program = programes, i = 0; program; program = program->next, i++)
+		program_order_init(&entries[i], program, incdir);
+
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < j; i++)
+			entries[j].pending += program_order_depends(&entries[i], &entries[j]);
+	}
+
+	/* Repeatedly pick the lowest entry not waiting for an earlier one */
+	while (n < count) {
+		best = NULL;
+		for (i = 0; i < count; i++) {
+			entry = &entries[i];
+			if (entry->placed || entry->pending)
+				continue;
+
+			if (!best || program_order_before(entry, best))
+				best = entry;
+		}
+
+		best->placed = true;
+		order[n] = best - entries;
+		if (order[n] != n)
+			moved++;
+		n++;
+
+		for (j = best - entries + 1; j < count; j++) {
+			if (!entries[j].placed && program_order_depends(best, &entries[j]))
+				entries[j].pending--;
+		}
+	}
+
+	programes = entries[order[0]].program;
+	for (i = 1; i < count; i++)
+		entries[order[i - 1]].program->next = entries[order[i]].program;
+	programes_last = entries[order[count - 1]].program;
+	programes_last->next = NULL;
+
+	free(order);
+	free(entries);
+
+	if (moved)
+		fprintf(stderr, "[PROGRAM] ordered %u entries by partition and start sector\n", count);
+
+	return 0;
+}
+
+/* Number of sectors of the image behind @program, or 0 if unknown */
+static uint64_t program_file_sectors(struct program *program, const char *incdir)
+{
+	char tmp[PATH_MAX];
+	struct stat sb;
+
+	if (stat(program_path(program, incdir, tmp), &sb) < 0)
+		return 0;
+
+	return (sb.st_size + program->sector_size - 1) / program->sector_size;
+}
+
+/*
+ * Whether @next continues @program, in both the image and the storage, such
+ * that a single command programming both writes the same
+ */
+static bool program_mergeable(struct program *program, struct program *next,
+			      const char *incdir)
+{
+	uint64_t next_start;
+	uint64_t start;
+
+	if (program->erase || program->sparse || next->erase || next->sparse)
+		return false;
+
+	if (!program->filename || !next->filename || strcmp(program->filename, next->filename) ||
+	    program->partition != next->partition || program->sector_size != next->sector_size)
+		return false;
+
+	if (!program_start_sector(program, &start) || !program_start_sector(next, &next_start))
+		return false;
+
+	if (!program->num_sectors || !next->num_sectors ||
+	    next_start != start + program->num_sectors ||
+	    next->file_offset != program->file_offset + program->num_sectors)
+		return false;
+
+	if (program_is_stream(program, incdir))
+		return false;
+
+	/* The number of sectors programmed is capped by the size of the image */
+	return program_file_sectors(program, incdir) >=
+	       (uint64_t)program->num_sectors + next->num_sectors;
+}
+
+/**
+ * program_coalesce() - merge adjacent ranges of the same image
+ * @incdir:	include directory of the image files
+ *
+ * Program entries directly following one another, in both the image and
+ * the storage, e.g. slices of an image by file_sector_offset, are merged
+ * into single entries.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int program_coalesce(const char *incdir)
+{
+	struct program *program;
+	struct program *prev;
+	struct program *next;
+	unsigned merged = 0;
+
+	for (program = programes; program; program = program->next) {
+		if (program->erased || program->replaced)
+			continue;
+
+		for (;;) {
+			/* Entries not to be programmed don't keep others apart */
+			prev = program;
+			for (next = program->next; next && (next->erased || next->replaced);
+			     next = next->next)
+				prev = next;
+
+			if (!next || !program_mergeable(program, next, incdir))
+				break;
+
+			program->num_sectors += next->num_sectors;
+			prev->next = next->next;
+			if (programes_last == next)
+				programes_last = prev;
+			free(next);
+			merged++;
+		}
+	}
+
+	if (merged)
+		fprintf(stderr, "[PROGRAM] merged %u adjacent ranges of images\n", merged);
+
+	return 0;
+}
+
+/**
+ * program_list() - the program entries, in the order to be programmed
+ *
+ * Returns the first program entry, or NULL.
+ */
+struct program *program_list(void)
+{
+	return programes;
+}
+
+/**
+ * program_find_label() - find the program entry of a partition
+ * @label:	partition label
+ *
+ * Returns the first program entry with the given label, or NULL.
+ */
+struct program *program_find_label(const char *label)
+{
+	struct program *program;
+
+	for (program = programes; program; program = program->next) {
+		if (program->label && !strcmp(program->label, label))
+			return program;
+	}
+
+	return NULL;
+}
+
 /**
  * program_find_bootable_partition() - find one bootable partition
  *
@@ -154,7 +1257,8 @@ int program_find_bootable_partition(void)
 
 		if (!strcmp(label, "xbl") || !strcmp(label, "xbl_a") ||
 		    !strcmp(label, "sbl1")) {
-			if (part != -ENOENT)
+			/* An image may be programmed in several ranges */
+			if (part != -ENOENT && part != (int)program->partition)
 				return -EINVAL;
 
 			part = program->partition;
@@ -2,6 +2,8 @@
 #define __PROGRAM_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "qdl.h"
 
 struct program {
@@ -12,13 +14,36 @@ struct program {
 	unsigned num_sectors;
 	unsigned partition;
 	const char *start_sector;
+	bool sparse;
+
+	bool erase;
+	bool erased;
+
+	/* superseded by other entries, e.g. the ranges differing from a base build */
+	bool replaced;
+
+	/* bytes of the image hinted to the page cache ahead of programming */
+	size_t readahead;
 
 	struct program *next;
 };
 
 int program_load(const char *program_file);
+int program_load_base(const char *program_file);
 int program_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct program *program, int fd),
 		    const char *incdir);
+bool program_need_execute(void);
+int program_erase_zeros(const char *incdir, bool (*erased_zero)(unsigned partition));
+int program_delta(const char *base_dir, const char *incdir);
+int program_dedup(const char *incdir);
+int program_order(const char *incdir);
+int program_coalesce(const char *incdir);
+bool program_depends(struct program *a, struct program *b, const char *incdir);
+bool program_written(struct program *program, const char *incdir, uint64_t *count);
+struct program *program_list(void);
+unsigned program_sector_count(struct program *program, off_t size);
+bool program_start_sector(struct program *program, uint64_t *sector);
 int program_find_bootable_partition(void);
+struct program *program_find_label(const char *label);
 
 #endif
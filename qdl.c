@@ -50,9 +50,16 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+#include "dump.h"
+#include "hashdb.h"
+#include "journal.h"
 #include "qdl.h"
 #include "patch.h"
+#include "plan.h"
+#include "sha256.h"
+#include "source.h"
 #include "ufs.h"
+#include "vip.h"
 
 #define MAX_USBFS_BULK_SIZE    (16*1024)
 
@@ -62,19 +69,36 @@ enum {
     QDL_FILE_PROGRAM,
     QDL_FILE_UFS,
     QDL_FILE_CONTENTS,
+    QDL_FILE_PLAN,
 };
 
 struct qdl_device {
     libusb_device_handle *handle;
 
+    int intf;
     int in_ep;
     int out_ep;
 
     size_t in_maxpktsize;
     size_t out_maxpktsize;
+
+    char serial[64];
+
+    /* Simulated device, used to create VIP digests without a device */
+    bool sim;
+    bool sim_pending;
 };
 
+static const char qdl_sim_response[] =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\" ?><data>"
+        "<response value=\"ACK\" MaxPayloadSizeToTargetInBytes=\"1048576\" "
+        "MaxPayloadSizeToTargetInBytesSupported=\"1048576\" /></data>";
+
 bool qdl_debug;
+bool qdl_allocated_only;
+bool qdl_erased_zero;
+enum qdl_verify qdl_verify = QDL_VERIFY_NONE;
+enum qdl_incremental qdl_incremental = QDL_INCREMENTAL_NONE;
 
 static int detect_type(const char *xml_file) {
     xmlNode *root;
@@ -106,6 +130,8 @@ static int detect_type(const char *xml_file) {
         }
     } else if (!xmlStrcmp(root->name, (xmlChar *) "contents")) {
         type = QDL_FILE_CONTENTS;
+    } else if (!xmlStrcmp(root->name, (xmlChar *) "plan")) {
+        type = QDL_FILE_PLAN;
     }
 
     xmlFreeDoc(doc);
@@ -113,6 +139,36 @@ static int detect_type(const char *xml_file) {
     return type;
 }
 
+/*
+ * Devices in EDL mode report their serial number as part of the product
+ * string, e.g. "QUSB__BULK_SN:1234ABCD", rather than as a serial number
+ */
+static void usb_read_serial(struct qdl_device *qdl, struct libusb_device_descriptor *desc) {
+    char buf[128];
+    char *sn;
+    int ret;
+
+    qdl->serial[0] = '\0';
+
+    if (desc->iProduct) {
+        ret = libusb_get_string_descriptor_ascii(qdl->handle, desc->iProduct,
+                                                 (unsigned char *) buf, sizeof(buf));
+        sn = ret > 0 ? strstr(buf, "_SN:") : NULL;
+        if (sn) {
+            sn += 4;
+            snprintf(qdl->serial, sizeof(qdl->serial), "%.*s", (int) strcspn(sn, " _"), sn);
+            return;
+        }
+    }
+
+    if (desc->iSerialNumber) {
+        ret = libusb_get_string_descriptor_ascii(qdl->handle, desc->iSerialNumber,
+                                                 (unsigned char *) buf, sizeof(buf));
+        if (ret > 0)
+            snprintf(qdl->serial, sizeof(qdl->serial), "%.*s", (int) sizeof(qdl->serial) - 1, buf);
+    }
+}
+
 static int parse_usb_desc(libusb_device *device, struct qdl_device *qdl, int *intf) {
     unsigned out;
     unsigned in;
@@ -207,6 +263,8 @@ static int parse_usb_desc(libusb_device *device, struct qdl_device *qdl, int *in
             qdl->out_ep = out;
             qdl->out_maxpktsize = out_size;
 
+            usb_read_serial(qdl, &desc);
+
             *intf = interface.altsetting->bInterfaceNumber;
             return 0;
         }
@@ -238,6 +296,7 @@ static int usb_open(struct qdl_device *qdl) {
         }
     }
 
+    libusb_free_device_list(usb, usb_size);
     return -ENOENT;
 
     found:
@@ -247,11 +306,44 @@ static int usb_open(struct qdl_device *qdl) {
     if (ret) {
         err(1, "libusb_claim_interface");
     }
+    qdl->intf = intf;
     return 0;
 }
 
+static void usb_close(struct qdl_device *qdl) {
+    libusb_release_interface(qdl->handle, qdl->intf);
+    libusb_close(qdl->handle);
+    qdl->handle = NULL;
+}
+
+/* Wait for the device to re-enumerate after a reset */
+static int usb_reopen(struct qdl_device *qdl) {
+    int i;
+
+    usb_close(qdl);
+
+    for (i = 0; i < 30; i++) {
+        sleep(1);
+        if (!usb_open(qdl))
+            return 0;
+    }
+
+    fprintf(stderr, "device did not come back after reset\n");
+    return -ENOENT;
+}
+
 int qdl_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout) {
 
+    /* The simulated device ACKs every request */
+    if (qdl->sim) {
+        if (!qdl->sim_pending || len < sizeof(qdl_sim_response))
+            return LIBUSB_ERROR_TIMEOUT;
+
+        qdl->sim_pending = false;
+        memcpy(buf, qdl_sim_response, sizeof(qdl_sim_response) - 1);
+        return sizeof(qdl_sim_response) - 1;
+    }
+
     int transferred,
             ret = libusb_bulk_transfer(qdl->handle, qdl->in_ep, buf, len, &transferred, timeout);
     return ret ? ret : transferred;
@@ -261,6 +353,12 @@ int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, bool eot) {
 
     int transferred = 0, writed = 0, ret = -1, size = len;
     unsigned char *data = (unsigned char *) buf;
+
+    if (qdl->sim) {
+        qdl->sim_pending = true;
+        return len;
+    }
+
     while (size > 0) {
         int xfer = (size > qdl->out_maxpktsize) ? qdl->out_maxpktsize : size;
         ret = libusb_bulk_transfer(qdl->handle, qdl->out_ep, data, xfer, &transferred, 0);
@@ -283,6 +381,40 @@ int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, bool eot) {
     return writed;
 }
 
+/* Identify the session by the contents of its program, patch and UFS files */
+static void manifest_add(struct sha256_ctx *manifest, const char *path) {
+    char buf[4096];
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        err(1, "failed to open %s", path);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        sha256_update(manifest, buf, n);
+    if (n < 0)
+        err(1, "failed to read %s", path);
+
+    close(fd);
+}
+
+/*
+ * The program file of the base build has the same name as that of the new
+ * build, in the directory of the base build
+ */
+static void delta_load_base(const char *base_dir, const char *program_file) {
+    const char *name;
+    char path[PATH_MAX];
+
+    name = strrchr(program_file, '/');
+    name = name ? name + 1 : program_file;
+
+    snprintf(path, sizeof(path), "%s/%s", base_dir, name);
+    if (program_load_base(path) < 0)
+        errx(1, "failed to load %s of the base build", path);
+}
+
 #define RED   "\x1B[31m"
 #define GRN   "\x1B[32m"
 #define YEL   "\x1B[33m"
@@ -299,48 +431,166 @@ static void print_usage(void) {
             MAG"\t%s --debug --storage emmc ./prog_emmc_firehose_8996_ddr.elf rawprogram_unsparse.xml patch0.xml\n\n"RESET,
             __progname);
     fprintf(stderr,
-            "%s [--debug] [--storage <emmc|ufs>] [--finalize-provisioning] [--include <PATH>] <prog.mbn> [<program> <patch> ...]\n",
+            "%s [--debug] [--storage <emmc|ufs>] [--finalize-provisioning] [--include <PATH>] [--verify=<digest|readback>] [--vip-digests <PATH>] [--read-queue-depth <N>] [--direct-io=<never|auto|always>] [--allocated-only] [--erased-reads-zero] [--journal <PATH>] [--resume] [--incremental[=<history|probe>]] [--delta-base <PATH>] [--passes <LIST>] <prog.mbn> [<program> <patch> ...]\n",
             __progname);
+    fprintf(stderr,
+            "%s [--storage <emmc|ufs>] [--include <PATH>] [--delta-base <PATH>] [--passes <LIST>] <--dry-run|--save-plan <FILE>> <prog.mbn> [<program> <patch> ...]\n",
+            __progname);
+    fprintf(stderr,
+            "%s [--storage <emmc|ufs>] [--include <PATH>] --create-digests <PATH> <prog.mbn> [<program> <patch> ...]\n",
+            __progname);
+    fprintf(stderr,
+            "%s [--debug] [--storage <emmc|ufs>] [--sparse] dump <prog.mbn> <what>=<file> [<what>=<file> ...] [<program> ...]\n"
+            "\twhere <what> is a partition label, a LUN or <LUN>:<start sector>:<num sectors>\n",
+            __progname);
+    fprintf(stderr,
+            "--incremental records what's programmed per device in ~/.local/state/qdl; once it\n"
+            "exists, later sessions of the device update it with what they modify\n");
 }
 
 int main(int argc, char **argv) {
     char *prog_mbn, *storage = "ufs";
     char *incdir = NULL;
+    char *vip_create_dir = NULL;
+    char *journal_path = NULL;
+    char *hashdb_path = NULL;
+    char *cache_path = NULL;
+    char *delta_base = NULL;
+    char *plan_path = NULL;
+    char state_name[128];
+    char *end;
     int type;
     int ret;
     int opt;
     bool qdl_finalize_provisioning = false;
-    struct qdl_device qdl;
+    bool dump_mode = false;
+    bool sparse = false;
+    bool resume = false;
+    bool dry_run = false;
+    struct qdl_device qdl = {0};
+    struct sha256_ctx manifest;
+    uint8_t manifest_digest[SHA256_DIGEST_SIZE];
 
 
     static struct option options[] = {
+            {"allocated-only",        no_argument,       0, 'a'},
+            {"delta-base",            required_argument, 0, 'B'},
+            {"create-digests",        required_argument, 0, 'c'},
             {"debug",                 no_argument,       0, 'd'},
+            {"direct-io",             required_argument, 0, 'D'},
             {"include",               required_argument, 0, 'i'},
+            {"incremental",           optional_argument, 0, 'I'},
             {"finalize-provisioning", no_argument,       0, 'l'},
+            {"journal",               required_argument, 0, 'j'},
+            {"dry-run",               no_argument,       0, 'N'},
+            {"erased-reads-zero",     no_argument,       0, 'z'},
+            {"passes",                required_argument, 0, 'O'},
+            {"read-queue-depth",      required_argument, 0, 'q'},
+            {"resume",                no_argument,       0, 'r'},
+            {"save-plan",             required_argument, 0, 'P'},
+            {"sparse",                no_argument,       0, 'S'},
             {"storage",               required_argument, 0, 's'},
+            {"verify",                required_argument, 0, 'v'},
+            {"vip-digests",           required_argument, 0, 'V'},
             {0, 0,                                       0, 0}
     };
 
     while ((opt = getopt_long(argc, argv, "di:", options, NULL)) != -1) {
         switch (opt) {
+            case 'a':
+                qdl_allocated_only = true;
+                break;
+            case 'B':
+                delta_base = optarg;
+                break;
+            case 'c':
+                vip_create_dir = optarg;
+                break;
             case 'd':
                 qdl_debug = true;
                 break;
+            case 'D':
+                if (!strcmp(optarg, "never"))
+                    source_direct = SOURCE_DIRECT_NEVER;
+                else if (!strcmp(optarg, "auto"))
+                    source_direct = SOURCE_DIRECT_AUTO;
+                else if (!strcmp(optarg, "always"))
+                    source_direct = SOURCE_DIRECT_ALWAYS;
+                else
+                    errx(1, "unknown direct I/O policy \"%s\"", optarg);
+                break;
             case 'i':
                 incdir = optarg;
                 break;
+            case 'I':
+                if (!optarg || !strcmp(optarg, "history"))
+                    qdl_incremental = QDL_INCREMENTAL_HISTORY;
+                else if (!strcmp(optarg, "probe"))
+                    qdl_incremental = QDL_INCREMENTAL_PROBE;
+                else
+                    errx(1, "unknown incremental mode \"%s\"", optarg);
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
             case 'l':
                 qdl_finalize_provisioning = true;
                 break;
+            case 'N':
+                dry_run = true;
+                break;
+            case 'z':
+                qdl_erased_zero = true;
+                break;
+            case 'O':
+                if (plan_select(optarg) < 0)
+                    errx(1, "invalid passes \"%s\"", optarg);
+                break;
+            case 'P':
+                plan_path = optarg;
+                break;
+            case 'q':
+                source_queue_depth = strtoul(optarg, &end, 10);
+                if (*end || !source_queue_depth)
+                    errx(1, "invalid read queue depth \"%s\"", optarg);
+                if (source_queue_depth > SOURCE_QUEUE_DEPTH_MAX) {
+                    fprintf(stderr, "[SOURCE] read queue depth %u capped at %u\n",
+                            source_queue_depth, SOURCE_QUEUE_DEPTH_MAX);
+                    source_queue_depth = SOURCE_QUEUE_DEPTH_MAX;
+                }
+                break;
+            case 'r':
+                resume = true;
+                break;
             case 's':
                 storage = optarg;
                 break;
+            case 'S':
+                sparse = true;
+                break;
+            case 'V':
+                if (vip_load(optarg) < 0)
+                    errx(1, "failed to load VIP digests from %s", optarg);
+                break;
+            case 'v':
+                if (!strcmp(optarg, "digest"))
+                    qdl_verify = QDL_VERIFY_DIGEST;
+                else if (!strcmp(optarg, "readback"))
+                    qdl_verify = QDL_VERIFY_READBACK;
+                else
+                    errx(1, "unknown verify mode \"%s\"", optarg);
+                break;
             default:
                 print_usage();
                 return 1;
         }
     }
 
+    if (optind < argc && !strcmp(argv[optind], "dump")) {
+        dump_mode = true;
+        optind++;
+    }
+
     /* at least 2 non optional args required */
     if ((optind + 2) > argc) {
         print_usage();
@@ -349,11 +599,22 @@ int main(int argc, char **argv) {
 
     prog_mbn = argv[optind++];
 
+    sha256_init(&manifest);
+
     do {
+        if (dump_mode && strchr(argv[optind], '=')) {
+            ret = dump_add(argv[optind], sparse);
+            if (ret < 0)
+                errx(1, "invalid dump %s", argv[optind]);
+            continue;
+        }
+
         type = detect_type(argv[optind]);
         if (type < 0 || type == QDL_FILE_UNKNOWN)
             errx(1, "failed to detect file type of %s\n", argv[optind]);
 
+        manifest_add(&manifest, argv[optind]);
+
         switch (type) {
             case QDL_FILE_PATCH:
                 ret = patch_load(argv[optind]);
@@ -364,6 +625,18 @@ int main(int argc, char **argv) {
                 ret = program_load(argv[optind]);
                 if (ret < 0)
                     errx(1, "program_load %s failed", argv[optind]);
+                if (delta_base)
+                    delta_load_base(delta_base, argv[optind]);
+                break;
+            case QDL_FILE_PLAN:
+                if (delta_base)
+                    errx(1, "%s is a flash plan, already reduced to a delta", argv[optind]);
+                ret = program_load(argv[optind]);
+                if (ret < 0)
+                    errx(1, "program_load %s failed", argv[optind]);
+                ret = patch_load(argv[optind]);
+                if (ret < 0)
+                    errx(1, "patch_load %s failed", argv[optind]);
                 break;
             case QDL_FILE_UFS:
                 ret = ufs_load(argv[optind], qdl_finalize_provisioning);
@@ -376,15 +649,133 @@ int main(int argc, char **argv) {
         }
     } while (++optind < argc);
 
+    sha256_update(&manifest, storage, strlen(storage));
+    sha256_final(&manifest, manifest_digest);
+
+    /* A VIP session must be replayed as a whole, it can't be resumed */
+    if (resume && (dump_mode || vip_create_dir || vip_enabled()))
+        errx(1, "--resume can only be used for flashing without VIP");
+
+    if (qdl_incremental != QDL_INCREMENTAL_NONE && (dump_mode || vip_create_dir || vip_enabled()))
+        errx(1, "--incremental can only be used for flashing without VIP");
+
+    /* The signed digests don't cover the commands used for verification */
+    if (qdl_verify != QDL_VERIFY_NONE && vip_enabled())
+        errx(1, "--verify can't be used with --vip-digests");
+
+    if ((delta_base || plan_path || dry_run) && dump_mode)
+        errx(1, "--delta-base, --save-plan and --dry-run can only be used for flashing");
+
+    if (delta_base) {
+        ret = program_delta(delta_base, incdir);
+        if (ret < 0)
+            errx(1, "failed to compare against the base build: %s", strerror(-ret));
+    }
+
+    if (!dump_mode) {
+        ret = plan_optimize(PLAN_STAGE_HOST, incdir, NULL);
+        if (ret < 0)
+            return 1;
+    }
+
+    if (dry_run)
+        plan_print(incdir);
+
+    /* Planned once, the plan can be executed on any number of devices */
+    if (plan_path) {
+        ret = plan_save(plan_path);
+        if (ret < 0)
+            errx(1, "failed to save the flash plan to %s", plan_path);
+    }
+
+    if (dry_run || plan_path)
+        return 0;
+
+    if (vip_create_dir) {
+        if (dump_mode || qdl_verify != QDL_VERIFY_NONE)
+            errx(1, "--create-digests can only be used for flashing");
+
+        /* Run the session against a simulated device, hashing each packet */
+        qdl.sim = true;
+        vip_gen_init();
+
+        ret = firehose_run(&qdl, incdir, storage);
+        if (!ret)
+            ret = vip_gen_finalize(vip_create_dir);
+
+        return ret ? 1 : 0;
+    }
+
     ret = usb_open(&qdl);
     if (ret)
         return 1;
 
-    ret = sahara_run(&qdl, prog_mbn);
-    if (ret < 0)
-        return 1;
+    /*
+     * Journal the operations of the session, for it to be resumed if cut
+     * short; without a serial number the journal might be of another device
+     */
+    if (!dump_mode && !vip_enabled() && (journal_path || resume)) {
+        if (!journal_path && qdl.serial[0]) {
+            snprintf(state_name, sizeof(state_name), "%s.journal", qdl.serial);
+            journal_path = state_path(state_name, true);
+        }
+
+        if (journal_path)
+            journal_open(journal_path, qdl.serial[0] ? qdl.serial : "unknown",
+                         manifest_digest, resume);
+        else if (resume)
+            fprintf(stderr, "[RESUME] device has no serial number, flashing everything\n");
+    }
+
+    /*
+     * Keep the hashes of what's programmed to the device, or, once flashed
+     * with --incremental, at least keep those recorded from going stale
+     */
+    if (!dump_mode && !vip_enabled() && qdl.serial[0]) {
+        snprintf(state_name, sizeof(state_name), "%s.hashdb", qdl.serial);
+        hashdb_path = state_path(state_name, qdl_incremental == QDL_INCREMENTAL_HISTORY);
+        if (hashdb_path)
+            hashdb_open(hashdb_path, qdl_incremental == QDL_INCREMENTAL_HISTORY);
+
+        if (qdl_incremental == QDL_INCREMENTAL_HISTORY) {
+            cache_path = state_path("image-hashes", true);
+            if (cache_path)
+                hashdb_cache_open(cache_path);
+        }
+    } else if (qdl_incremental == QDL_INCREMENTAL_HISTORY) {
+        fprintf(stderr, "[INCREMENTAL] device has no serial number, flashing everything\n");
+    }
+
+    for (;;) {
+        ret = sahara_run(&qdl, prog_mbn);
+        if ((ret == -ETIMEDOUT || ret == -EPROTO) && !vip_enabled()) {
+            /* No Sahara HELLO, the programmer might still be running */
+            ret = firehose_probe(&qdl);
+            if (ret < 0) {
+                fprintf(stderr, "device responds to neither Sahara nor firehose\n");
+                return 1;
+            }
+
+            printf("firehose programmer already running, skipping Sahara\n");
+        } else if (ret < 0) {
+            return 1;
+        }
+
+        ret = firehose_run(&qdl, incdir, storage);
+        if (ret != -EAGAIN)
+            break;
+
+        /* The device was reset to complete the session, reconnect */
+        ret = usb_reopen(&qdl);
+        if (ret)
+            return 1;
+    }
+
+    if (!ret)
+        journal_complete();
+    journal_close();
+    hashdb_close();
 
-    ret = firehose_run(&qdl, incdir, storage);
     if (ret < 0)
         return 1;
 
@@ -9,15 +9,35 @@
 
 struct qdl_device;
 
+enum qdl_verify {
+	QDL_VERIFY_NONE,
+	QDL_VERIFY_DIGEST,
+	QDL_VERIFY_READBACK,
+};
+
+enum qdl_incremental {
+	QDL_INCREMENTAL_NONE,
+	QDL_INCREMENTAL_HISTORY,
+	QDL_INCREMENTAL_PROBE,
+};
+
 int qdl_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout);
 int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, bool eot);
 
+int firehose_probe(struct qdl_device *qdl);
 int firehose_run(struct qdl_device *qdl, const char *incdir, const char *storage);
 int sahara_run(struct qdl_device *qdl, char *prog_mbn);
 void print_hex_dump(const char *prefix, const void *buf, size_t len);
+bool is_zero_buffer(const void *buf, size_t len);
 unsigned attr_as_unsigned(xmlNode *node, const char *attr, int *errors);
 const char *attr_as_string(xmlNode *node, const char *attr, int *errors);
+bool attr_as_bool(xmlNode *node, const char *attr);
+char *state_path(const char *name, bool create);
 
 extern bool qdl_debug;
+extern bool qdl_allocated_only;
+extern bool qdl_erased_zero;
+extern enum qdl_verify qdl_verify;
+extern enum qdl_incremental qdl_incremental;
 
 #endif
@@ -197,6 +197,7 @@ int sahara_run(struct qdl_device *qdl, char *prog_mbn)
 	struct sahara_pkt *pkt;
 	char buf[4096];
 	char tmp[32];
+	bool hello = false;
 	bool done = false;
 	int n;
 
@@ -206,7 +207,11 @@ int sahara_run(struct qdl_device *qdl, char *prog_mbn)
 			break;
 
 		pkt = (struct sahara_pkt*)buf;
-		if (n != pkt->length) {
+		if (n < 8 || n != pkt->length) {
+			/* Not speaking Sahara, the caller might want to probe for firehose */
+			if (!hello)
+				return -EPROTO;
+
 			fprintf(stderr, "length not matching");
 			return -EINVAL;
 		}
@@ -214,6 +219,7 @@ int sahara_run(struct qdl_device *qdl, char *prog_mbn)
 		switch (pkt->cmd) {
 		case 1:
 			sahara_hello(qdl, pkt);
+			hello = true;
 			break;
 		case 3:
 			sahara_read(qdl, pkt, prog_mbn);
@@ -235,5 +241,8 @@ int sahara_run(struct qdl_device *qdl, char *prog_mbn)
 		}
 	}
 
+	if (!hello)
+		return -ETIMEDOUT;
+
 	return done ? 0 : -1;
 }
@@ -0,0 +1,1504 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define SOURCE_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#include "bufpool.h"
+#include "decompress.h"
+#include "qdl.h"
+#include "source.h"
+
+/*
+ * An image source delivers the content of an image in chunks of whole
+ * sectors, with data beyond the end of the file delivered as zeros to pad the
+ * image to the programmed size. Chunks never straddle the end of the file,
+ * whose final partial sector is delivered on its own, so that all readers
+ * split the image into the same packets.
+ *
+ * Regular files are mapped and transmitted straight from the mapping. Other
+ * files are prefetched by a reader thread into a ring of buffers. The reader
+ * (producer) and the USB sender (consumer) hand buffers to each other through
+ * the ring's head and tail counters, without taking any locks. Only when the
+ * ring is full, or empty, does the side waiting for it block, on a condition
+ * variable signalled by the other side once it moves its counter.
+ *
+ * When a read queue depth is configured, images are instead read through
+ * io_uring, keeping that many reads in flight, and the threaded reader is
+ * used when io_uring is unavailable. The ring is set up once per session,
+ * see source_uring_create(), and shared by its sources.
+ *
+ * Either reader may bypass the page cache using O_DIRECT, in which case reads
+ * are widened to the direct I/O alignment and the chunk is delivered from
+ * within the aligned buffer.
+ *
+ * Compressed images are always read by the reader thread, which expands them
+ * in order, with the offset and size of the image applying to the expanded
+ * data. So are images read from a pipe, which can't be mapped or read at an
+ * offset.
+ *
+ * The readers borrow a buffer from the session's buffer pool for each chunk,
+ * and return it when the chunk is released, or later if the consumer took
+ * its own reference to it.
+ */
+#define SOURCE_BUFFERS	4
+
+/* Alignment satisfying O_DIRECT on both 512 byte and 4k block devices */
+#define SOURCE_DIRECT_ALIGN	4096
+
+/* Smaller images are cheap enough to keep in the page cache */
+#define SOURCE_DIRECT_MIN_SIZE	(64 * 1024 * 1024)
+
+unsigned source_queue_depth;
+enum source_direct source_direct = SOURCE_DIRECT_NEVER;
+
+enum source_type {
+	SOURCE_MMAP,
+	SOURCE_THREAD,
+	SOURCE_URING,
+	SOURCE_SEGMENTS,
+};
+
+struct source_queue;
+
+struct source_buf {
+	void *base;
+	void *data;
+	size_t len;
+};
+
+struct source {
+	enum source_type type;
+
+	int fd;
+	off_t offset;
+	uint64_t size;
+	unsigned sector_size;
+	size_t chunk_size;
+
+	/* reads bypass the page cache, fd_flags holds the original file flags */
+	bool direct;
+	int fd_flags;
+
+	/* bytes of the image backed by the file, and the consumer's position */
+	uint64_t data_len;
+	uint64_t pos;
+
+	/* mmap: the image is delivered from the mapping up to the last full sector */
+	void *map;
+	size_t map_len;
+	const void *data;
+	size_t len;
+	void *bounce;
+	void *zeros;
+
+	/* thread: chunks are prefetched into the ring by the reader */
+	struct source_buf bufs[SOURCE_BUFFERS];
+
+	/* written by the reader */
+	atomic_uint head;
+	/* written by the consumer */
+	atomic_uint tail;
+
+	atomic_int error;
+	atomic_bool stop;
+
+	/* blocking on a full or empty ring */
+	atomic_uint waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	pthread_t thread;
+
+	/* thread: compressed images are expanded while read */
+	struct decompress *dc;
+	/* thread: the image is read from a pipe, in order, until its end */
+	bool stream;
+	bool stream_eof;
+	void *carry;
+	size_t carry_len;
+
+	/* io_uring: reads are kept in flight by the consumer itself */
+	struct source_queue *queue;
+
+	/* segments: data segments are read through a nested source */
+	struct source_segment *segs;
+	unsigned nsegs;
+	unsigned seg;
+	uint64_t seg_pos;
+	struct source *child;
+	void *fill;
+	uint32_t fill_pattern;
+};
+
+/* Length of the chunk at @pos */
+static size_t source_chunk_len(struct source *src, uint64_t pos)
+{
+	uint64_t full = src->data_len - src->data_len % src->sector_size;
+	uint64_t end;
+
+	if (pos < full)
+		end = full;
+	else if (pos < src->data_len)
+		return src->sector_size;
+	else
+		end = src->size;
+
+	return end - pos < src->chunk_size ? end - pos : src->chunk_size;
+}
+
+static int source_mmap_open(struct source *src)
+{
+	uint64_t avail = src->data_len;
+	struct stat sb;
+	size_t delta;
+	long page;
+	int ret;
+
+	ret = fstat(src->fd, &sb);
+	if (ret < 0 || !S_ISREG(sb.st_mode))
+		return -EINVAL;
+
+	if (avail) {
+		page = sysconf(_SC_PAGESIZE);
+		delta = src->offset % page;
+
+		if (delta + avail > SIZE_MAX)
+			return -EFBIG;
+
+		src->map_len = delta + avail;
+		src->map = mmap(NULL, src->map_len, PROT_READ, MAP_SHARED,
+				src->fd, src->offset - delta);
+		if (src->map == MAP_FAILED) {
+			src->map = NULL;
+			return -errno;
+		}
+
+		/* Hints only, the mapping works without them */
+		madvise(src->map, src->map_len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		madvise(src->map, src->map_len, MADV_HUGEPAGE);
+#endif
+
+		src->data = (const char *)src->map + delta;
+	}
+
+	src->type = SOURCE_MMAP;
+
+	return 0;
+}
+
+static ssize_t source_mmap_next(struct source *src, const void **buf)
+{
+	uint64_t full = src->data_len - src->data_len % src->sector_size;
+	size_t tail;
+
+	if (src->pos >= src->size)
+		return 0;
+
+	src->len = source_chunk_len(src, src->pos);
+
+	if (src->pos < full) {
+		/* Whole sectors straight from the mapping */
+		*buf = (const char *)src->data + src->pos;
+	} else if (src->pos < src->data_len) {
+		/* The final partial sector, padded in a bounce buffer */
+		if (!src->bounce) {
+			src->bounce = malloc(src->sector_size);
+			if (!src->bounce)
+				return -ENOMEM;
+		}
+
+		tail = src->data_len - src->pos;
+		memcpy(src->bounce, (const char *)src->data + src->pos, tail);
+		memset((char *)src->bounce + tail, 0, src->sector_size - tail);
+
+		*buf = src->bounce;
+	} else {
+		/* Zeros past the end of the file */
+		if (!src->zeros) {
+			src->zeros = bufpool_get();
+			memset(src->zeros, 0, src->chunk_size);
+		}
+
+		*buf = src->zeros;
+	}
+
+	return src->len;
+}
+
+/* Wake the other side of the ring, if it's blocked waiting for a change */
+static void source_wake(struct source *src)
+{
+	/* Pairs with the fence in source_wait(), one sees what the other did */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&src->waiters, memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&src->lock);
+	pthread_cond_broadcast(&src->cond);
+	pthread_mutex_unlock(&src->lock);
+}
+
+/* Block until the other side of the ring makes @ready true */
+static void source_wait(struct source *src, bool (*ready)(struct source *src))
+{
+	pthread_mutex_lock(&src->lock);
+	atomic_fetch_add(&src->waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	while (!ready(src))
+		pthread_cond_wait(&src->cond, &src->lock);
+
+	atomic_fetch_sub(&src->waiters, 1);
+	pthread_mutex_unlock(&src->lock);
+}
+
+/* The reader has room for another chunk, or is to stop */
+static bool source_ring_room(struct source *src)
+{
+	return atomic_load_explicit(&src->head, memory_order_relaxed) -
+	       atomic_load_explicit(&src->tail, memory_order_acquire) < SOURCE_BUFFERS ||
+	       atomic_load(&src->stop);
+}
+
+/* The consumer has a chunk to take, or an error to report */
+static bool source_ring_ready(struct source *src)
+{
+	return atomic_load_explicit(&src->head, memory_order_acquire) !=
+	       atomic_load_explicit(&src->tail, memory_order_relaxed) ||
+	       atomic_load(&src->error);
+}
+
+/* Widen a read of @len bytes at @offset to the direct I/O alignment */
+static size_t source_direct_span(struct source *src, off_t *offset, size_t len, size_t *delta)
+{
+	*delta = 0;
+	if (!src->direct)
+		return len;
+
+	*delta = *offset & (SOURCE_DIRECT_ALIGN - 1);
+	*offset -= *delta;
+
+	return (*delta + len + SOURCE_DIRECT_ALIGN - 1) & ~(size_t)(SOURCE_DIRECT_ALIGN - 1);
+}
+
+/**
+ * source_buffer_size() - size of the buffers needed by the readers
+ * @chunk_size:	maximum chunk size
+ *
+ * Return: buffer size, with room to widen the reads for direct I/O
+ */
+size_t source_buffer_size(size_t chunk_size)
+{
+	return chunk_size + 2 * SOURCE_DIRECT_ALIGN;
+}
+
+/**
+ * source_buffer_count() - number of buffers an open source may hold
+ *
+ * Return: number of buffers
+ */
+unsigned source_buffer_count(void)
+{
+	/* The chunks in flight, and the zeros past the end of the file */
+	return (source_queue_depth > SOURCE_BUFFERS ? source_queue_depth : SOURCE_BUFFERS) + 1;
+}
+
+/*
+ * Fill a chunk from a pipe, whose length is only known once its end is
+ * reached. The chunk in which it ends is then cut short, following the chunk
+ * plan of a file of that length, with its partial sector carried over to
+ * the next chunk.
+ */
+static int source_stream_fill(struct source *src, struct source_buf *buf, uint64_t pos, size_t len)
+{
+	size_t fill = src->carry_len;
+	ssize_t n;
+
+	memcpy(buf->base, src->carry, src->carry_len);
+	src->carry_len = 0;
+
+	while (!src->stream_eof && fill < len) {
+		n = read(src->fd, buf->base + fill, len - fill);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+
+		if (n == 0) {
+			src->stream_eof = true;
+			src->data_len = pos + fill;
+			len = source_chunk_len(src, pos);
+			break;
+		}
+
+		fill += n;
+	}
+
+	if (fill > len) {
+		src->carry_len = fill - len;
+		memcpy(src->carry, buf->base + len, src->carry_len);
+		fill = len;
+	}
+
+	if (fill < len)
+		memset(buf->base + fill, 0, len - fill);
+
+	buf->data = buf->base;
+	buf->len = len;
+
+	return 0;
+}
+
+static int source_fill(struct source *src, struct source_buf *buf, off_t offset, size_t len)
+{
+	size_t fill = 0;
+	size_t delta;
+	size_t span;
+	ssize_t n;
+
+	if (src->stream)
+		return source_stream_fill(src, buf, offset - src->offset, len);
+
+	span = source_direct_span(src, &offset, len, &delta);
+
+	if (src->dc) {
+		n = decompress_read(src->dc, buf->base, span);
+		if (n < 0)
+			return n;
+
+		fill = n;
+	}
+
+	while (!src->dc && fill < span) {
+		n = pread(src->fd, buf->base + fill, span - fill, offset + fill);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			break;
+
+		fill += n;
+
+		/* A direct read ends short, and unaligned, only at the end of the file */
+		if (src->direct && (n & (SOURCE_DIRECT_ALIGN - 1)))
+			break;
+	}
+
+	/* Pad with zeros past the end of the file */
+	if (fill < span)
+		memset(buf->base + fill, 0, span - fill);
+
+	buf->data = buf->base + delta;
+	buf->len = len;
+
+	return 0;
+}
+
+/* Discard the part of a piped image ahead of the offset */
+static int source_stream_skip(struct source *src)
+{
+	off_t left = src->offset;
+	ssize_t n;
+	void *buf;
+
+	if (!left)
+		return 0;
+
+	buf = bufpool_get();
+
+	while (left) {
+		n = read(src->fd, buf, left < (off_t)src->chunk_size ? left : (off_t)src->chunk_size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		left -= n;
+	}
+
+	bufpool_put(buf);
+
+	return n < 0 ? -errno : 0;
+}
+
+/* Report a read error to the consumer */
+static void source_fail(struct source *src, int error)
+{
+	atomic_store(&src->error, error);
+	source_wake(src);
+}
+
+static void *source_reader(void *data)
+{
+	struct source *src = data;
+	struct source_buf *buf;
+	uint64_t done = 0;
+	unsigned head;
+	size_t len;
+	int ret;
+
+	if (src->dc) {
+		ret = decompress_skip(src->dc, src->offset);
+		if (ret < 0) {
+			source_fail(src, ret);
+			return NULL;
+		}
+	}
+
+	if (src->stream) {
+		ret = source_stream_skip(src);
+		if (ret < 0) {
+			source_fail(src, ret);
+			return NULL;
+		}
+	}
+
+	while (done < src->size) {
+		head = atomic_load_explicit(&src->head, memory_order_relaxed);
+
+		if (head - atomic_load_explicit(&src->tail, memory_order_acquire) == SOURCE_BUFFERS)
+			source_wait(src, source_ring_room);
+		if (atomic_load(&src->stop))
+			return NULL;
+
+		buf = &src->bufs[head % SOURCE_BUFFERS];
+		buf->base = bufpool_get();
+		len = source_chunk_len(src, done);
+
+		ret = source_fill(src, buf, src->offset + done, len);
+		if (ret < 0) {
+			bufpool_put(buf->base);
+			source_fail(src, ret);
+			return NULL;
+		}
+
+		done += buf->len;
+
+		atomic_store_explicit(&src->head, head + 1, memory_order_release);
+		source_wake(src);
+	}
+
+	return NULL;
+}
+
+static void source_thread_open(struct source *src)
+{
+	int ret;
+
+	src->type = SOURCE_THREAD;
+
+	pthread_mutex_init(&src->lock, NULL);
+	pthread_cond_init(&src->cond, NULL);
+
+	ret = pthread_create(&src->thread, NULL, source_reader, src);
+	if (ret)
+		errx(1, "failed to create reader thread");
+}
+
+static ssize_t source_thread_next(struct source *src, const void **buf)
+{
+	struct source_buf *sbuf;
+	unsigned tail;
+	int error;
+
+	tail = atomic_load_explicit(&src->tail, memory_order_relaxed);
+
+	while (atomic_load_explicit(&src->head, memory_order_acquire) == tail) {
+		if (src->pos >= src->size)
+			return 0;
+
+		error = atomic_load(&src->error);
+		if (error)
+			return error;
+
+		source_wait(src, source_ring_ready);
+	}
+
+	sbuf = &src->bufs[tail % SOURCE_BUFFERS];
+	*buf = sbuf->data;
+
+	return sbuf->len;
+}
+
+#ifdef SOURCE_HAVE_IO_URING
+
+/* A read of one chunk, into a buffer borrowed for it */
+struct source_req {
+	struct source *src;
+	void *data;
+	uint64_t pos;
+	size_t len;
+	bool done;
+
+	/* the read, widened for direct I/O */
+	off_t offset;
+	size_t delta;
+	size_t span;
+	size_t filled;
+
+	struct iovec iov;
+};
+
+/*
+ * The io_uring of the session, shared by its sources, with the buffer pool
+ * registered once for all of their reads
+ */
+struct source_uring {
+	int fd;
+	bool registered;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_entries;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned pending;
+
+	/* sources may be read from worker threads */
+	pthread_mutex_t lock;
+};
+
+static struct source_uring *source_uring;
+
+/* The reads of one source, kept in flight on the session's io_uring */
+struct source_queue {
+	unsigned depth;
+	struct source_req *reqs;
+
+	/* sequence numbers of the next chunk to hand out and to queue */
+	uint64_t chunk;
+	uint64_t queued;
+	uint64_t queue_pos;
+
+	unsigned inflight;
+	int error;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int source_uring_submit(unsigned min_complete)
+{
+	struct source_uring *u = source_uring;
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	do {
+		ret = io_uring_enter(u->fd, u->pending, min_complete, flags);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+
+	u->pending -= ret;
+
+	return 0;
+}
+
+static void source_uring_queue(struct source_req *req)
+{
+	struct source_uring *u = source_uring;
+	struct source *src = req->src;
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	unsigned idx;
+
+	/* Make room, should more reads be queued than the ring holds */
+	while (*u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == *u->sq_entries) {
+		if (source_uring_submit(0) < 0)
+			break;
+	}
+
+	tail = *u->sq_tail;
+	idx = tail & *u->sq_mask;
+
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = src->fd;
+	sqe->off = req->offset + req->filled;
+	sqe->user_data = (uintptr_t)req;
+
+	if (u->registered) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)req->data + req->filled;
+		sqe->len = req->span - req->filled;
+		sqe->buf_index = bufpool_index(req->data);
+	} else {
+		req->iov.iov_base = (char *)req->data + req->filled;
+		req->iov.iov_len = req->span - req->filled;
+
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr = (uintptr_t)&req->iov;
+		sqe->len = 1;
+	}
+
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	u->pending++;
+	src->queue->inflight++;
+}
+
+static void source_uring_start(struct source *src)
+{
+	struct source_queue *q = src->queue;
+	struct source_req *req = &q->reqs[q->queued++ % q->depth];
+
+	req->src = src;
+	req->data = bufpool_get();
+	req->pos = q->queue_pos;
+	req->len = source_chunk_len(src, req->pos);
+	req->offset = src->offset + req->pos;
+	req->span = source_direct_span(src, &req->offset, req->len, &req->delta);
+	req->filled = 0;
+	req->done = false;
+
+	q->queue_pos += req->len;
+
+	source_uring_queue(req);
+}
+
+/* Complete the reads of every source of the session that have finished */
+static void source_uring_complete(void)
+{
+	struct source_uring *u = source_uring;
+	struct io_uring_cqe *cqe;
+	struct source_req *req;
+	struct source *src;
+	unsigned head;
+	unsigned tail;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & *u->cq_mask];
+		req = (struct source_req *)(uintptr_t)cqe->user_data;
+		src = req->src;
+		src->queue->inflight--;
+
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+			source_uring_queue(req);
+		} else if (cqe->res < 0) {
+			src->queue->error = cqe->res;
+		} else {
+			req->filled += cqe->res;
+
+			/*
+			 * Reads end short at the end of the file, unaligned or
+			 * empty in the case of direct I/O, pad with zeros.
+			 */
+			if (req->filled < req->span && cqe->res &&
+			    !(src->direct && (cqe->res & (SOURCE_DIRECT_ALIGN - 1)))) {
+				source_uring_queue(req);
+				continue;
+			}
+
+			memset((char *)req->data + req->filled, 0, req->span - req->filled);
+			req->done = true;
+		}
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait for the reads of the session to make progress */
+static int source_uring_wait(void)
+{
+	int ret;
+
+	ret = source_uring_submit(1);
+	if (ret < 0)
+		return ret;
+
+	source_uring_complete();
+
+	return 0;
+}
+
+static void source_uring_unmap(struct source_uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	free(u);
+}
+
+/**
+ * source_uring_create() - set up the io_uring shared by the session's sources
+ *
+ * With a read queue depth, the ring is set up once the buffer pool is, and
+ * the pool registered with it for all reads of the session. Sources fall
+ * back to other readers if the ring can't be set up.
+ */
+void source_uring_create(void)
+{
+	struct io_uring_params p = {0};
+	struct source_uring *u;
+	struct iovec *iovs;
+	unsigned i;
+	int ret;
+
+	if (!source_queue_depth)
+		return;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return;
+
+	/* Room for a second source reading while the first one is open */
+	u->fd = io_uring_setup(2 * source_queue_depth, &p);
+	if (u->fd < 0)
+		goto err;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			goto err;
+		}
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto err;
+	}
+
+	u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_entries = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_entries);
+	u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	iovs = calloc(bufpool_count(), sizeof(*iovs));
+	if (!iovs)
+		err(1, "failed to allocate read queue");
+
+	for (i = 0; i < bufpool_count(); i++) {
+		iovs[i].iov_base = bufpool_buf(i);
+		iovs[i].iov_len = bufpool_size();
+	}
+
+	/*
+	 * Registering the pool saves mapping the buffers for every read, but
+	 * may exceed the locked memory limit, in which case plain reads are
+	 * used.
+	 */
+	ret = io_uring_register(u->fd, IORING_REGISTER_BUFFERS, iovs, bufpool_count());
+	u->registered = ret == 0;
+	free(iovs);
+
+	pthread_mutex_init(&u->lock, NULL);
+	source_uring = u;
+
+	return;
+
+err:
+	source_uring_unmap(u);
+}
+
+/**
+ * source_uring_destroy() - tear down the io_uring of the session
+ *
+ * Every source must have been closed, before the buffer pool is destroyed.
+ */
+void source_uring_destroy(void)
+{
+	struct source_uring *u = source_uring;
+
+	if (!u)
+		return;
+
+	source_uring = NULL;
+
+	pthread_mutex_destroy(&u->lock);
+	source_uring_unmap(u);
+}
+
+static void source_uring_free(struct source *src)
+{
+	struct source_queue *q = src->queue;
+	unsigned i;
+
+	pthread_mutex_lock(&source_uring->lock);
+
+	/* The kernel may still be writing to the buffers */
+	while (q->inflight && !source_uring_wait())
+		;
+
+	pthread_mutex_unlock(&source_uring->lock);
+
+	for (i = 0; i < q->depth; i++)
+		bufpool_put(q->reqs[i].data);
+	free(q->reqs);
+
+	free(q);
+	src->queue = NULL;
+}
+
+static int source_uring_open(struct source *src)
+{
+	struct source_queue *q;
+	int ret;
+
+	if (!source_uring)
+		return -ENOSYS;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+
+	q->depth = source_queue_depth;
+	q->reqs = calloc(q->depth, sizeof(*q->reqs));
+	if (!q->reqs)
+		err(1, "failed to allocate read queue");
+
+	src->queue = q;
+	src->type = SOURCE_URING;
+
+	pthread_mutex_lock(&source_uring->lock);
+
+	while (q->queue_pos < src->size && q->queued < q->depth)
+		source_uring_start(src);
+
+	ret = source_uring_submit(0);
+
+	pthread_mutex_unlock(&source_uring->lock);
+
+	if (ret < 0) {
+		source_uring_free(src);
+		return ret;
+	}
+
+	return 0;
+}
+
+static ssize_t source_uring_next(struct source *src, const void **buf)
+{
+	struct source_queue *q = src->queue;
+	struct source_req *req;
+	int ret = 0;
+
+	if (src->pos >= src->size)
+		return 0;
+
+	req = &q->reqs[q->chunk % q->depth];
+
+	pthread_mutex_lock(&source_uring->lock);
+	while (!req->done && !q->error && !ret)
+		ret = source_uring_wait();
+	pthread_mutex_unlock(&source_uring->lock);
+
+	if (!req->done)
+		return q->error ? : ret;
+
+	*buf = (char *)req->data + req->delta;
+
+	return req->len;
+}
+
+static void source_uring_release(struct source *src)
+{
+	struct source_queue *q = src->queue;
+	struct source_req *req = &q->reqs[q->chunk % q->depth];
+
+	src->pos += req->len;
+	bufpool_put(req->data);
+	req->data = NULL;
+	q->chunk++;
+
+	/* Reuse the released buffer for the next chunk not yet in flight */
+	if (q->queue_pos < src->size) {
+		pthread_mutex_lock(&source_uring->lock);
+		source_uring_start(src);
+		source_uring_submit(0);
+		pthread_mutex_unlock(&source_uring->lock);
+	}
+}
+
+#else
+
+static int source_uring_open(struct source *src)
+{
+	return -ENOSYS;
+}
+
+static ssize_t source_uring_next(struct source *src, const void **buf)
+{
+	return -ENOSYS;
+}
+
+static void source_uring_release(struct source *src)
+{
+}
+
+static void source_uring_free(struct source *src)
+{
+}
+
+void source_uring_create(void)
+{
+}
+
+void source_uring_destroy(void)
+{
+}
+
+#endif
+
+/*
+ * An image that is already largely in the page cache is most likely shared
+ * with other sessions, and reading it through the cache costs nothing.
+ */
+static bool source_cached(struct source *src)
+{
+	unsigned char *vec;
+	size_t resident = 0;
+	size_t pages;
+	size_t delta;
+	size_t len;
+	void *map;
+	long page;
+	size_t i;
+	int ret;
+
+	page = sysconf(_SC_PAGESIZE);
+	delta = src->offset % page;
+	len = delta + src->data_len;
+	pages = (len + page - 1) / page;
+
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, src->fd, src->offset - delta);
+	if (map == MAP_FAILED)
+		return false;
+
+	vec = malloc(pages);
+	if (!vec) {
+		munmap(map, len);
+		return false;
+	}
+
+	ret = mincore(map, len, (void *)vec);
+	if (!ret) {
+		for (i = 0; i < pages; i++)
+			resident += vec[i] & 1;
+	}
+
+	free(vec);
+	munmap(map, len);
+
+	return !ret && resident >= pages / 4;
+}
+
+static bool source_want_direct(struct source *src)
+{
+	switch (source_direct) {
+	case SOURCE_DIRECT_NEVER:
+		return false;
+	case SOURCE_DIRECT_ALWAYS:
+		return true;
+	case SOURCE_DIRECT_AUTO:
+		return src->data_len >= SOURCE_DIRECT_MIN_SIZE && !source_cached(src);
+	}
+
+	return false;
+}
+
+static int source_direct_enable(struct source *src)
+{
+#ifdef O_DIRECT
+	int ret;
+
+	src->fd_flags = fcntl(src->fd, F_GETFL);
+	if (src->fd_flags < 0)
+		return -errno;
+
+	ret = fcntl(src->fd, F_SETFL, src->fd_flags | O_DIRECT);
+	if (ret < 0)
+		return -errno;
+
+	src->direct = true;
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/**
+ * source_is_stream() - check if an image can only be read in order
+ * @fd:		file descriptor of the image
+ *
+ * Return: true for pipes and other files that can't seek
+ */
+bool source_is_stream(int fd)
+{
+	return lseek(fd, 0, SEEK_CUR) < 0 && errno == ESPIPE;
+}
+
+/**
+ * source_file_size() - get the size of an image file
+ * @fd:		file descriptor of the image
+ * @size:	size of the image
+ *
+ * The size of a compressed image is the size of the expanded image.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int source_file_size(int fd, uint64_t *size)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0)
+		return -errno;
+
+	if (S_ISREG(sb.st_mode) && decompress_detect(fd) != DECOMPRESS_NONE)
+		return decompress_size(fd, size);
+
+	*size = sb.st_size;
+
+	return 0;
+}
+
+/**
+ * source_open() - start reading an image
+ * @fd:		file descriptor of the image
+ * @offset:	offset in the file to start reading from
+ * @size:	number of bytes to deliver, a multiple of @sector_size
+ * @sector_size: size of a sector, the unit of every chunk
+ * @chunk_size:	maximum size of each chunk delivered by source_next(), a
+ *		multiple of @sector_size
+ *
+ * Buffers are borrowed from the session's buffer pool, which must hold
+ * source_buffer_count() buffers of source_buffer_size() for the source.
+ *
+ * Return: image source, or NULL on failure
+ */
+struct source *source_open(int fd, off_t offset, uint64_t size,
+			   unsigned sector_size, size_t chunk_size)
+{
+	uint64_t file_size;
+	struct source *src;
+	struct stat sb;
+	int ret;
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return NULL;
+
+	src->fd = fd;
+	src->offset = offset;
+	src->size = size;
+	src->sector_size = sector_size;
+	src->chunk_size = chunk_size;
+
+	/* Without a known file size the whole image is read from the file */
+	src->data_len = size;
+	if (!fstat(fd, &sb) && S_ISREG(sb.st_mode)) {
+		if (decompress_detect(fd) != DECOMPRESS_NONE) {
+			src->dc = decompress_open(fd);
+			if (!src->dc || source_file_size(fd, &file_size) < 0) {
+				decompress_close(src->dc);
+				free(src);
+				return NULL;
+			}
+		} else {
+			file_size = sb.st_size;
+		}
+
+		if (file_size <= offset)
+			src->data_len = 0;
+		else if (file_size - offset < size)
+			src->data_len = file_size - offset;
+	}
+
+	src->stream = source_is_stream(fd);
+	if (src->stream) {
+		src->carry = malloc(sector_size);
+		if (!src->carry) {
+			free(src);
+			return NULL;
+		}
+	}
+
+	if (src->dc || src->stream) {
+		source_thread_open(src);
+		return src;
+	}
+
+	/* Direct I/O only applies to the readers, not to the mapping */
+	if (source_want_direct(src))
+		source_direct_enable(src);
+
+	if (!source_queue_depth && !src->direct) {
+		ret = source_mmap_open(src);
+		if (!ret)
+			return src;
+	}
+
+	if (source_queue_depth) {
+		ret = source_uring_open(src);
+		if (!ret)
+			return src;
+	}
+
+	source_thread_open(src);
+
+	return src;
+}
+
+/**
+ * source_open_segments() - start reading an image made of segments
+ * @fd:		file descriptor of the image
+ * @segs:	segments, each a multiple of @sector_size
+ * @nsegs:	number of segments
+ * @sector_size: size of a sector, the unit of every chunk
+ * @chunk_size:	maximum size of each chunk delivered by source_next()
+ *
+ * The image is the concatenation of @segs, each either read from the file
+ * or filled with a 32-bit pattern. Chunks never straddle segments.
+ *
+ * Return: image source, or NULL on failure
+ */
+struct source *source_open_segments(int fd, const struct source_segment *segs, unsigned nsegs,
+				    unsigned sector_size, size_t chunk_size)
+{
+	struct source *src;
+	unsigned i;
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return NULL;
+
+	src->segs = malloc(nsegs * sizeof(*segs));
+	if (!src->segs) {
+		free(src);
+		return NULL;
+	}
+
+	memcpy(src->segs, segs, nsegs * sizeof(*segs));
+	src->nsegs = nsegs;
+
+	src->type = SOURCE_SEGMENTS;
+	src->fd = fd;
+	src->sector_size = sector_size;
+	src->chunk_size = chunk_size;
+
+	for (i = 0; i < nsegs; i++)
+		src->size += segs[i].len;
+
+	return src;
+}
+
+static ssize_t source_segments_next(struct source *src, const void **buf)
+{
+	const struct source_segment *seg;
+	uint32_t *fill;
+	ssize_t n;
+	size_t i;
+
+	while (src->seg < src->nsegs) {
+		seg = &src->segs[src->seg];
+
+		if (!seg->fill) {
+			if (!src->child) {
+				src->child = source_open(src->fd, seg->offset, seg->len,
+							 src->sector_size, src->chunk_size);
+				if (!src->child)
+					return -ENOMEM;
+			}
+
+			n = source_next(src->child, buf);
+			if (n)
+				return n;
+
+			source_close(src->child);
+			src->child = NULL;
+		} else if (src->seg_pos < seg->len) {
+			/*
+			 * Expand the pattern once, and serve every chunk of it from
+			 * there. A buffer still on loan is never rewritten, a new
+			 * pattern gets a buffer of its own.
+			 */
+			if (!src->fill || src->fill_pattern != seg->pattern) {
+				if (src->fill)
+					bufpool_put(src->fill);
+				src->fill = bufpool_get();
+
+				fill = src->fill;
+				for (i = 0; i < src->chunk_size / sizeof(*fill); i++)
+					fill[i] = seg->pattern;
+				src->fill_pattern = seg->pattern;
+			}
+
+			src->len = seg->len - src->seg_pos < src->chunk_size ?
+				   seg->len - src->seg_pos : src->chunk_size;
+			*buf = src->fill;
+
+			return src->len;
+		}
+
+		src->seg++;
+		src->seg_pos = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * source_next() - get the next chunk of the image
+ * @src:	image source
+ * @buf:	pointer to the chunk data
+ *
+ * The chunk remains valid until source_release() is called, which must
+ * happen before the next call to source_next(). Chunks may be shorter than
+ * the chunk size, but are always made of whole sectors.
+ *
+ * Return: length of the chunk, 0 at the end of the image, or negative errno
+ * on failure
+ */
+ssize_t source_next(struct source *src, const void **buf)
+{
+	switch (src->type) {
+	case SOURCE_MMAP:
+		return source_mmap_next(src, buf);
+	case SOURCE_THREAD:
+		return source_thread_next(src, buf);
+	case SOURCE_URING:
+		return source_uring_next(src, buf);
+	case SOURCE_SEGMENTS:
+		return source_segments_next(src, buf);
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * source_release() - hand the current chunk back to the source
+ * @src:	image source
+ */
+void source_release(struct source *src)
+{
+	unsigned tail;
+
+	switch (src->type) {
+	case SOURCE_MMAP:
+		src->pos += src->len;
+		src->len = 0;
+		break;
+	case SOURCE_THREAD:
+		tail = atomic_load_explicit(&src->tail, memory_order_relaxed);
+		src->pos += src->bufs[tail % SOURCE_BUFFERS].len;
+		bufpool_put(src->bufs[tail % SOURCE_BUFFERS].base);
+		atomic_store_explicit(&src->tail, tail + 1, memory_order_release);
+		source_wake(src);
+		break;
+	case SOURCE_URING:
+		source_uring_release(src);
+		break;
+	case SOURCE_SEGMENTS:
+		if (src->child) {
+			source_release(src->child);
+		} else {
+			src->seg_pos += src->len;
+			src->pos += src->len;
+		}
+		break;
+	}
+}
+
+/**
+ * source_close() - stop reading and free the image source
+ * @src:	image source
+ */
+void source_close(struct source *src)
+{
+	unsigned tail;
+	unsigned head;
+
+	if (!src)
+		return;
+
+	switch (src->type) {
+	case SOURCE_MMAP:
+		if (src->map)
+			munmap(src->map, src->map_len);
+		free(src->bounce);
+		if (src->zeros)
+			bufpool_put(src->zeros);
+		break;
+	case SOURCE_THREAD:
+		atomic_store(&src->stop, true);
+		source_wake(src);
+		pthread_join(src->thread, NULL);
+		pthread_cond_destroy(&src->cond);
+		pthread_mutex_destroy(&src->lock);
+
+		/* Return the chunks read ahead but never consumed */
+		head = atomic_load(&src->head);
+		for (tail = atomic_load(&src->tail); tail != head; tail++)
+			bufpool_put(src->bufs[tail % SOURCE_BUFFERS].base);
+		break;
+	case SOURCE_URING:
+		source_uring_free(src);
+		break;
+	case SOURCE_SEGMENTS:
+		source_close(src->child);
+		if (src->fill)
+			bufpool_put(src->fill);
+		free(src->segs);
+		break;
+	}
+
+	if (src->direct)
+		fcntl(src->fd, F_SETFL, src->fd_flags);
+
+	decompress_close(src->dc);
+	free(src->carry);
+	free(src);
+}
+
+/**
+ * source_is_zero() - check if a range of an image reads as zeros
+ * @fd:		file descriptor of the image
+ * @offset:	offset of the range
+ * @size:	length of the range, padded with zeros past the end of the image
+ * @sector_size: sector size of the range
+ *
+ * The range is read in chunks of the session's buffer pool, stopping at the
+ * first that isn't all zeros.
+ *
+ * Return: true if the range reads as zeros, false otherwise or on failure
+ */
+bool source_is_zero(int fd, off_t offset, uint64_t size, unsigned sector_size)
+{
+	struct source *src;
+	const void *buf;
+	size_t chunk_size;
+	ssize_t len;
+	bool zero = true;
+
+	chunk_size = (bufpool_size() - 2 * SOURCE_DIRECT_ALIGN) / sector_size * sector_size;
+
+	src = source_open(fd, offset, size, sector_size, chunk_size);
+	if (!src)
+		return false;
+
+	while (zero) {
+		len = source_next(src, &buf);
+		if (len <= 0) {
+			zero = !len;
+			break;
+		}
+
+		zero = is_zero_buffer(buf, len);
+		source_release(src);
+	}
+
+	source_close(src);
+
+	return zero;
+}
@@ -0,0 +1,48 @@
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct source;
+
+/* A part of an image, read from the file or filled with a pattern */
+struct source_segment {
+	uint64_t len;
+	off_t offset;
+	bool fill;
+	uint32_t pattern;
+};
+
+enum source_direct {
+	SOURCE_DIRECT_NEVER,
+	SOURCE_DIRECT_AUTO,
+	SOURCE_DIRECT_ALWAYS,
+};
+
+/* Each queued read holds a pool buffer of up to the max payload size */
+#define SOURCE_QUEUE_DEPTH_MAX	64
+
+extern unsigned source_queue_depth;
+extern enum source_direct source_direct;
+
+size_t source_buffer_size(size_t chunk_size);
+unsigned source_buffer_count(void);
+
+void source_uring_create(void);
+void source_uring_destroy(void);
+
+bool source_is_stream(int fd);
+bool source_is_zero(int fd, off_t offset, uint64_t size, unsigned sector_size);
+int source_file_size(int fd, uint64_t *size);
+struct source *source_open(int fd, off_t offset, uint64_t size,
+			   unsigned sector_size, size_t chunk_size);
+struct source *source_open_segments(int fd, const struct source_segment *segs, unsigned nsegs,
+				    unsigned sector_size, size_t chunk_size);
+ssize_t source_next(struct source *src, const void **buf);
+void source_release(struct source *src);
+void source_close(struct source *src);
+
+#endif
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qdl.h"
+#include "sparse.h"
+
+struct sparse_writer {
+	int fd;
+	unsigned blk_sz;
+
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	off_t offset;
+
+	/* The chunk currently being extended, its header is written on close */
+	uint16_t chunk_type;
+	uint32_t chunk_blks;
+	off_t chunk_offset;
+};
+
+static int sparse_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, offset);
+		if (n < 0)
+			return -errno;
+
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static int sparse_chunk_close(struct sparse_writer *sw)
+{
+	struct sparse_chunk_header chunk = {0};
+
+	if (!sw->chunk_type)
+		return 0;
+
+	chunk.chunk_type = sw->chunk_type;
+	chunk.chunk_sz = sw->chunk_blks;
+	chunk.total_sz = sizeof(chunk);
+	if (sw->chunk_type == CHUNK_TYPE_RAW)
+		chunk.total_sz += (uint64_t)sw->chunk_blks * sw->blk_sz;
+	else
+		chunk.total_sz += sizeof(uint32_t);
+
+	sw->chunk_type = 0;
+
+	return sparse_pwrite(sw->fd, &chunk, sizeof(chunk), sw->chunk_offset);
+}
+
+/* total_sz of a chunk is 32 bits, so long runs of data span several chunks */
+static bool sparse_chunk_full(struct sparse_writer *sw)
+{
+	uint64_t size = (uint64_t)(sw->chunk_blks + 1) * sw->blk_sz;
+
+	return sw->chunk_type == CHUNK_TYPE_RAW &&
+	       size > UINT32_MAX - sizeof(struct sparse_chunk_header);
+}
+
+static int sparse_chunk_open(struct sparse_writer *sw, uint16_t type)
+{
+	uint32_t pattern = 0;
+	int ret;
+
+	ret = sparse_chunk_close(sw);
+	if (ret < 0)
+		return ret;
+
+	sw->chunk_type = type;
+	sw->chunk_blks = 0;
+	sw->chunk_offset = sw->offset;
+	sw->total_chunks++;
+
+	sw->offset += sizeof(struct sparse_chunk_header);
+
+	/* Zero blocks are described by a FILL chunk with a zero pattern */
+	if (type == CHUNK_TYPE_FILL) {
+		ret = sparse_pwrite(sw->fd, &pattern, sizeof(pattern), sw->offset);
+		sw->offset += sizeof(pattern);
+	}
+
+	return ret;
+}
+
+/**
+ * sparse_writer_open() - start writing an Android sparse image
+ * @fd:		file descriptor of the output file
+ * @blk_sz:	block size of the image, must be a multiple of 4
+ *
+ * Return: sparse writer, or NULL on failure
+ */
+struct sparse_writer *sparse_writer_open(int fd, unsigned blk_sz)
+{
+	struct sparse_writer *sw;
+
+	if (!blk_sz || blk_sz % 4)
+		return NULL;
+
+	sw = calloc(1, sizeof(*sw));
+	if (!sw)
+		return NULL;
+
+	sw->fd = fd;
+	sw->blk_sz = blk_sz;
+	sw->offset = sizeof(struct sparse_header);
+
+	return sw;
+}
+
+/**
+ * sparse_writer_write() - append data to the sparse image
+ * @sw:		sparse writer
+ * @buf:	data to append
+ * @len:	length of @buf, must be a multiple of the block size
+ *
+ * Runs of zero blocks are stored as FILL chunks, everything else as RAW
+ * chunks. Chunks are extended across calls.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int sparse_writer_write(struct sparse_writer *sw, const void *buf, size_t len)
+{
+	const void *run = NULL;
+	size_t run_len = 0;
+	uint16_t type;
+	size_t i;
+	int ret;
+
+	if (len % sw->blk_sz)
+		return -EINVAL;
+
+	for (i = 0; i < len; i += sw->blk_sz) {
+		type = is_zero_buffer(buf + i, sw->blk_sz) ? CHUNK_TYPE_FILL : CHUNK_TYPE_RAW;
+
+		if (type != sw->chunk_type || sparse_chunk_full(sw)) {
+			if (run_len) {
+				ret = sparse_pwrite(sw->fd, run, run_len, sw->offset);
+				if (ret < 0)
+					return ret;
+				sw->offset += run_len;
+				run_len = 0;
+			}
+
+			ret = sparse_chunk_open(sw, type);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (type == CHUNK_TYPE_RAW) {
+			if (!run_len)
+				run = buf + i;
+			run_len += sw->blk_sz;
+		}
+
+		sw->chunk_blks++;
+		sw->total_blks++;
+	}
+
+	if (run_len) {
+		ret = sparse_pwrite(sw->fd, run, run_len, sw->offset);
+		if (ret < 0)
+			return ret;
+		sw->offset += run_len;
+	}
+
+	return 0;
+}
+
+/**
+ * sparse_writer_close() - finalize the sparse image
+ * @sw:		sparse writer, freed by this call
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int sparse_writer_close(struct sparse_writer *sw)
+{
+	struct sparse_header header = {0};
+	int ret;
+
+	ret = sparse_chunk_close(sw);
+	if (ret < 0)
+		goto out;
+
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(struct sparse_header);
+	header.chunk_hdr_sz = sizeof(struct sparse_chunk_header);
+	header.blk_sz = sw->blk_sz;
+	header.total_blks = sw->total_blks;
+	header.total_chunks = sw->total_chunks;
+
+	ret = sparse_pwrite(sw->fd, &header, sizeof(header), 0);
+	if (ret < 0)
+		goto out;
+
+	if (ftruncate(sw->fd, sw->offset) < 0)
+		ret = -errno;
+
+out:
+	free(sw);
+	return ret;
+}
+
+static int sparse_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, offset);
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			return -EINVAL;
+
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/**
+ * sparse_is_sparse() - check if a file holds a sparse image
+ * @fd:		file descriptor of the file
+ * @offset:	offset of the image in the file
+ *
+ * Return: true if a sparse image header is found at @offset
+ */
+bool sparse_is_sparse(int fd, off_t offset)
+{
+	uint32_t magic;
+
+	if (sparse_pread(fd, &magic, sizeof(magic), offset) < 0)
+		return false;
+
+	return magic == SPARSE_HEADER_MAGIC;
+}
+
+/**
+ * sparse_read_extents() - read the layout of a sparse image
+ * @fd:		file descriptor of the image
+ * @offset:	offset of the image in the file
+ * @blk_sz:	block size of the image
+ * @total_blks:	size of the expanded image, in blocks
+ * @extents:	allocated array of extents covering the expanded image
+ * @count:	number of extents
+ *
+ * Walks the chunk headers of the image, without reading its data, and
+ * describes each chunk as an extent of the expanded image. Adjacent fill and
+ * don't care chunks are merged; raw chunks, whose data is interleaved with
+ * chunk headers in the file, are not.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int sparse_read_extents(int fd, off_t offset, unsigned *blk_sz, uint64_t *total_blks,
+			struct sparse_extent **extents, unsigned *count)
+{
+	struct sparse_chunk_header chunk;
+	struct sparse_header header;
+	struct sparse_extent *ext;
+	struct sparse_extent *list = NULL;
+	enum sparse_extent_type type;
+	uint64_t block = 0;
+	unsigned size = 0;
+	unsigned n = 0;
+	uint32_t fill = 0;
+	uint64_t data;
+	unsigned i;
+	int ret;
+
+	ret = sparse_pread(fd, &header, sizeof(header), offset);
+	if (ret < 0)
+		return ret;
+
+	if (header.magic != SPARSE_HEADER_MAGIC || header.major_version != 1 ||
+	    header.file_hdr_sz < sizeof(header) || header.chunk_hdr_sz < sizeof(chunk) ||
+	    !header.blk_sz || header.blk_sz % 4)
+		return -EINVAL;
+
+	offset += header.file_hdr_sz;
+
+	for (i = 0; i < header.total_chunks; i++) {
+		ret = sparse_pread(fd, &chunk, sizeof(chunk), offset);
+		if (ret < 0)
+			goto err;
+
+		if (chunk.total_sz < header.chunk_hdr_sz)
+			goto invalid;
+
+		offset += header.chunk_hdr_sz;
+		data = chunk.total_sz - header.chunk_hdr_sz;
+
+		switch (chunk.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			type = SPARSE_EXTENT_RAW;
+			if (data != (uint64_t)chunk.chunk_sz * header.blk_sz)
+				goto invalid;
+			break;
+		case CHUNK_TYPE_FILL:
+			type = SPARSE_EXTENT_FILL;
+			if (data != sizeof(fill))
+				goto invalid;
+			ret = sparse_pread(fd, &fill, sizeof(fill), offset);
+			if (ret < 0)
+				goto err;
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			type = SPARSE_EXTENT_DONT_CARE;
+			if (data)
+				goto invalid;
+			break;
+		case CHUNK_TYPE_CRC32:
+			offset += data;
+			continue;
+		default:
+			goto invalid;
+		}
+
+		if (!chunk.chunk_sz) {
+			offset += data;
+			continue;
+		}
+
+		ext = n ? &list[n - 1] : NULL;
+		if (ext && type != SPARSE_EXTENT_RAW && ext->type == type &&
+		    (type == SPARSE_EXTENT_DONT_CARE || ext->fill == fill)) {
+			ext->blocks += chunk.chunk_sz;
+		} else {
+			if (n == size) {
+				size = size ? size * 2 : 64;
+				ext = realloc(list, size * sizeof(*list));
+				if (!ext) {
+					ret = -ENOMEM;
+					goto err;
+				}
+				list = ext;
+			}
+
+			ext = &list[n++];
+			ext->type = type;
+			ext->block = block;
+			ext->blocks = chunk.chunk_sz;
+			ext->offset = offset;
+			ext->fill = type == SPARSE_EXTENT_FILL ? fill : 0;
+		}
+
+		block += chunk.chunk_sz;
+		offset += data;
+	}
+
+	if (block != header.total_blks)
+		goto invalid;
+
+	*blk_sz = header.blk_sz;
+	*total_blks = header.total_blks;
+	*extents = list;
+	*count = n;
+
+	return 0;
+
+invalid:
+	ret = -EINVAL;
+err:
+	free(list);
+	return ret;
+}
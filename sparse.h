@@ -0,0 +1,63 @@
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Android sparse image format, as produced by img2simg */
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+
+#define CHUNK_TYPE_RAW		0xcac1
+#define CHUNK_TYPE_FILL		0xcac2
+#define CHUNK_TYPE_DONT_CARE	0xcac3
+#define CHUNK_TYPE_CRC32	0xcac4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+};
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;
+	uint32_t total_sz;
+};
+
+enum sparse_extent_type {
+	SPARSE_EXTENT_RAW,
+	SPARSE_EXTENT_FILL,
+	SPARSE_EXTENT_DONT_CARE,
+};
+
+/* A range of blocks of the expanded image */
+struct sparse_extent {
+	enum sparse_extent_type type;
+	uint64_t block;
+	uint64_t blocks;
+
+	/* offset of the data in the file, for raw extents */
+	off_t offset;
+	/* 32-bit fill pattern, for fill extents */
+	uint32_t fill;
+};
+
+struct sparse_writer;
+
+struct sparse_writer *sparse_writer_open(int fd, unsigned blk_sz);
+int sparse_writer_write(struct sparse_writer *sw, const void *buf, size_t len);
+int sparse_writer_close(struct sparse_writer *sw);
+
+bool sparse_is_sparse(int fd, off_t offset);
+int sparse_read_extents(int fd, off_t offset, unsigned *blk_sz, uint64_t *total_blks,
+			struct sparse_extent **extents, unsigned *count);
+
+#endif
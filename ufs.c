@@ -46,6 +46,8 @@ struct ufs_epilogue *ufs_epilogue_p;
 struct ufs_body *ufs_body_p;
 struct ufs_body *ufs_body_last;
 
+static bool ufs_provisioned;
+
 static const char notice_bconfigdescrlock[] = "\n"
 "Please pay attention that UFS provisioning is irreversible (OTP) operation unless parameter bConfigDescrLock = 0.\n"
 "In order to prevent unintentional device locking the tool has the following safety:\n\n"
@@ -59,7 +61,7 @@ static const char notice_bconfigdescrlock[] = "\n"
 
 bool ufs_need_provisioning(void)
 {
-	return !!ufs_epilogue_p;
+	return !!ufs_epilogue_p && !ufs_provisioned;
 }
 
 struct ufs_common *ufs_parse_common_params(xmlNode *node, bool finalize_provisioning)
@@ -306,5 +308,12 @@ int ufs_provisioning_execute(struct qdl_device *qdl,
 		if (ret)
 			return ret;
 	}
-	return apply_ufs_epilogue(qdl, ufs_epilogue_p, true);
+	ret = apply_ufs_epilogue(qdl, ufs_epilogue_p, true);
+	if (ret)
+		return ret;
+
+	/* Don't provision again if the session has to be restarted */
+	ufs_provisioned = true;
+
+	return 0;
 }
@@ -28,9 +28,14 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/stat.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -81,6 +86,101 @@ void print_hex_dump(const char *prefix, const void *buf, size_t len)
 	}
 }
 
+static bool is_zero_scalar(const uint8_t *ptr, size_t len)
+{
+	const uint64_t *words;
+	uint64_t acc;
+	size_t i;
+
+	/* Align to the word size, then test eight words at a time */
+	while (len && ((uintptr_t)ptr & (sizeof(uint64_t) - 1))) {
+		if (*ptr++)
+			return false;
+		len--;
+	}
+
+	words = (const uint64_t *)ptr;
+	for (i = 0; i + 8 <= len / sizeof(uint64_t); i += 8) {
+		acc = words[i] | words[i + 1] | words[i + 2] | words[i + 3] |
+		      words[i + 4] | words[i + 5] | words[i + 6] | words[i + 7];
+		if (acc)
+			return false;
+	}
+
+	for (i *= sizeof(uint64_t); i < len; i++) {
+		if (ptr[i])
+			return false;
+	}
+
+	return true;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const uint8_t *ptr, size_t len)
+{
+	__m256i acc;
+	size_t i;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		acc = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(ptr + i)),
+					_mm256_loadu_si256((const __m256i *)(ptr + i + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(ptr + i + 64)),
+					_mm256_loadu_si256((const __m256i *)(ptr + i + 96))));
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+	}
+
+	return is_zero_scalar(ptr + i, len - i);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static bool is_zero_neon(const uint8_t *ptr, size_t len)
+{
+	uint8x16_t acc;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		acc = vorrq_u8(vorrq_u8(vld1q_u8(ptr + i), vld1q_u8(ptr + i + 16)),
+			       vorrq_u8(vld1q_u8(ptr + i + 32), vld1q_u8(ptr + i + 48)));
+		if (vmaxvq_u8(acc))
+			return false;
+	}
+
+	return is_zero_scalar(ptr + i, len - i);
+}
+#endif
+
+/**
+ * is_zero_buffer() - check if a buffer contains only zeros
+ * @buf:	buffer to check
+ * @len:	length of @buf
+ *
+ * Uses AVX2 or NEON where available, testing a cache line or two per
+ * iteration and bailing out at the first one with any bit set.
+ */
+bool is_zero_buffer(const void *buf, size_t len)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	static int avx2 = -1;
+
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2");
+	if (avx2)
+		return is_zero_avx2(buf, len);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	return is_zero_neon(buf, len);
+#endif
+
+	return is_zero_scalar(buf, len);
+}
+
 unsigned attr_as_unsigned(xmlNode *node, const char *attr, int *errors)
 {
 	xmlChar *value;
@@ -109,3 +209,92 @@ const char *attr_as_string(xmlNode *node, const char *attr, int *errors)
 
 	return strdup((char*)value);
 }
+
+/**
+ * attr_as_bool() - parse an optional boolean attribute
+ * @node:	XML node
+ * @attr:	attribute name
+ *
+ * Return: true if the attribute is "true" or "1", false otherwise or if absent
+ */
+bool attr_as_bool(xmlNode *node, const char *attr)
+{
+	xmlChar *value;
+	bool ret;
+
+	value = xmlGetProp(node, (xmlChar*)attr);
+	if (!value)
+		return false;
+
+	ret = !xmlStrcasecmp(value, (xmlChar*)"true") || !xmlStrcmp(value, (xmlChar*)"1");
+	xmlFree(value);
+
+	return ret;
+}
+
+static int mkdir_parents(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -errno;
+		}
+		*p = '/';
+	}
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * state_path() - path of a file kept between sessions
+ * @name:	name of the file, characters other than alphanumerics, '-', '_'
+ *		and non-leading '.' are replaced
+ * @create:	create the directory of the file if missing
+ *
+ * The files are kept in $XDG_STATE_HOME/qdl, or ~/.local/state/qdl.
+ *
+ * Return: newly allocated path, or NULL if there's no place for the file
+ */
+char *state_path(const char *name, bool create)
+{
+	const char *state = getenv("XDG_STATE_HOME");
+	const char *home = getenv("HOME");
+	char dir[PATH_MAX];
+	char *path;
+	size_t len;
+	size_t i;
+
+	if (state && *state)
+		snprintf(dir, sizeof(dir), "%s/qdl", state);
+	else if (home && *home)
+		snprintf(dir, sizeof(dir), "%s/.local/state/qdl", home);
+	else
+		return NULL;
+
+	if (create && mkdir_parents(dir) < 0) {
+		fprintf(stderr, "unable to create %s\n", dir);
+		return NULL;
+	}
+
+	len = strlen(dir);
+	path = malloc(len + strlen(name) + 2);
+	if (!path)
+		return NULL;
+
+	sprintf(path, "%s/%s", dir, name);
+
+	/* Keep the name from escaping the directory */
+	for (i = len + 1; path[i]; i++) {
+		if (!isalnum(path[i]) && path[i] != '-' && path[i] != '_' &&
+		    (path[i] != '.' || i == len + 1))
+			path[i] = '_';
+	}
+
+	return path;
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sha256.h"
+#include "vip.h"
+#include "worker.h"
+
+/*
+ * Validated Image Programming (VIP) requires every packet sent to the
+ * programmer to be covered by a table of SHA-256 digests. The first table is
+ * signed and describes the first packets of the session, followed by the
+ * digest of the next table, which in turn describes the following packets
+ * and so on.
+ *
+ * As the signed table covers the entire chain, the tables are generated
+ * ahead of time by a dry run of the session (--create-digests), after which
+ * DigestsToSign.bin is signed offline and provided to the flashing session
+ * (--vip-digests) together with the chained tables.
+ *
+ * The packets depend on the max payload size negotiated with the programmer,
+ * so the size used by the dry run is stored along with the tables, for the
+ * flashing session to use the same.
+ */
+#define VIP_SIGNED_TABLE		"DigestsToSign.bin"
+#define VIP_SIGNED_TABLE_MBN		"DigestsToSign.bin.mbn"
+#define VIP_CHAINED_TABLE_FMT		"ChainedTableOfDigests%u.bin"
+#define VIP_PAYLOAD_SIZE		"MaxPayloadSize.txt"
+
+#define VIP_DIGESTS_PER_SIGNED_TABLE	53
+#define VIP_DIGESTS_PER_CHAINED_TABLE	255
+
+#define VIP_DIGESTS_PER_BLOCK		256
+
+static const char *vip_dir;
+static size_t vip_payload_size;
+static bool vip_started;
+static unsigned vip_packets_left;
+static unsigned vip_table_index;
+static void *vip_table;
+
+static struct worker_pool *vip_pool;
+static uint8_t **vip_blocks;
+static unsigned vip_nblocks;
+static unsigned vip_packets;
+
+/**
+ * vip_load() - enable VIP using the tables of digests in @dir
+ * @dir:	directory with the signed and chained tables of digests
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int vip_load(const char *dir)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, VIP_SIGNED_TABLE_MBN);
+	if (access(path, R_OK) < 0) {
+		fprintf(stderr, "[VIP] unable to access %s\n", path);
+		return -errno;
+	}
+
+	/* Digests created without a recorded size assume the default */
+	snprintf(path, sizeof(path), "%s/%s", dir, VIP_PAYLOAD_SIZE);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fscanf(fp, "%zu", &vip_payload_size) != 1 || !vip_payload_size) {
+			fprintf(stderr, "[VIP] invalid payload size in %s\n", path);
+			fclose(fp);
+			return -EINVAL;
+		}
+		fclose(fp);
+	}
+
+	vip_dir = dir;
+
+	return 0;
+}
+
+bool vip_enabled(void)
+{
+	return vip_dir || vip_pool;
+}
+
+/**
+ * vip_get_payload_size() - max payload size the digests were created for
+ *
+ * Return: payload size in bytes, or 0 if not recorded
+ */
+size_t vip_get_payload_size(void)
+{
+	return vip_payload_size;
+}
+
+/**
+ * vip_set_payload_size() - record the max payload size of the dry run
+ * @size:	payload size in bytes
+ */
+void vip_set_payload_size(size_t size)
+{
+	vip_payload_size = size;
+}
+
+static int vip_read_table(const char *name, size_t *len)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", vip_dir, name);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "[VIP] unable to open %s\n", path);
+		return -errno;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	free(vip_table);
+	vip_table = malloc(sb.st_size);
+	if (!vip_table)
+		err(1, "failed to allocate table of digests");
+
+	n = read(fd, vip_table, sb.st_size);
+	close(fd);
+	if (n != sb.st_size) {
+		fprintf(stderr, "[VIP] failed to read %s\n", path);
+		return -EIO;
+	}
+
+	*len = n;
+
+	return 0;
+}
+
+/**
+ * vip_next_table() - get the table of digests to send ahead of a packet
+ * @table:	pointer to the table, if one is to be sent
+ * @len:	length of @table
+ *
+ * Must be called once for every packet sent to the programmer.
+ *
+ * Return: 1 if @table should be sent before the packet, 0 if not, negative
+ * errno on failure
+ */
+int vip_next_table(const void **table, size_t *len)
+{
+	char name[64];
+	int ret = 0;
+
+	if (!vip_dir)
+		return 0;
+
+	if (!vip_started) {
+		ret = vip_read_table(VIP_SIGNED_TABLE_MBN, len);
+		vip_packets_left = VIP_DIGESTS_PER_SIGNED_TABLE;
+		vip_started = true;
+		ret = ret ? : 1;
+	} else if (!vip_packets_left) {
+		snprintf(name, sizeof(name), VIP_CHAINED_TABLE_FMT, vip_table_index++);
+		ret = vip_read_table(name, len);
+		vip_packets_left = VIP_DIGESTS_PER_CHAINED_TABLE;
+		ret = ret ? : 1;
+	}
+
+	vip_packets_left--;
+	*table = vip_table;
+
+	return ret;
+}
+
+struct vip_hash_job {
+	uint8_t *digest;
+	size_t len;
+	uint8_t data[];
+};
+
+static void vip_hash_packet(void *data)
+{
+	struct vip_hash_job *job = data;
+
+	sha256(job->data, job->len, job->digest);
+	free(job);
+}
+
+/**
+ * vip_gen_init() - start collecting digests of the session's packets
+ */
+void vip_gen_init(void)
+{
+	vip_pool = worker_pool_create(0);
+}
+
+bool vip_generating(void)
+{
+	return !!vip_pool;
+}
+
+/**
+ * vip_gen_packet() - record a packet sent to the programmer
+ * @buf:	packet data
+ * @len:	length of @buf
+ *
+ * The packet is hashed by the worker pool, the caller is free to reuse @buf
+ * upon return.
+ */
+void vip_gen_packet(const void *buf, size_t len)
+{
+	struct vip_hash_job *job;
+	unsigned block = vip_packets / VIP_DIGESTS_PER_BLOCK;
+
+	if (block == vip_nblocks) {
+		vip_blocks = realloc(vip_blocks, (vip_nblocks + 1) * sizeof(*vip_blocks));
+		if (!vip_blocks)
+			err(1, "failed to allocate digests");
+
+		vip_blocks[vip_nblocks] = malloc(VIP_DIGESTS_PER_BLOCK * SHA256_DIGEST_SIZE);
+		if (!vip_blocks[vip_nblocks])
+			err(1, "failed to allocate digests");
+		vip_nblocks++;
+	}
+
+	job = malloc(sizeof(*job) + len);
+	if (!job)
+		err(1, "failed to allocate digest job");
+
+	job->digest = vip_blocks[block] + (vip_packets % VIP_DIGESTS_PER_BLOCK) * SHA256_DIGEST_SIZE;
+	job->len = len;
+	memcpy(job->data, buf, len);
+
+	worker_pool_submit(vip_pool, vip_hash_packet, job);
+
+	vip_packets++;
+}
+
+static const uint8_t *vip_gen_digest(unsigned packet)
+{
+	return vip_blocks[packet / VIP_DIGESTS_PER_BLOCK] +
+	       (packet % VIP_DIGESTS_PER_BLOCK) * SHA256_DIGEST_SIZE;
+}
+
+static int vip_write_table(const char *dir, const char *name, unsigned first,
+			   unsigned count, const uint8_t *next, uint8_t *digest)
+{
+	struct sha256_ctx ctx;
+	char path[PATH_MAX];
+	FILE *fp;
+	unsigned i;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		fprintf(stderr, "[VIP] unable to create %s\n", path);
+		return -errno;
+	}
+
+	sha256_init(&ctx);
+	for (i = first; i < first + count; i++) {
+		fwrite(vip_gen_digest(i), SHA256_DIGEST_SIZE, 1, fp);
+		sha256_update(&ctx, vip_gen_digest(i), SHA256_DIGEST_SIZE);
+	}
+
+	if (next) {
+		fwrite(next, SHA256_DIGEST_SIZE, 1, fp);
+		sha256_update(&ctx, next, SHA256_DIGEST_SIZE);
+	}
+
+	sha256_final(&ctx, digest);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "[VIP] failed to write %s\n", path);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * vip_gen_finalize() - write the tables of digests of the session
+ * @dir:	output directory
+ *
+ * The tables are written last to first, as each table ends with the digest
+ * of the next one.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int vip_gen_finalize(const char *dir)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint8_t next[SHA256_DIGEST_SIZE];
+	unsigned nchained = 0;
+	unsigned remaining;
+	unsigned first;
+	unsigned count;
+	unsigned i;
+	char name[PATH_MAX];
+	FILE *fp;
+	int ret;
+
+	worker_pool_wait(vip_pool);
+	worker_pool_destroy(vip_pool);
+	vip_pool = NULL;
+
+	if (vip_packets > VIP_DIGESTS_PER_SIGNED_TABLE) {
+		remaining = vip_packets - VIP_DIGESTS_PER_SIGNED_TABLE;
+		nchained = (remaining + VIP_DIGESTS_PER_CHAINED_TABLE - 1) / VIP_DIGESTS_PER_CHAINED_TABLE;
+	}
+
+	for (i = nchained; i-- > 0;) {
+		first = VIP_DIGESTS_PER_SIGNED_TABLE + i * VIP_DIGESTS_PER_CHAINED_TABLE;
+		count = vip_packets - first;
+		if (count > VIP_DIGESTS_PER_CHAINED_TABLE)
+			count = VIP_DIGESTS_PER_CHAINED_TABLE;
+
+		snprintf(name, sizeof(name), VIP_CHAINED_TABLE_FMT, i);
+		ret = vip_write_table(dir, name, first, count,
+				      i + 1 < nchained ? next : NULL, digest);
+		if (ret < 0)
+			return ret;
+
+		memcpy(next, digest, SHA256_DIGEST_SIZE);
+	}
+
+	count = vip_packets < VIP_DIGESTS_PER_SIGNED_TABLE ? vip_packets : VIP_DIGESTS_PER_SIGNED_TABLE;
+	ret = vip_write_table(dir, VIP_SIGNED_TABLE, 0, count, nchained ? next : NULL, digest);
+	if (ret < 0)
+		return ret;
+
+	if (vip_payload_size) {
+		snprintf(name, sizeof(name), "%s/%s", dir, VIP_PAYLOAD_SIZE);
+		fp = fopen(name, "w");
+		if (!fp || fprintf(fp, "%zu\n", vip_payload_size) < 0 || fclose(fp)) {
+			fprintf(stderr, "[VIP] failed to write %s/%s\n", dir, VIP_PAYLOAD_SIZE);
+			return -EIO;
+		}
+	}
+
+	printf("[VIP] wrote digests of %u packets to %s, sign %s to complete\n",
+	       vip_packets, dir, VIP_SIGNED_TABLE);
+
+	return 0;
+}
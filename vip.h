@@ -0,0 +1,19 @@
+#ifndef __VIP_H__
+#define __VIP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int vip_load(const char *dir);
+int vip_next_table(const void **table, size_t *len);
+
+void vip_gen_init(void);
+bool vip_generating(void);
+void vip_gen_packet(const void *buf, size_t len);
+int vip_gen_finalize(const char *dir);
+
+bool vip_enabled(void);
+size_t vip_get_payload_size(void);
+void vip_set_payload_size(size_t size);
+
+#endif
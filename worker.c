@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+/*
+ * A worker is a single background thread executing one job at a time. It is
+ * used to overlap host side work, such as hashing or comparing a buffer, with
+ * the USB transfer of the same (read-only) buffer.
+ */
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	void (*fn)(void *arg);
+	void *arg;
+
+	bool busy;
+	bool exit;
+};
+
+static void *worker_thread(void *data)
+{
+	struct worker *worker = data;
+
+	pthread_mutex_lock(&worker->lock);
+	for (;;) {
+		while (!worker->busy && !worker->exit)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+
+		if (!worker->busy)
+			break;
+
+		pthread_mutex_unlock(&worker->lock);
+		worker->fn(worker->arg);
+		pthread_mutex_lock(&worker->lock);
+
+		worker->busy = false;
+		pthread_cond_broadcast(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+struct worker *worker_create(void)
+{
+	struct worker *worker;
+	int ret;
+
+	worker = calloc(1, sizeof(*worker));
+	if (!worker)
+		err(1, "failed to allocate worker");
+
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+
+	ret = pthread_create(&worker->thread, NULL, worker_thread, worker);
+	if (ret)
+		errx(1, "failed to create worker thread");
+
+	return worker;
+}
+
+void worker_destroy(struct worker *worker)
+{
+	if (!worker)
+		return;
+
+	pthread_mutex_lock(&worker->lock);
+	worker->exit = true;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_join(worker->thread, NULL);
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+	free(worker);
+}
+
+/**
+ * worker_submit() - hand a job to the worker
+ * @worker:	worker to run the job
+ * @fn:		job function
+ * @arg:	argument passed to @fn
+ *
+ * Waits for any previously submitted job to complete before queueing @fn.
+ */
+void worker_submit(struct worker *worker, void (*fn)(void *arg), void *arg)
+{
+	pthread_mutex_lock(&worker->lock);
+	while (worker->busy)
+		pthread_cond_wait(&worker->cond, &worker->lock);
+
+	worker->fn = fn;
+	worker->arg = arg;
+	worker->busy = true;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/**
+ * worker_wait() - wait for the submitted job to complete
+ * @worker:	worker to wait for
+ */
+void worker_wait(struct worker *worker)
+{
+	pthread_mutex_lock(&worker->lock);
+	while (worker->busy)
+		pthread_cond_wait(&worker->cond, &worker->lock);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * A worker pool runs independent jobs on a number of threads, with a bounded
+ * queue of jobs waiting to be picked up.
+ */
+struct worker_pool_job {
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct worker_pool {
+	pthread_t *threads;
+	unsigned nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct worker_pool_job *queue;
+	unsigned queue_size;
+	unsigned head;
+	unsigned count;
+	unsigned running;
+
+	bool exit;
+};
+
+static void *worker_pool_thread(void *data)
+{
+	struct worker_pool *pool = data;
+	struct worker_pool_job job;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->count && !pool->exit)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		if (!pool->count)
+			break;
+
+		job = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->queue_size;
+		pool->count--;
+		pool->running++;
+		pthread_cond_broadcast(&pool->cond);
+
+		pthread_mutex_unlock(&pool->lock);
+		job.fn(job.arg);
+		pthread_mutex_lock(&pool->lock);
+
+		pool->running--;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/**
+ * worker_pool_create() - create a pool of worker threads
+ * @threads:	number of threads, 0 to use one per online CPU
+ */
+struct worker_pool *worker_pool_create(unsigned threads)
+{
+	struct worker_pool *pool;
+	unsigned i;
+	long ncpus;
+	int ret;
+
+	if (!threads) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = ncpus > 0 ? ncpus : 1;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		err(1, "failed to allocate worker pool");
+
+	pool->nthreads = threads;
+	pool->queue_size = threads * 2;
+	pool->threads = calloc(threads, sizeof(*pool->threads));
+	pool->queue = calloc(pool->queue_size, sizeof(*pool->queue));
+	if (!pool->threads || !pool->queue)
+		err(1, "failed to allocate worker pool");
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (i = 0; i < threads; i++) {
+		ret = pthread_create(&pool->threads[i], NULL, worker_pool_thread, pool);
+		if (ret)
+			errx(1, "failed to create worker thread");
+	}
+
+	return pool;
+}
+
+void worker_pool_destroy(struct worker_pool *pool)
+{
+	unsigned i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->exit = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->queue);
+	free(pool);
+}
+
+/**
+ * worker_pool_submit() - queue a job on the pool
+ * @pool:	worker pool
+ * @fn:		job function
+ * @arg:	argument passed to @fn
+ *
+ * Blocks while the queue is full, which bounds the amount of work, and
+ * memory, in flight.
+ */
+void worker_pool_submit(struct worker_pool *pool, void (*fn)(void *arg), void *arg)
+{
+	unsigned tail;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == pool->queue_size)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+
+	tail = (pool->head + pool->count) % pool->queue_size;
+	pool->queue[tail].fn = fn;
+	pool->queue[tail].arg = arg;
+	pool->count++;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * worker_pool_wait() - wait for all queued jobs to complete
+ * @pool:	worker pool
+ */
+void worker_pool_wait(struct worker_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count || pool->running)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
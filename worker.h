@@ -0,0 +1,17 @@
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+struct worker;
+struct worker_pool;
+
+struct worker *worker_create(void);
+void worker_destroy(struct worker *worker);
+void worker_submit(struct worker *worker, void (*fn)(void *arg), void *arg);
+void worker_wait(struct worker *worker);
+
+struct worker_pool *worker_pool_create(unsigned threads);
+void worker_pool_destroy(struct worker_pool *pool);
+void worker_pool_submit(struct worker_pool *pool, void (*fn)(void *arg), void *arg);
+void worker_pool_wait(struct worker_pool *pool);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2019, The qdl contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+
+#include "xxhash.h"
+
+#define XXH64_P1	0x9e3779b185ebca87ULL
+#define XXH64_P2	0xc2b2ae3d27d4eb4fULL
+#define XXH64_P3	0x165667b19e3779f9ULL
+#define XXH64_P4	0x85ebca77c2b2ae63ULL
+#define XXH64_P5	0x27d4eb2f165667c5ULL
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t xxh64_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+
+	return v;
+}
+
+static uint32_t xxh64_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+
+	return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH64_P2;
+	acc = ROL(acc, 31);
+
+	return acc * XXH64_P1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= xxh64_round(0, v);
+
+	return acc * XXH64_P1 + XXH64_P4;
+}
+
+static void xxh64_stripe(uint64_t v[4], const uint8_t *p)
+{
+	v[0] = xxh64_round(v[0], xxh64_read64(p));
+	v[1] = xxh64_round(v[1], xxh64_read64(p + 8));
+	v[2] = xxh64_round(v[2], xxh64_read64(p + 16));
+	v[3] = xxh64_round(v[3], xxh64_read64(p + 24));
+}
+
+void xxh64_init(struct xxh64_ctx *ctx, uint64_t seed)
+{
+	ctx->v[0] = seed + XXH64_P1 + XXH64_P2;
+	ctx->v[1] = seed + XXH64_P2;
+	ctx->v[2] = seed;
+	ctx->v[3] = seed - XXH64_P1;
+	ctx->seed = seed;
+	ctx->count = 0;
+}
+
+void xxh64_update(struct xxh64_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	size_t fill = ctx->count % XXH64_STRIPE_SIZE;
+	size_t n;
+
+	ctx->count += len;
+
+	if (fill) {
+		n = XXH64_STRIPE_SIZE - fill;
+		if (len < n) {
+			memcpy(ctx->buf + fill, ptr, len);
+			return;
+		}
+
+		memcpy(ctx->buf + fill, ptr, n);
+		xxh64_stripe(ctx->v, ctx->buf);
+		ptr += n;
+		len -= n;
+	}
+
+	for (; len >= XXH64_STRIPE_SIZE; len -= XXH64_STRIPE_SIZE, ptr += XXH64_STRIPE_SIZE)
+		xxh64_stripe(ctx->v, ptr);
+
+	memcpy(ctx->buf, ptr, len);
+}
+
+uint64_t xxh64_final(struct xxh64_ctx *ctx)
+{
+	size_t len = ctx->count % XXH64_STRIPE_SIZE;
+	const uint8_t *p = ctx->buf;
+	uint64_t h;
+
+	if (ctx->count >= XXH64_STRIPE_SIZE) {
+		h = ROL(ctx->v[0], 1) + ROL(ctx->v[1], 7) +
+		    ROL(ctx->v[2], 12) + ROL(ctx->v[3], 18);
+		h = xxh64_merge(h, ctx->v[0]);
+		h = xxh64_merge(h, ctx->v[1]);
+		h = xxh64_merge(h, ctx->v[2]);
+		h = xxh64_merge(h, ctx->v[3]);
+	} else {
+		h = ctx->seed + XXH64_P5;
+	}
+
+	h += ctx->count;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		h ^= xxh64_round(0, xxh64_read64(p));
+		h = ROL(h, 27) * XXH64_P1 + XXH64_P4;
+	}
+
+	if (len >= 4) {
+		h ^= (uint64_t)xxh64_read32(p) * XXH64_P1;
+		h = ROL(h, 23) * XXH64_P2 + XXH64_P3;
+		len -= 4;
+		p += 4;
+	}
+
+	for (; len; len--, p++) {
+		h ^= *p * XXH64_P5;
+		h = ROL(h, 11) * XXH64_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH64_P2;
+	h ^= h >> 29;
+	h *= XXH64_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	struct xxh64_ctx ctx;
+
+	xxh64_init(&ctx, seed);
+	xxh64_update(&ctx, data, len);
+
+	return xxh64_final(&ctx);
+}
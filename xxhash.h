@@ -0,0 +1,25 @@
+#ifndef __XXHASH_H__
+#define __XXHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XXH64_STRIPE_SIZE	32
+
+/*
+ * XXH64, a fast non-cryptographic hash, for telling apart image contents
+ * where the cost of SHA-256 would limit the rate of programming
+ */
+struct xxh64_ctx {
+	uint64_t v[4];
+	uint64_t seed;
+	uint64_t count;
+	uint8_t buf[XXH64_STRIPE_SIZE];
+};
+
+void xxh64_init(struct xxh64_ctx *ctx, uint64_t seed);
+void xxh64_update(struct xxh64_ctx *ctx, const void *data, size_t len);
+uint64_t xxh64_final(struct xxh64_ctx *ctx);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif